@@ -29,11 +29,21 @@ using std::experimental::optional;
 
 namespace py = pybind11;
 
+// ~DiskPlotter() waits for the plots still being copied in the background, so
+// it's called without the GIL
+struct DiskPlotterDeleter {
+    void operator()(DiskPlotter *dp) const
+    {
+        py::gil_scoped_release release;
+        delete dp;
+    }
+};
+
 PYBIND11_MODULE(chiapos, m)
 {
     m.doc() = "Chia Proof of Space";
 
-    py::class_<DiskPlotter>(m, "DiskPlotter")
+    py::class_<DiskPlotter, std::unique_ptr<DiskPlotter, DiskPlotterDeleter>>(m, "DiskPlotter")
         .def(py::init<>())
         .def(
             "create_plot_disk",
@@ -49,7 +59,9 @@ PYBIND11_MODULE(chiapos, m)
                uint32_t num_buckets,
                uint32_t stripe_size,
                uint8_t num_threads,
-               bool nobitfield) {
+               bool nobitfield,
+               bool background_copy,
+               uint32_t copy_megabytes_per_second) {
                 std::string memo_str(memo);
                 const uint8_t *memo_ptr = reinterpret_cast<const uint8_t *>(memo_str.data());
                 std::string id_str(id);
@@ -68,11 +80,35 @@ PYBIND11_MODULE(chiapos, m)
                                       num_buckets,
                                       stripe_size,
                                       num_threads,
-                                      nobitfield ? 0 : ENABLE_BITFIELD);
+                                      nobitfield ? 0 : ENABLE_BITFIELD,
+                                      0,
+                                      copy_megabytes_per_second,
+                                      background_copy);
                 } catch (const std::exception &e) {
                     std::cout << "Caught plotting error: " << e.what() << std::endl;
                     throw e;
                 }
+            },
+            py::arg("tmp_dir"),
+            py::arg("tmp2_dir"),
+            py::arg("final_dir"),
+            py::arg("filename"),
+            py::arg("k"),
+            py::arg("memo"),
+            py::arg("id"),
+            py::arg("buffmegabytes"),
+            py::arg("num_buckets"),
+            py::arg("stripe_size"),
+            py::arg("num_threads"),
+            py::arg("nobitfield"),
+            py::arg("background_copy") = false,
+            py::arg("copy_megabytes_per_second") = 0)
+        .def("pending_copies", [](DiskPlotter &dp) { return dp.PendingCopies(); })
+        .def(
+            "wait_for_copies",
+            [](DiskPlotter &dp) {
+                py::gil_scoped_release release;
+                dp.WaitForCopies();
             });
 
     py::class_<DiskProver>(m, "DiskProver")
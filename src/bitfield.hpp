@@ -14,6 +14,7 @@
 
 #pragma once
 
+#include <atomic>
 #include <memory>
 
 struct bitfield
@@ -31,6 +32,19 @@ struct bitfield
         buffer_[bit / 64] |= uint64_t(1) << (bit % 64);
     }
 
+    // Like set(), but may be called from several threads at once
+    void set_concurrent(int64_t const bit)
+    {
+        assert(bit / 64 < size_);
+        static_assert(sizeof(std::atomic<uint64_t>) == sizeof(uint64_t), "");
+        auto& word = reinterpret_cast<std::atomic<uint64_t>*>(buffer_.get())[bit / 64];
+        uint64_t const mask = uint64_t(1) << (bit % 64);
+        // skip the locked write if the bit is already set
+        if ((word.load(std::memory_order_relaxed) & mask) == 0) {
+            word.fetch_or(mask, std::memory_order_relaxed);
+        }
+    }
+
     bool get(int64_t const bit) const
     {
         assert(bit / 64 < size_);
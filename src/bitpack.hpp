@@ -0,0 +1,119 @@
+// Copyright 2018 Chia Network Inc
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//    http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SRC_CPP_BITPACK_HPP_
+#define SRC_CPP_BITPACK_HPP_
+
+#include <algorithm>
+#include <cstring>
+
+#include "util.hpp"
+
+// Packs fixed size, big endian entries, of which only the first bits bits are
+// used, back to back into a bit stream, and unpacks them again. The entries are
+// moved 7 bytes at a time, through a 64 bit accumulator.
+namespace BitPack {
+
+    // Bits moved per step. The bits left in the accumulator (at most 7) and a
+    // step always fit in 64 bits
+    const uint32_t kStepBits = 56;
+
+    inline uint64_t PackedSize(uint64_t const num_entries, uint32_t const bits)
+    {
+        return cdiv(num_entries * bits, 8);
+    }
+
+    // Loads 8 bytes of entry, starting at byte. Bytes past entry_len read as 0
+    inline uint64_t LoadPartial(const uint8_t *entry, uint32_t const entry_len, uint32_t const byte)
+    {
+        uint8_t word[8] = {0};
+        memcpy(word, entry + byte, std::min<uint32_t>(8, entry_len - byte));
+        return Util::EightBytesToInt(word);
+    }
+
+    // Writes PackedSize(num_entries, bits) bytes to dst. src is only read up
+    // to the end of the last entry, but dst needs 7 bytes of head-room
+    inline void Pack(
+        uint8_t *dst,
+        const uint8_t *src,
+        uint32_t const entry_len,
+        uint32_t const bits,
+        uint64_t const num_entries)
+    {
+        const uint8_t *const src_end = src + num_entries * entry_len;
+        uint64_t acc = 0;
+        uint32_t acc_bits = 0;
+        for (uint64_t i = 0; i < num_entries; i++) {
+            const uint8_t *entry = src + i * entry_len;
+            for (uint32_t bit = 0; bit < bits; bit += kStepBits) {
+                uint32_t const n = std::min(kStepBits, bits - bit);
+                uint64_t word = entry + bit / 8 + 8 > src_end
+                                    ? LoadPartial(entry, entry_len, bit / 8)
+                                    : Util::EightBytesToInt(entry + bit / 8);
+                word &= ~uint64_t(0) << (64 - n);
+                acc |= word >> acc_bits;
+                acc_bits += n;
+                uint32_t const full_bytes = acc_bits / 8;
+                Util::IntToEightBytes(dst, acc);
+                dst += full_bytes;
+                acc <<= full_bytes * 8;
+                acc_bits -= full_bytes * 8;
+            }
+        }
+        if (acc_bits > 0) {
+            *dst = acc >> 56;
+        }
+    }
+
+    // Unpacks num_entries entries, starting at bit src_bit of src, into
+    // entries of entry_len bytes. The bits after the first bits bits of each
+    // entry are set to 0. Exactly num_entries * entry_len bytes are written to
+    // dst, but src needs 7 bytes of head-room
+    inline void Unpack(
+        uint8_t *dst,
+        const uint8_t *src,
+        uint64_t src_bit,
+        uint32_t const entry_len,
+        uint32_t const bits,
+        uint64_t const num_entries)
+    {
+        uint8_t *const dst_end = dst + num_entries * entry_len;
+        // The steps write 8 bytes each, the last one ending at zero_from
+        uint32_t const zero_from = (bits - 1) / kStepBits * (kStepBits / 8) + 8;
+        for (uint64_t i = 0; i < num_entries; i++) {
+            uint8_t *entry = dst + i * entry_len;
+            for (uint32_t bit = 0; bit < bits; bit += kStepBits) {
+                uint32_t const n = std::min(kStepBits, bits - bit);
+                uint64_t word = Util::EightBytesToInt(src + src_bit / 8) << (src_bit % 8);
+                word &= ~uint64_t(0) << (64 - n);
+                src_bit += n;
+                uint32_t const byte = bit / 8;
+                if (entry + byte + 8 > dst_end) {
+                    // Near the end, the step is assembled on the side, so
+                    // nothing is written past dst_end
+                    uint8_t tail[8];
+                    Util::IntToEightBytes(tail, word);
+                    memcpy(entry + byte, tail, entry_len - byte);
+                } else {
+                    Util::IntToEightBytes(entry + byte, word);
+                }
+            }
+            if (zero_from < entry_len) {
+                memset(entry + zero_from, 0, entry_len - zero_from);
+            }
+        }
+    }
+}
+
+#endif  // SRC_CPP_BITPACK_HPP_
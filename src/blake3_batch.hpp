@@ -0,0 +1,397 @@
+// Copyright 2018 Chia Network Inc
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//    http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SRC_CPP_BLAKE3_BATCH_HPP_
+#define SRC_CPP_BLAKE3_BATCH_HPP_
+
+#include <stdint.h>
+#include <string.h>
+
+#include "util.hpp"
+
+// Hashes many messages of the same length, each fitting in a single 64 byte
+// BLAKE3 block, several messages at a time. This is what the f functions of
+// tables 2-7 need. blake3_hash_many() in src/b3 can't be used for this, since
+// its kernels always compress full 64 byte blocks, and the block length is
+// part of the hash.
+//
+// The input is a flat array of 64 byte blocks, one per message, each holding
+// 'block_len' bytes of message followed by zeros. The output is the 32 byte
+// hash of each message.
+namespace Blake3Batch {
+
+    const uint32_t kIV[8] = {
+        0x6A09E667UL,
+        0xBB67AE85UL,
+        0x3C6EF372UL,
+        0xA54FF53AUL,
+        0x510E527FUL,
+        0x9B05688CUL,
+        0x1F83D9ABUL,
+        0x5BE0CD19UL};
+
+    const uint8_t kMsgSchedule[7][16] = {
+        {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+        {2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8},
+        {3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1},
+        {10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6},
+        {12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4},
+        {9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7},
+        {11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13},
+    };
+
+    // A single block message is both the start and the end of the root chunk
+    // (CHUNK_START | CHUNK_END | ROOT)
+    const uint32_t kFlags = 1 | 2 | 8;
+
+    const uint32_t kBlockLen = 64;
+    const uint32_t kOutLen = 32;
+
+    inline uint32_t RotR(uint32_t const w, uint32_t const c) { return (w >> c) | (w << (32 - c)); }
+
+    inline void HashPortable(
+        const uint8_t *blocks,
+        uint64_t const num_blocks,
+        uint8_t const block_len,
+        uint8_t *out)
+    {
+        for (uint64_t n = 0; n < num_blocks; n++) {
+            uint32_t m[16];
+            for (uint32_t i = 0; i < 16; i++) {
+                const uint8_t *p = blocks + n * kBlockLen + 4 * i;
+                m[i] = (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) |
+                       ((uint32_t)p[3] << 24);
+            }
+            uint32_t v[16] = {
+                kIV[0], kIV[1], kIV[2], kIV[3], kIV[4], kIV[5], kIV[6], kIV[7],
+                kIV[0], kIV[1], kIV[2], kIV[3], 0, 0, block_len, kFlags};
+
+            auto g = [&v](int a, int b, int c, int d, uint32_t x, uint32_t y) {
+                v[a] = v[a] + v[b] + x;
+                v[d] = RotR(v[d] ^ v[a], 16);
+                v[c] = v[c] + v[d];
+                v[b] = RotR(v[b] ^ v[c], 12);
+                v[a] = v[a] + v[b] + y;
+                v[d] = RotR(v[d] ^ v[a], 8);
+                v[c] = v[c] + v[d];
+                v[b] = RotR(v[b] ^ v[c], 7);
+            };
+            for (uint32_t r = 0; r < 7; r++) {
+                const uint8_t *s = kMsgSchedule[r];
+                g(0, 4, 8, 12, m[s[0]], m[s[1]]);
+                g(1, 5, 9, 13, m[s[2]], m[s[3]]);
+                g(2, 6, 10, 14, m[s[4]], m[s[5]]);
+                g(3, 7, 11, 15, m[s[6]], m[s[7]]);
+                g(0, 5, 10, 15, m[s[8]], m[s[9]]);
+                g(1, 6, 11, 12, m[s[10]], m[s[11]]);
+                g(2, 7, 8, 13, m[s[12]], m[s[13]]);
+                g(3, 4, 9, 14, m[s[14]], m[s[15]]);
+            }
+            for (uint32_t i = 0; i < 8; i++) {
+                uint32_t const w = v[i] ^ v[i + 8];
+                uint8_t *p = out + n * kOutLen + 4 * i;
+                p[0] = w;
+                p[1] = w >> 8;
+                p[2] = w >> 16;
+                p[3] = w >> 24;
+            }
+        }
+    }
+
+#if defined(_WIN32) || defined(__x86_64__)
+
+    // 4 lanes. SSE2 is part of the x86-64 baseline, so this needs no checks
+    inline __m128i RotR128(__m128i const w, int const c)
+    {
+        return _mm_or_si128(_mm_srli_epi32(w, c), _mm_slli_epi32(w, 32 - c));
+    }
+
+    inline void G128(__m128i *v, int a, int b, int c, int d, __m128i const x, __m128i const y)
+    {
+        v[a] = _mm_add_epi32(_mm_add_epi32(v[a], v[b]), x);
+        v[d] = RotR128(_mm_xor_si128(v[d], v[a]), 16);
+        v[c] = _mm_add_epi32(v[c], v[d]);
+        v[b] = RotR128(_mm_xor_si128(v[b], v[c]), 12);
+        v[a] = _mm_add_epi32(_mm_add_epi32(v[a], v[b]), y);
+        v[d] = RotR128(_mm_xor_si128(v[d], v[a]), 8);
+        v[c] = _mm_add_epi32(v[c], v[d]);
+        v[b] = RotR128(_mm_xor_si128(v[b], v[c]), 7);
+    }
+
+    inline void Transpose4x4(__m128i *r)
+    {
+        __m128i const t0 = _mm_unpacklo_epi32(r[0], r[1]);
+        __m128i const t1 = _mm_unpacklo_epi32(r[2], r[3]);
+        __m128i const t2 = _mm_unpackhi_epi32(r[0], r[1]);
+        __m128i const t3 = _mm_unpackhi_epi32(r[2], r[3]);
+        r[0] = _mm_unpacklo_epi64(t0, t1);
+        r[1] = _mm_unpackhi_epi64(t0, t1);
+        r[2] = _mm_unpacklo_epi64(t2, t3);
+        r[3] = _mm_unpackhi_epi64(t2, t3);
+    }
+
+    inline void HashSSE2(
+        const uint8_t *blocks,
+        uint64_t const num_blocks,
+        uint8_t const block_len,
+        uint8_t *out)
+    {
+        uint64_t n = 0;
+        for (; n + 4 <= num_blocks; n += 4) {
+            const uint8_t *in = blocks + n * kBlockLen;
+            __m128i m[16];
+            for (int w = 0; w < 16; w += 4) {
+                for (int lane = 0; lane < 4; lane++) {
+                    m[w + lane] =
+                        _mm_loadu_si128((const __m128i *)(in + lane * kBlockLen + w * 4));
+                }
+                Transpose4x4(m + w);
+            }
+            __m128i v[16];
+            for (int i = 0; i < 8; i++) {
+                v[i] = _mm_set1_epi32(kIV[i]);
+            }
+            for (int i = 0; i < 4; i++) {
+                v[8 + i] = _mm_set1_epi32(kIV[i]);
+            }
+            v[12] = _mm_setzero_si128();
+            v[13] = _mm_setzero_si128();
+            v[14] = _mm_set1_epi32(block_len);
+            v[15] = _mm_set1_epi32(kFlags);
+            for (int r = 0; r < 7; r++) {
+                const uint8_t *s = kMsgSchedule[r];
+                G128(v, 0, 4, 8, 12, m[s[0]], m[s[1]]);
+                G128(v, 1, 5, 9, 13, m[s[2]], m[s[3]]);
+                G128(v, 2, 6, 10, 14, m[s[4]], m[s[5]]);
+                G128(v, 3, 7, 11, 15, m[s[6]], m[s[7]]);
+                G128(v, 0, 5, 10, 15, m[s[8]], m[s[9]]);
+                G128(v, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+                G128(v, 2, 7, 8, 13, m[s[12]], m[s[13]]);
+                G128(v, 3, 4, 9, 14, m[s[14]], m[s[15]]);
+            }
+            for (int i = 0; i < 8; i++) {
+                v[i] = _mm_xor_si128(v[i], v[i + 8]);
+            }
+            Transpose4x4(v);
+            Transpose4x4(v + 4);
+            for (int lane = 0; lane < 4; lane++) {
+                uint8_t *o = out + (n + lane) * kOutLen;
+                _mm_storeu_si128((__m128i *)o, v[lane]);
+                _mm_storeu_si128((__m128i *)(o + 16), v[4 + lane]);
+            }
+        }
+        HashPortable(blocks + n * kBlockLen, num_blocks - n, block_len, out + n * kOutLen);
+    }
+
+    // 8 lanes
+    TARGET_AVX2 inline __m256i RotR256(__m256i const w, int const c)
+    {
+        return _mm256_or_si256(_mm256_srli_epi32(w, c), _mm256_slli_epi32(w, 32 - c));
+    }
+
+    TARGET_AVX2 inline void G256(
+        __m256i *v,
+        int a,
+        int b,
+        int c,
+        int d,
+        __m256i const x,
+        __m256i const y)
+    {
+        v[a] = _mm256_add_epi32(_mm256_add_epi32(v[a], v[b]), x);
+        v[d] = RotR256(_mm256_xor_si256(v[d], v[a]), 16);
+        v[c] = _mm256_add_epi32(v[c], v[d]);
+        v[b] = RotR256(_mm256_xor_si256(v[b], v[c]), 12);
+        v[a] = _mm256_add_epi32(_mm256_add_epi32(v[a], v[b]), y);
+        v[d] = RotR256(_mm256_xor_si256(v[d], v[a]), 8);
+        v[c] = _mm256_add_epi32(v[c], v[d]);
+        v[b] = RotR256(_mm256_xor_si256(v[b], v[c]), 7);
+    }
+
+    TARGET_AVX2 inline void Transpose8x8(__m256i *r)
+    {
+        __m256i const t0 = _mm256_unpacklo_epi32(r[0], r[1]);
+        __m256i const t1 = _mm256_unpackhi_epi32(r[0], r[1]);
+        __m256i const t2 = _mm256_unpacklo_epi32(r[2], r[3]);
+        __m256i const t3 = _mm256_unpackhi_epi32(r[2], r[3]);
+        __m256i const t4 = _mm256_unpacklo_epi32(r[4], r[5]);
+        __m256i const t5 = _mm256_unpackhi_epi32(r[4], r[5]);
+        __m256i const t6 = _mm256_unpacklo_epi32(r[6], r[7]);
+        __m256i const t7 = _mm256_unpackhi_epi32(r[6], r[7]);
+        __m256i const u0 = _mm256_unpacklo_epi64(t0, t2);
+        __m256i const u1 = _mm256_unpackhi_epi64(t0, t2);
+        __m256i const u2 = _mm256_unpacklo_epi64(t1, t3);
+        __m256i const u3 = _mm256_unpackhi_epi64(t1, t3);
+        __m256i const u4 = _mm256_unpacklo_epi64(t4, t6);
+        __m256i const u5 = _mm256_unpackhi_epi64(t4, t6);
+        __m256i const u6 = _mm256_unpacklo_epi64(t5, t7);
+        __m256i const u7 = _mm256_unpackhi_epi64(t5, t7);
+        r[0] = _mm256_permute2x128_si256(u0, u4, 0x20);
+        r[1] = _mm256_permute2x128_si256(u1, u5, 0x20);
+        r[2] = _mm256_permute2x128_si256(u2, u6, 0x20);
+        r[3] = _mm256_permute2x128_si256(u3, u7, 0x20);
+        r[4] = _mm256_permute2x128_si256(u0, u4, 0x31);
+        r[5] = _mm256_permute2x128_si256(u1, u5, 0x31);
+        r[6] = _mm256_permute2x128_si256(u2, u6, 0x31);
+        r[7] = _mm256_permute2x128_si256(u3, u7, 0x31);
+    }
+
+    TARGET_AVX2 inline void HashAVX2(
+        const uint8_t *blocks,
+        uint64_t const num_blocks,
+        uint8_t const block_len,
+        uint8_t *out)
+    {
+        uint64_t n = 0;
+        for (; n + 8 <= num_blocks; n += 8) {
+            const uint8_t *in = blocks + n * kBlockLen;
+            __m256i m[16];
+            for (int w = 0; w < 16; w += 8) {
+                for (int lane = 0; lane < 8; lane++) {
+                    m[w + lane] =
+                        _mm256_loadu_si256((const __m256i *)(in + lane * kBlockLen + w * 4));
+                }
+                Transpose8x8(m + w);
+            }
+            __m256i v[16];
+            for (int i = 0; i < 8; i++) {
+                v[i] = _mm256_set1_epi32(kIV[i]);
+            }
+            for (int i = 0; i < 4; i++) {
+                v[8 + i] = _mm256_set1_epi32(kIV[i]);
+            }
+            v[12] = _mm256_setzero_si256();
+            v[13] = _mm256_setzero_si256();
+            v[14] = _mm256_set1_epi32(block_len);
+            v[15] = _mm256_set1_epi32(kFlags);
+            for (int r = 0; r < 7; r++) {
+                const uint8_t *s = kMsgSchedule[r];
+                G256(v, 0, 4, 8, 12, m[s[0]], m[s[1]]);
+                G256(v, 1, 5, 9, 13, m[s[2]], m[s[3]]);
+                G256(v, 2, 6, 10, 14, m[s[4]], m[s[5]]);
+                G256(v, 3, 7, 11, 15, m[s[6]], m[s[7]]);
+                G256(v, 0, 5, 10, 15, m[s[8]], m[s[9]]);
+                G256(v, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+                G256(v, 2, 7, 8, 13, m[s[12]], m[s[13]]);
+                G256(v, 3, 4, 9, 14, m[s[14]], m[s[15]]);
+            }
+            for (int i = 0; i < 8; i++) {
+                v[i] = _mm256_xor_si256(v[i], v[i + 8]);
+            }
+            Transpose8x8(v);
+            for (int lane = 0; lane < 8; lane++) {
+                _mm256_storeu_si256((__m256i *)(out + (n + lane) * kOutLen), v[lane]);
+            }
+        }
+        HashSSE2(blocks + n * kBlockLen, num_blocks - n, block_len, out + n * kOutLen);
+    }
+
+    // 16 lanes. The message words are gathered and the hashes scattered,
+    // rather than transposing 16x16 words. The zero-masking forms of the
+    // intrinsics are used with every lane set: the plain ones start from an
+    // undefined vector, which GCC warns may be used uninitialized.
+    TARGET_AVX512 inline void G512(
+        __m512i *v,
+        int a,
+        int b,
+        int c,
+        int d,
+        __m512i const x,
+        __m512i const y)
+    {
+        v[a] = _mm512_add_epi32(_mm512_add_epi32(v[a], v[b]), x);
+        v[d] = _mm512_maskz_ror_epi32(0xFFFF, _mm512_xor_si512(v[d], v[a]), 16);
+        v[c] = _mm512_add_epi32(v[c], v[d]);
+        v[b] = _mm512_maskz_ror_epi32(0xFFFF, _mm512_xor_si512(v[b], v[c]), 12);
+        v[a] = _mm512_add_epi32(_mm512_add_epi32(v[a], v[b]), y);
+        v[d] = _mm512_maskz_ror_epi32(0xFFFF, _mm512_xor_si512(v[d], v[a]), 8);
+        v[c] = _mm512_add_epi32(v[c], v[d]);
+        v[b] = _mm512_maskz_ror_epi32(0xFFFF, _mm512_xor_si512(v[b], v[c]), 7);
+    }
+
+    TARGET_AVX512 inline void HashAVX512(
+        const uint8_t *blocks,
+        uint64_t const num_blocks,
+        uint8_t const block_len,
+        uint8_t *out)
+    {
+        __m512i const in_index = _mm512_mullo_epi32(
+            _mm512_set_epi32(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0),
+            _mm512_set1_epi32(kBlockLen));
+        __m512i const out_index = _mm512_mullo_epi32(
+            _mm512_set_epi32(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0),
+            _mm512_set1_epi32(kOutLen));
+        uint64_t n = 0;
+        for (; n + 16 <= num_blocks; n += 16) {
+            const uint8_t *in = blocks + n * kBlockLen;
+            __m512i m[16];
+            for (int w = 0; w < 16; w++) {
+                m[w] = _mm512_mask_i32gather_epi32(
+                    _mm512_setzero_si512(), 0xFFFF, in_index, (const void *)(in + w * 4), 1);
+            }
+            __m512i v[16];
+            for (int i = 0; i < 8; i++) {
+                v[i] = _mm512_set1_epi32(kIV[i]);
+            }
+            for (int i = 0; i < 4; i++) {
+                v[8 + i] = _mm512_set1_epi32(kIV[i]);
+            }
+            v[12] = _mm512_setzero_si512();
+            v[13] = _mm512_setzero_si512();
+            v[14] = _mm512_set1_epi32(block_len);
+            v[15] = _mm512_set1_epi32(kFlags);
+            for (int r = 0; r < 7; r++) {
+                const uint8_t *s = kMsgSchedule[r];
+                G512(v, 0, 4, 8, 12, m[s[0]], m[s[1]]);
+                G512(v, 1, 5, 9, 13, m[s[2]], m[s[3]]);
+                G512(v, 2, 6, 10, 14, m[s[4]], m[s[5]]);
+                G512(v, 3, 7, 11, 15, m[s[6]], m[s[7]]);
+                G512(v, 0, 5, 10, 15, m[s[8]], m[s[9]]);
+                G512(v, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+                G512(v, 2, 7, 8, 13, m[s[12]], m[s[13]]);
+                G512(v, 3, 4, 9, 14, m[s[14]], m[s[15]]);
+            }
+            uint8_t *o = out + n * kOutLen;
+            for (int i = 0; i < 8; i++) {
+                _mm512_i32scatter_epi32(
+                    (void *)(o + i * 4), out_index, _mm512_xor_si512(v[i], v[i + 8]), 1);
+            }
+        }
+        HashAVX2(blocks + n * kBlockLen, num_blocks - n, block_len, out + n * kOutLen);
+    }
+
+#endif  // defined(_WIN32) || defined(__x86_64__)
+
+    inline void Hash(
+        const uint8_t *blocks,
+        uint64_t const num_blocks,
+        uint8_t const block_len,
+        uint8_t *out)
+    {
+#if defined(_WIN32) || defined(__x86_64__)
+        switch (Util::GetISA()) {
+            case isa_t::avx512:
+                return HashAVX512(blocks, num_blocks, block_len, out);
+            case isa_t::avx2:
+                return HashAVX2(blocks, num_blocks, block_len, out);
+            default:
+                return HashSSE2(blocks, num_blocks, block_len, out);
+        }
+#else
+        HashPortable(blocks, num_blocks, block_len, out);
+#endif
+    }
+}
+
+#endif  // SRC_CPP_BLAKE3_BATCH_HPP_
@@ -0,0 +1,257 @@
+// Copyright 2018 Chia Network Inc
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//    http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SRC_CPP_BUCKET_CODEC_HPP_
+#define SRC_CPP_BUCKET_CODEC_HPP_
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "util.hpp"
+
+// Appends values of up to 56 bits to a big endian bit stream. The buffer needs
+// 7 bytes of head-room.
+class BitWriter {
+public:
+    explicit BitWriter(uint8_t *dst) : begin_(dst), dst_(dst) {}
+
+    // Appends the low num_bits bits of value
+    void Append(uint64_t const value, uint32_t const num_bits)
+    {
+        if (num_bits == 0) {
+            return;
+        }
+        acc_ |= value << (64 - num_bits) >> acc_bits_;
+        acc_bits_ += num_bits;
+        uint32_t const full_bytes = acc_bits_ / 8;
+        Util::IntToEightBytes(dst_, acc_);
+        dst_ += full_bytes;
+        acc_ <<= full_bytes * 8;
+        acc_bits_ -= full_bytes * 8;
+    }
+
+    // Appends value as that many 1 bits, and a 0 bit
+    void AppendUnary(uint64_t value)
+    {
+        for (; value >= 56; value -= 56) {
+            Append(~uint64_t(0), 56);
+        }
+        Append(((uint64_t(1) << value) - 1) << 1, value + 1);
+    }
+
+    // Returns the number of bytes written
+    uint64_t Finish()
+    {
+        if (acc_bits_ > 0) {
+            *dst_++ = acc_ >> 56;
+            acc_ = 0;
+            acc_bits_ = 0;
+        }
+        return dst_ - begin_;
+    }
+
+private:
+    uint8_t *const begin_;
+    uint8_t *dst_;
+    // The bits not written out yet, at the top
+    uint64_t acc_ = 0;
+    uint32_t acc_bits_ = 0;
+};
+
+// Reads what BitWriter wrote. The buffer needs 7 bytes of head-room.
+class BitReader {
+public:
+    explicit BitReader(const uint8_t *src) : src_(src) {}
+
+    uint64_t Read(uint32_t const num_bits)
+    {
+        if (num_bits == 0) {
+            return 0;
+        }
+        uint64_t const value =
+            Util::EightBytesToInt(src_ + bit_ / 8) << (bit_ % 8) >> (64 - num_bits);
+        bit_ += num_bits;
+        return value;
+    }
+
+    uint64_t ReadUnary()
+    {
+        uint64_t value = 0;
+        for (;;) {
+            uint64_t const zeros = ~(Util::EightBytesToInt(src_ + bit_ / 8) << (bit_ % 8));
+            uint32_t const ones = zeros ? Util::CountLeadingZeros(zeros) : 64;
+            if (ones < 56) {
+                bit_ += ones + 1;
+                return value + ones;
+            }
+            value += 56;
+            bit_ += 56;
+        }
+    }
+
+private:
+    const uint8_t *const src_;
+    uint64_t bit_ = 0;
+};
+
+// Compresses blocks of sort bucket entries. All the entries of a bucket share
+// the log_num_buckets bits starting at begin_bits, so those aren't stored. The
+// entries of a block are reordered by the (up to 56) bits that follow, and
+// those are stored as Rice coded differences. The order of the entries within
+// a bucket doesn't matter, since buckets are sorted when they're read. The
+// bits before begin_bits, and the ones after the differences, up to
+// entry_bits, are stored as they are. The bits after entry_bits must be 0.
+class BucketCodec {
+public:
+    // Bits of each entry that are difference coded, at most
+    static const uint32_t kKeyBits = 56;
+
+    BucketCodec(
+        uint32_t const entry_size,
+        uint32_t const entry_bits,
+        uint32_t const begin_bits,
+        uint32_t const log_num_buckets)
+        : entry_size_(entry_size)
+        , entry_bits_(entry_bits)
+        , prefix_begin_(std::min(begin_bits, entry_bits))
+        , prefix_bits_(std::min(log_num_buckets, entry_bits - prefix_begin_))
+        , prefix_shift_(log_num_buckets - prefix_bits_)
+        , key_begin_(prefix_begin_ + prefix_bits_)
+        , key_bits_(std::min(kKeyBits, entry_bits - key_begin_))
+        , tail_begin_(key_begin_ + key_bits_)
+        // 7 bytes head-room for SetInt64InBytes()
+        , entry_buf_(new uint8_t[entry_size + 7]())
+    {
+    }
+
+    // The most bytes Encode() needs for num_entries entries, including 7
+    // bytes of head-room
+    uint64_t MaxSize(uint64_t const num_entries) const
+    {
+        // The unary parts of the differences add up to less than 2 bits per
+        // entry, since the Rice parameter is at least half the mean difference
+        return cdiv(8 + num_entries * (entry_bits_ + 3), 8) + 7;
+    }
+
+    // Encodes num_entries entries, all from the same bucket, to dst. entries
+    // needs 7 bytes of head-room. Returns the number of bytes written.
+    uint64_t Encode(uint8_t *dst, const uint8_t *entries, uint64_t const num_entries)
+    {
+        keys_.resize(num_entries);
+        for (uint64_t i = 0; i < num_entries; i++) {
+            keys_[i] = {
+                key_bits_ ? Util::SliceInt64FromBytes(
+                                entries + i * entry_size_, key_begin_, key_bits_)
+                          : 0,
+                i};
+        }
+        std::sort(keys_.begin(), keys_.end());
+
+        // floor(log2()) of the mean difference
+        uint32_t rice_bits = 0;
+        if (num_entries > 1) {
+            uint64_t const mean = (keys_.back().first - keys_.front().first) / (num_entries - 1);
+            while (mean >> (rice_bits + 1)) {
+                rice_bits++;
+            }
+        }
+
+        BitWriter out(dst);
+        out.Append(rice_bits, 8);
+        uint64_t prev_key = 0;
+        for (uint64_t i = 0; i < num_entries; i++) {
+            const uint8_t *entry = entries + keys_[i].second * entry_size_;
+            uint64_t const key = keys_[i].first;
+            CopyBits(out, entry, 0, prefix_begin_);
+            if (i == 0) {
+                out.Append(key, key_bits_);
+            } else {
+                uint64_t const delta = key - prev_key;
+                out.AppendUnary(delta >> rice_bits);
+                out.Append(delta, rice_bits);
+            }
+            CopyBits(out, entry, tail_begin_, entry_bits_ - tail_begin_);
+            prev_key = key;
+        }
+        return out.Finish();
+    }
+
+    // Decodes num_entries entries of bucket, encoded by Encode(), to dst. src
+    // needs 7 bytes of head-room.
+    void Decode(uint8_t *dst, const uint8_t *src, uint64_t const num_entries, uint64_t const bucket)
+    {
+        uint8_t *entry = entry_buf_.get();
+        BitReader in(src);
+        uint32_t const rice_bits = in.Read(8);
+        uint64_t key = 0;
+        for (uint64_t i = 0; i < num_entries; i++) {
+            memset(entry, 0, entry_size_);
+            PasteBits(in, entry, 0, prefix_begin_);
+            Util::SetInt64InBytes(entry, prefix_begin_, bucket >> prefix_shift_, prefix_bits_);
+            if (i == 0) {
+                key = in.Read(key_bits_);
+            } else {
+                uint64_t const quotient = in.ReadUnary();
+                key += (quotient << rice_bits) | in.Read(rice_bits);
+            }
+            Util::SetInt64InBytes(entry, key_begin_, key, key_bits_);
+            PasteBits(in, entry, tail_begin_, entry_bits_ - tail_begin_);
+            memcpy(dst + i * entry_size_, entry, entry_size_);
+        }
+    }
+
+private:
+    static void CopyBits(
+        BitWriter &out,
+        const uint8_t *entry,
+        uint32_t const begin,
+        uint32_t const num_bits)
+    {
+        for (uint32_t bit = 0; bit < num_bits; bit += kKeyBits) {
+            uint32_t const n = std::min(kKeyBits, num_bits - bit);
+            out.Append(Util::SliceInt64FromBytes(entry, begin + bit, n), n);
+        }
+    }
+
+    static void PasteBits(
+        BitReader &in,
+        uint8_t *entry,
+        uint32_t const begin,
+        uint32_t const num_bits)
+    {
+        for (uint32_t bit = 0; bit < num_bits; bit += kKeyBits) {
+            uint32_t const n = std::min(kKeyBits, num_bits - bit);
+            Util::SetInt64InBytes(entry, begin + bit, in.Read(n), n);
+        }
+    }
+
+    uint32_t const entry_size_;
+    uint32_t const entry_bits_;
+    // The bucket bits
+    uint32_t const prefix_begin_;
+    uint32_t const prefix_bits_;
+    // If the bucket bits don't all fit in the entry, the ones that do
+    uint32_t const prefix_shift_;
+    // The difference coded bits
+    uint32_t const key_begin_;
+    uint32_t const key_bits_;
+    uint32_t const tail_begin_;
+    std::unique_ptr<uint8_t[]> entry_buf_;
+    std::vector<std::pair<uint64_t, uint64_t>> keys_;
+};
+
+#endif  // SRC_CPP_BUCKET_CODEC_HPP_
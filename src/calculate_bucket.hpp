@@ -22,11 +22,13 @@
 #include <bitset>
 #include <iostream>
 #include <map>
+#include <memory>
 #include <utility>
 #include <vector>
 
 #include "b3/blake3.h"
 #include "bits.hpp"
+#include "blake3_batch.hpp"
 #include "chacha8.h"
 #include "pos_constants.hpp"
 #include "util.hpp"
@@ -173,7 +175,14 @@ public:
         assert(n <= (1U << kBatchSizes));
 
         chacha8_get_keystream(&this->enc_ctx_, start, num_blocks, buf_);
-        for (uint64_t x = first_x; x < first_x + n; x++) {
+        uint64_t x = first_x;
+#if defined(_WIN32) || defined(__x86_64__)
+        if (Util::GetISA() >= isa_t::avx2) {
+            x = UnpackAVX2(first_x, n, start_bit, res);
+            start_bit += (x - first_x) * k_;
+        }
+#endif
+        for (; x < first_x + n; x++) {
             uint64_t y = Util::SliceInt64FromBytes(buf_, start_bit, k_);
 
             res[x - first_x] = (y << kExtraBits) | (x >> x_shift);
@@ -183,6 +192,45 @@ public:
     }
 
 private:
+#if defined(_WIN32) || defined(__x86_64__)
+    // Does the k bit slicing of CalculateBuckets() 4 values at a time, with one unaligned 64-bit
+    // gather per 4 values. Since k <= 50, each value lies within the 8 bytes starting at its
+    // first byte. Returns one past the last x done.
+    TARGET_AVX2 uint64_t
+    UnpackAVX2(uint64_t const first_x, uint64_t const n, uint32_t const start_bit, uint64_t* res)
+    {
+        // Reverses the bytes of each 64-bit lane, to read the keystream as big endian
+        __m256i const bswap = _mm256_setr_epi8(
+            7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+            7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+        __m256i const low3 = _mm256_set1_epi64x(7);
+        __m128i const y_shift = _mm_cvtsi32_si128(64 - k_);
+        __m128i const x_shift = _mm_cvtsi32_si128(k_ - kExtraBits);
+        __m256i const step = _mm256_set1_epi64x(4 * (uint64_t)k_);
+        __m256i const x_step = _mm256_set1_epi64x(4);
+
+        __m256i bit = _mm256_add_epi64(
+            _mm256_set1_epi64x(start_bit),
+            _mm256_setr_epi64x(0, k_, 2 * (uint64_t)k_, 3 * (uint64_t)k_));
+        __m256i xs = _mm256_add_epi64(_mm256_set1_epi64x(first_x), _mm256_setr_epi64x(0, 1, 2, 3));
+        uint64_t i = 0;
+        for (; i + 4 <= n; i += 4) {
+            __m256i word = _mm256_i64gather_epi64(
+                (const long long*)buf_, _mm256_srli_epi64(bit, 3), 1);
+            word = _mm256_shuffle_epi8(word, bswap);
+            __m256i const y =
+                _mm256_srl_epi64(_mm256_sllv_epi64(word, _mm256_and_si256(bit, low3)), y_shift);
+            __m256i const f = _mm256_or_si256(
+                _mm256_slli_epi64(y, kExtraBits), _mm256_srl_epi64(xs, x_shift));
+            _mm256_storeu_si256((__m256i*)(res + i), f);
+            bit = _mm256_add_epi64(bit, step);
+            xs = _mm256_add_epi64(xs, x_step);
+        }
+        return first_x + i;
+    }
+#endif
+
+
     // Size of the plot
     uint8_t k_{};
 
@@ -197,6 +245,17 @@ struct rmap_item {
     uint16_t pos : 12;
 };
 
+// Fixed size metadata record, used by the batched f evaluation. Metadata of up to
+// 128 bits is kept in left. Larger metadata (k > 32) keeps its first 128 bits in
+// left and the rest in right, like PlotEntry does.
+struct metadata_t {
+    uint128_t left;
+    uint128_t right;
+};
+
+// Number of f evaluations FxCalculator::CalculateBuckets() hashes together
+const uint32_t kFxBatchSize = 64;
+
 // Class to evaluate F2 .. F7.
 class FxCalculator {
 public:
@@ -208,6 +267,7 @@ public:
         this->table_index_ = table_index;
 
         this->rmap.resize(kBC);
+        this->rmap_bits_.resize((kBC + 31) / 32);
         if (!initialized) {
             initialized = true;
             load_tables();
@@ -225,7 +285,8 @@ public:
     inline std::pair<Bits, Bits> CalculateBucket(const Bits& y1, const Bits& L, const Bits& R) const
     {
         Bits input;
-        uint8_t input_bytes[64];
+        // ToBytes() writes whole 64 bit words, as many as a Bits can hold
+        uint8_t input_bytes[10 * 8];
         uint8_t hash_bytes[32];
         blake3_hasher hasher;
         uint64_t f;
@@ -263,6 +324,58 @@ public:
         return std::make_pair(Bits(f, k_ + kExtraBits), c);
     }
 
+    // Performs num_entries evaluations of the f function. This is equivalent to
+    // calling CalculateBucket() for each (y1[i], L[i], R[i]), but the inputs are
+    // packed straight into BLAKE3 blocks and hashed several at a time, without
+    // going through Bits. f_out[i] receives f (k + kExtraBits bits) and, unless
+    // this is table 7, c_out[i] receives the metadata for the next table.
+    inline void CalculateBuckets(
+        uint64_t const num_entries,
+        const uint64_t* y1,
+        const metadata_t* L,
+        const metadata_t* R,
+        uint64_t* f_out,
+        metadata_t* c_out)
+    {
+        uint32_t const y_size = k_ + kExtraBits;
+        uint32_t const metadata_size = kVectorLens[table_index_] * k_;
+        uint32_t const c_size = table_index_ < 7 ? kVectorLens[table_index_ + 1] * k_ : 0;
+        uint8_t const block_len = cdiv(y_size + 2 * metadata_size, 8);
+
+        if (!batch_blocks_) {
+            // 7 bytes head-room for SliceInt64FromBytes()
+            batch_blocks_.reset(new uint8_t[kFxBatchSize * Blake3Batch::kBlockLen + 7]);
+            batch_hashes_.reset(new uint8_t[kFxBatchSize * Blake3Batch::kOutLen + 7]);
+        }
+
+        for (uint64_t begin = 0; begin < num_entries; begin += kFxBatchSize) {
+            uint64_t const n = std::min<uint64_t>(kFxBatchSize, num_entries - begin);
+
+            memset(batch_blocks_.get(), 0, n * Blake3Batch::kBlockLen);
+            for (uint64_t i = 0; i < n; i++) {
+                uint8_t* block = batch_blocks_.get() + i * Blake3Batch::kBlockLen;
+                Util::SetInt64InBytes(block, 0, y1[begin + i], y_size);
+                SetMetadata(block, y_size, L[begin + i], metadata_size);
+                SetMetadata(block, y_size + metadata_size, R[begin + i], metadata_size);
+            }
+
+            Blake3Batch::Hash(batch_blocks_.get(), n, block_len, batch_hashes_.get());
+
+            for (uint64_t i = 0; i < n; i++) {
+                const uint8_t* hash = batch_hashes_.get() + i * Blake3Batch::kOutLen;
+                f_out[begin + i] = Util::EightBytesToInt(hash) >> (64 - y_size);
+                if (c_size == 0) {
+                    continue;
+                }
+                // For tables 2 and 3, c is L + R, which is what follows y in the
+                // input. For tables 4-6 it's taken from the hash, after f
+                const uint8_t* c_bytes =
+                    table_index_ < 4 ? batch_blocks_.get() + i * Blake3Batch::kBlockLen : hash;
+                c_out[begin + i] = GetMetadata(c_bytes, y_size, c_size);
+            }
+        }
+    }
+
     // Given two buckets with entries (y values), computes which y values match, and returns a list
     // of the pairs of indices into bucket_L and bucket_R. Indices l and r match iff:
     //   let  yl = bucket_L[l].y,  yr = bucket_R[r].y
@@ -282,34 +395,121 @@ public:
         uint16_t *idx_L,
         uint16_t *idx_R)
     {
-        int32_t idx_count = 0;
-        uint16_t parity = (bucket_L[0].y / kBC) % 2;
+        std::vector<uint64_t> L_y(bucket_L.size());
+        std::vector<uint64_t> R_y(bucket_R.size());
+        for (size_t i = 0; i < bucket_L.size(); i++) {
+            L_y[i] = bucket_L[i].y;
+        }
+        for (size_t i = 0; i < bucket_R.size(); i++) {
+            R_y[i] = bucket_R[i].y;
+        }
+        return FindMatches(L_y.data(), L_y.size(), R_y.data(), R_y.size(), idx_L, idx_R);
+    }
+
+    // Same as above, for buckets given as arrays of y values. On x86, the 64 targets of a left
+    // entry are first looked up in a bitmap of the right bucket's y values, 8 or 16 at a time
+    // with gathers, and the rmap is only read for the few targets that hit. 'isa' picks the
+    // kernel, and is only meant to be overridden by tests.
+    inline int32_t FindMatches(
+        const uint64_t *L_y,
+        size_t const L_size,
+        const uint64_t *R_y,
+        size_t const R_size,
+        uint16_t *idx_L,
+        uint16_t *idx_R,
+        isa_t const isa = Util::GetISA())
+    {
+        uint16_t parity = (L_y[0] / kBC) % 2;
 
         for (size_t yl : rmap_clean) {
             this->rmap[yl].count = 0;
+            this->rmap_bits_[yl / 32] = 0;
         }
         rmap_clean.clear();
 
-        uint64_t remove = (bucket_R[0].y / kBC) * kBC;
-        for (size_t pos_R = 0; pos_R < bucket_R.size(); pos_R++) {
-            uint64_t r_y = bucket_R[pos_R].y - remove;
+        uint64_t remove = (R_y[0] / kBC) * kBC;
+        for (size_t pos_R = 0; pos_R < R_size; pos_R++) {
+            uint64_t r_y = R_y[pos_R] - remove;
 
             if (!rmap[r_y].count) {
                 rmap[r_y].pos = pos_R;
             }
             rmap[r_y].count++;
+            rmap_bits_[r_y / 32] |= 1U << (r_y % 32);
             rmap_clean.push_back(r_y);
         }
 
         uint64_t remove_y = remove - kBC;
-        for (size_t pos_L = 0; pos_L < bucket_L.size(); pos_L++) {
-            uint64_t r = bucket_L[pos_L].y - remove_y;
+#if defined(_WIN32) || defined(__x86_64__)
+        switch (isa) {
+            case isa_t::avx512:
+                return FindMatchesAVX512(L_y, L_size, remove_y, parity, idx_L, idx_R);
+            case isa_t::avx2:
+                return FindMatchesAVX2(L_y, L_size, remove_y, parity, idx_L, idx_R);
+            default:
+                break;
+        }
+#endif
+        return FindMatchesPortable(L_y, L_size, remove_y, parity, idx_L, idx_R);
+    }
+
+private:
+    static inline void SetMetadata(
+        uint8_t* bytes,
+        uint32_t const start_bit,
+        const metadata_t& metadata,
+        uint32_t const size)
+    {
+        if (size <= 128) {
+            Util::SetInt128InBytes(bytes, start_bit, metadata.left, size);
+        } else {
+            Util::SetInt128InBytes(bytes, start_bit, metadata.left, 128);
+            Util::SetInt128InBytes(bytes, start_bit + 128, metadata.right, size - 128);
+        }
+    }
+
+    // Writes out the matches of the left entry at pos_L, given a bitmask of which of its
+    // targets are present in the right bucket. Matches are ordered by target, as in the
+    // original algorithm.
+    inline void AddMatches(
+        uint64_t mask,
+        size_t const pos_L,
+        const uint16_t *targets,
+        uint16_t *idx_L,
+        uint16_t *idx_R,
+        int32_t &idx_count) const
+    {
+        while (mask) {
+            rmap_item const item = rmap[targets[Util::CountTrailingZeros(mask)]];
+            mask &= mask - 1;
+            for (size_t j = 0; j < item.count; j++) {
+                if (idx_L != nullptr) {
+                    idx_L[idx_count] = pos_L;
+                    idx_R[idx_count] = item.pos + j;
+                }
+                idx_count++;
+            }
+        }
+    }
+
+    // Without SIMD gathers, probing the rmap directly is faster than going through the bitmap
+    inline int32_t FindMatchesPortable(
+        const uint64_t *L_y,
+        size_t const L_size,
+        uint64_t const remove_y,
+        uint16_t const parity,
+        uint16_t *idx_L,
+        uint16_t *idx_R) const
+    {
+        int32_t idx_count = 0;
+        for (size_t pos_L = 0; pos_L < L_size; pos_L++) {
+            uint64_t r = L_y[pos_L] - remove_y;
             for (uint8_t i = 0; i < kExtraBitsPow; i++) {
                 uint16_t r_target = L_targets[parity][r][i];
                 for (size_t j = 0; j < rmap[r_target].count; j++) {
-                    if(idx_L != nullptr) {
-                        idx_L[idx_count]=pos_L;
-                        idx_R[idx_count]=rmap[r_target].pos + j;
+                    if (idx_L != nullptr) {
+                        idx_L[idx_count] = pos_L;
+                        idx_R[idx_count] = rmap[r_target].pos + j;
                     }
                     idx_count++;
                 }
@@ -318,11 +518,93 @@ public:
         return idx_count;
     }
 
-private:
+#if defined(_WIN32) || defined(__x86_64__)
+    // 8 targets per gather
+    TARGET_AVX2 int32_t FindMatchesAVX2(
+        const uint64_t *L_y,
+        size_t const L_size,
+        uint64_t const remove_y,
+        uint16_t const parity,
+        uint16_t *idx_L,
+        uint16_t *idx_R) const
+    {
+        int32_t idx_count = 0;
+        const int *bits = (const int *)rmap_bits_.data();
+        __m256i const low5 = _mm256_set1_epi32(31);
+        for (size_t pos_L = 0; pos_L < L_size; pos_L++) {
+            const uint16_t *targets = L_targets[parity][L_y[pos_L] - remove_y];
+            uint64_t mask = 0;
+            for (uint8_t i = 0; i < kExtraBitsPow; i += 8) {
+                __m256i const t =
+                    _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(targets + i)));
+                __m256i const words = _mm256_i32gather_epi32(bits, _mm256_srli_epi32(t, 5), 4);
+                __m256i const hit =
+                    _mm256_slli_epi32(_mm256_srlv_epi32(words, _mm256_and_si256(t, low5)), 31);
+                mask |= (uint64_t)(uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(hit)) << i;
+            }
+            AddMatches(mask, pos_L, targets, idx_L, idx_R, idx_count);
+        }
+        return idx_count;
+    }
+
+    // 16 targets per gather
+    TARGET_AVX512 int32_t FindMatchesAVX512(
+        const uint64_t *L_y,
+        size_t const L_size,
+        uint64_t const remove_y,
+        uint16_t const parity,
+        uint16_t *idx_L,
+        uint16_t *idx_R) const
+    {
+        int32_t idx_count = 0;
+        const int *bits = (const int *)rmap_bits_.data();
+        __m512i const low5 = _mm512_set1_epi32(31);
+        __m512i const one = _mm512_set1_epi32(1);
+        for (size_t pos_L = 0; pos_L < L_size; pos_L++) {
+            const uint16_t *targets = L_targets[parity][L_y[pos_L] - remove_y];
+            uint64_t mask = 0;
+            for (uint8_t i = 0; i < kExtraBitsPow; i += 16) {
+                // The zero-masking forms, with every lane set, since GCC
+                // warns the plain ones' undefined vector may be uninitialized
+                __m512i const t = _mm512_maskz_cvtepu16_epi32(
+                    0xFFFF, _mm256_loadu_si256((const __m256i *)(targets + i)));
+                __m512i const words = _mm512_mask_i32gather_epi32(
+                    _mm512_setzero_si512(), 0xFFFF, _mm512_maskz_srli_epi32(0xFFFF, t, 5), bits, 4);
+                __m512i const hit =
+                    _mm512_maskz_srlv_epi32(0xFFFF, words, _mm512_and_si512(t, low5));
+                mask |= (uint64_t)_mm512_test_epi32_mask(hit, one) << i;
+            }
+            AddMatches(mask, pos_L, targets, idx_L, idx_R, idx_count);
+        }
+        return idx_count;
+    }
+#endif  // defined(_WIN32) || defined(__x86_64__)
+
+    static inline metadata_t GetMetadata(
+        const uint8_t* bytes,
+        uint32_t const start_bit,
+        uint32_t const size)
+    {
+        metadata_t metadata{0, 0};
+        if (size <= 128) {
+            metadata.left = Util::SliceInt128FromBytes(bytes, start_bit, size);
+        } else {
+            metadata.left = Util::SliceInt128FromBytes(bytes, start_bit, 128);
+            metadata.right = Util::SliceInt128FromBytes(bytes, start_bit + 128, size - 128);
+        }
+        return metadata;
+    }
+
     uint8_t k_{};
     uint8_t table_index_{};
     std::vector<struct rmap_item> rmap;
     std::vector<uint16_t> rmap_clean;
+    // One bit per rmap entry, set when its count is non-zero
+    std::vector<uint32_t> rmap_bits_;
+
+    // Scratch space of CalculateBuckets(), allocated on first use
+    std::unique_ptr<uint8_t[]> batch_blocks_;
+    std::unique_ptr<uint8_t[]> batch_hashes_;
 };
 
 #endif  // SRC_CPP_CALCULATE_BUCKET_HPP_
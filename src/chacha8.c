@@ -1,5 +1,20 @@
 #include "chacha8.h"
 
+#if defined(_WIN32) || defined(__x86_64__)
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(__GNUC__)
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define TARGET_AVX512 __attribute__((target("avx512f")))
+#else
+#define TARGET_AVX2
+#define TARGET_AVX512
+#endif
+
 #define U32TO32_LITTLE(v) (v)
 #define U8TO32_LITTLE(p) (*(const uint32_t *)(p))
 #define U32TO8_LITTLE(p, v) (((uint32_t *)(p))[0] = U32TO32_LITTLE(v))
@@ -54,7 +69,11 @@ void chacha8_keysetup(struct chacha8_ctx *x, const uint8_t *k, uint32_t kbits, c
     }
 }
 
-void chacha8_get_keystream(const struct chacha8_ctx *x, uint64_t pos, uint32_t n_blocks, uint8_t *c)
+void chacha8_get_keystream_portable(
+    const struct chacha8_ctx *x,
+    uint64_t pos,
+    uint32_t n_blocks,
+    uint8_t *c)
 {
     uint32_t x0, x1, x2, x3, x4, x5, x6, x7, x8, x9, x10, x11, x12, x13, x14, x15;
     uint32_t j0, j1, j2, j3, j4, j5, j6, j7, j8, j9, j10, j11, j12, j13, j14, j15;
@@ -147,3 +166,305 @@ void chacha8_get_keystream(const struct chacha8_ctx *x, uint64_t pos, uint32_t n
         c += 64;
     }
 }
+
+#if defined(_WIN32) || defined(__x86_64__)
+
+/*
+ * The kernels below generate several consecutive blocks at once, one block per
+ * 32-bit SIMD lane, and transpose the result back to the byte order of
+ * chacha8_get_keystream_portable(). Blocks that don't fill all the lanes are
+ * passed on to the next narrower kernel.
+ */
+
+#define QUARTERROUND_SIMD(a, b, c, d, add, xor, rot16, rot12, rot8, rot7) \
+    a = add(a, b);                                                        \
+    d = rot16(xor(d, a));                                                 \
+    c = add(c, d);                                                        \
+    b = rot12(xor(b, c));                                                 \
+    a = add(a, b);                                                        \
+    d = rot8(xor(d, a));                                                  \
+    c = add(c, d);                                                        \
+    b = rot7(xor(b, c))
+
+#define DOUBLEROUND_SIMD(v, add, xor, rot16, rot12, rot8, rot7)                        \
+    QUARTERROUND_SIMD(v[0], v[4], v[8], v[12], add, xor, rot16, rot12, rot8, rot7);  \
+    QUARTERROUND_SIMD(v[1], v[5], v[9], v[13], add, xor, rot16, rot12, rot8, rot7);  \
+    QUARTERROUND_SIMD(v[2], v[6], v[10], v[14], add, xor, rot16, rot12, rot8, rot7); \
+    QUARTERROUND_SIMD(v[3], v[7], v[11], v[15], add, xor, rot16, rot12, rot8, rot7); \
+    QUARTERROUND_SIMD(v[0], v[5], v[10], v[15], add, xor, rot16, rot12, rot8, rot7); \
+    QUARTERROUND_SIMD(v[1], v[6], v[11], v[12], add, xor, rot16, rot12, rot8, rot7); \
+    QUARTERROUND_SIMD(v[2], v[7], v[8], v[13], add, xor, rot16, rot12, rot8, rot7);  \
+    QUARTERROUND_SIMD(v[3], v[4], v[9], v[14], add, xor, rot16, rot12, rot8, rot7)
+
+/* Words 12 and 13 of each lane's initial state, the 64-bit block counter */
+static void chacha8_lane_counters(uint64_t pos, int lanes, uint32_t *lo, uint32_t *hi)
+{
+    int i;
+    for (i = 0; i < lanes; i++) {
+        lo[i] = (uint32_t)(pos + i);
+        hi[i] = (uint32_t)((pos + i) >> 32);
+    }
+}
+
+#define ROTL128(v, n) _mm_or_si128(_mm_slli_epi32(v, n), _mm_srli_epi32(v, 32 - (n)))
+#define ROTL128_16(v) ROTL128(v, 16)
+#define ROTL128_12(v) ROTL128(v, 12)
+#define ROTL128_8(v) ROTL128(v, 8)
+#define ROTL128_7(v) ROTL128(v, 7)
+
+static void chacha8_transpose4x4(__m128i *r)
+{
+    __m128i t0 = _mm_unpacklo_epi32(r[0], r[1]);
+    __m128i t1 = _mm_unpacklo_epi32(r[2], r[3]);
+    __m128i t2 = _mm_unpackhi_epi32(r[0], r[1]);
+    __m128i t3 = _mm_unpackhi_epi32(r[2], r[3]);
+    r[0] = _mm_unpacklo_epi64(t0, t1);
+    r[1] = _mm_unpackhi_epi64(t0, t1);
+    r[2] = _mm_unpacklo_epi64(t2, t3);
+    r[3] = _mm_unpackhi_epi64(t2, t3);
+}
+
+/* 4 blocks at a time. SSE2 is part of the x86-64 baseline. */
+void chacha8_get_keystream_sse2(
+    const struct chacha8_ctx *x,
+    uint64_t pos,
+    uint32_t n_blocks,
+    uint8_t *c)
+{
+    __m128i j[16], v[16];
+    uint32_t lo[4], hi[4];
+    int i, w;
+
+    for (i = 0; i < 16; i++) {
+        j[i] = _mm_set1_epi32((int)x->input[i]);
+    }
+    for (; n_blocks >= 4; n_blocks -= 4, pos += 4, c += 4 * 64) {
+        chacha8_lane_counters(pos, 4, lo, hi);
+        j[12] = _mm_loadu_si128((const __m128i *)lo);
+        j[13] = _mm_loadu_si128((const __m128i *)hi);
+        for (i = 0; i < 16; i++) {
+            v[i] = j[i];
+        }
+        for (i = 8; i > 0; i -= 2) {
+            DOUBLEROUND_SIMD(
+                v, _mm_add_epi32, _mm_xor_si128, ROTL128_16, ROTL128_12, ROTL128_8, ROTL128_7);
+        }
+        for (i = 0; i < 16; i++) {
+            v[i] = _mm_add_epi32(v[i], j[i]);
+        }
+        for (w = 0; w < 16; w += 4) {
+            chacha8_transpose4x4(v + w);
+            for (i = 0; i < 4; i++) {
+                _mm_storeu_si128((__m128i *)(c + i * 64 + w * 4), v[w + i]);
+            }
+        }
+    }
+    chacha8_get_keystream_portable(x, pos, n_blocks, c);
+}
+
+#define ROTL256(v, n) _mm256_or_si256(_mm256_slli_epi32(v, n), _mm256_srli_epi32(v, 32 - (n)))
+#define ROTL256_16(v) _mm256_shuffle_epi8(v, rot16)
+#define ROTL256_12(v) ROTL256(v, 12)
+#define ROTL256_8(v) _mm256_shuffle_epi8(v, rot8)
+#define ROTL256_7(v) ROTL256(v, 7)
+
+/* Transposes the 4x4 blocks of words in each 128-bit half */
+TARGET_AVX2 static void chacha8_transpose4x4_256(__m256i *r)
+{
+    __m256i t0 = _mm256_unpacklo_epi32(r[0], r[1]);
+    __m256i t1 = _mm256_unpacklo_epi32(r[2], r[3]);
+    __m256i t2 = _mm256_unpackhi_epi32(r[0], r[1]);
+    __m256i t3 = _mm256_unpackhi_epi32(r[2], r[3]);
+    r[0] = _mm256_unpacklo_epi64(t0, t1);
+    r[1] = _mm256_unpackhi_epi64(t0, t1);
+    r[2] = _mm256_unpacklo_epi64(t2, t3);
+    r[3] = _mm256_unpackhi_epi64(t2, t3);
+}
+
+/* 8 blocks at a time */
+TARGET_AVX2 void chacha8_get_keystream_avx2(
+    const struct chacha8_ctx *x,
+    uint64_t pos,
+    uint32_t n_blocks,
+    uint8_t *c)
+{
+    const __m256i rot16 = _mm256_setr_epi8(
+        2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13,
+        2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13);
+    const __m256i rot8 = _mm256_setr_epi8(
+        3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14,
+        3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14);
+    __m256i j[16], v[16];
+    uint32_t lo[8], hi[8];
+    int i, w;
+
+    for (i = 0; i < 16; i++) {
+        j[i] = _mm256_set1_epi32((int)x->input[i]);
+    }
+    for (; n_blocks >= 8; n_blocks -= 8, pos += 8, c += 8 * 64) {
+        chacha8_lane_counters(pos, 8, lo, hi);
+        j[12] = _mm256_loadu_si256((const __m256i *)lo);
+        j[13] = _mm256_loadu_si256((const __m256i *)hi);
+        for (i = 0; i < 16; i++) {
+            v[i] = j[i];
+        }
+        for (i = 8; i > 0; i -= 2) {
+            DOUBLEROUND_SIMD(
+                v, _mm256_add_epi32, _mm256_xor_si256, ROTL256_16, ROTL256_12, ROTL256_8,
+                ROTL256_7);
+        }
+        for (i = 0; i < 16; i++) {
+            v[i] = _mm256_add_epi32(v[i], j[i]);
+        }
+        /*
+         * After this, the low half of v[w + i] holds words w..w+3 of block i,
+         * and the high half the same words of block i + 4.
+         */
+        for (w = 0; w < 16; w += 4) {
+            chacha8_transpose4x4_256(v + w);
+        }
+        for (w = 0; w < 16; w += 8) {
+            for (i = 0; i < 4; i++) {
+                __m256i a = _mm256_permute2x128_si256(v[w + i], v[w + 4 + i], 0x20);
+                __m256i b = _mm256_permute2x128_si256(v[w + i], v[w + 4 + i], 0x31);
+                _mm256_storeu_si256((__m256i *)(c + i * 64 + w * 4), a);
+                _mm256_storeu_si256((__m256i *)(c + (i + 4) * 64 + w * 4), b);
+            }
+        }
+    }
+    chacha8_get_keystream_sse2(x, pos, n_blocks, c);
+}
+
+#define ROTL512_16(v) _mm512_rol_epi32(v, 16)
+#define ROTL512_12(v) _mm512_rol_epi32(v, 12)
+#define ROTL512_8(v) _mm512_rol_epi32(v, 8)
+#define ROTL512_7(v) _mm512_rol_epi32(v, 7)
+
+/* Transposes the 4x4 blocks of words in each 128-bit quarter */
+TARGET_AVX512 static void chacha8_transpose4x4_512(__m512i *r)
+{
+    __m512i t0 = _mm512_unpacklo_epi32(r[0], r[1]);
+    __m512i t1 = _mm512_unpacklo_epi32(r[2], r[3]);
+    __m512i t2 = _mm512_unpackhi_epi32(r[0], r[1]);
+    __m512i t3 = _mm512_unpackhi_epi32(r[2], r[3]);
+    r[0] = _mm512_unpacklo_epi64(t0, t1);
+    r[1] = _mm512_unpackhi_epi64(t0, t1);
+    r[2] = _mm512_unpacklo_epi64(t2, t3);
+    r[3] = _mm512_unpackhi_epi64(t2, t3);
+}
+
+/* 16 blocks at a time */
+TARGET_AVX512 void chacha8_get_keystream_avx512(
+    const struct chacha8_ctx *x,
+    uint64_t pos,
+    uint32_t n_blocks,
+    uint8_t *c)
+{
+    __m512i j[16], v[16];
+    uint32_t lo[16], hi[16];
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        j[i] = _mm512_set1_epi32((int)x->input[i]);
+    }
+    for (; n_blocks >= 16; n_blocks -= 16, pos += 16, c += 16 * 64) {
+        chacha8_lane_counters(pos, 16, lo, hi);
+        j[12] = _mm512_loadu_si512((const void *)lo);
+        j[13] = _mm512_loadu_si512((const void *)hi);
+        for (i = 0; i < 16; i++) {
+            v[i] = j[i];
+        }
+        for (i = 8; i > 0; i -= 2) {
+            DOUBLEROUND_SIMD(
+                v, _mm512_add_epi32, _mm512_xor_si512, ROTL512_16, ROTL512_12, ROTL512_8,
+                ROTL512_7);
+        }
+        for (i = 0; i < 16; i++) {
+            v[i] = _mm512_add_epi32(v[i], j[i]);
+        }
+        /*
+         * After this, quarter q of v[4 * g + i] holds words 4g..4g+3 of block
+         * 4q + i. Gathering the quarters of v[i], v[4 + i], v[8 + i] and
+         * v[12 + i] gives blocks i, 4 + i, 8 + i and 12 + i in full.
+         */
+        for (i = 0; i < 16; i += 4) {
+            chacha8_transpose4x4_512(v + i);
+        }
+        for (i = 0; i < 4; i++) {
+            __m512i t0 = _mm512_shuffle_i32x4(v[i], v[4 + i], 0x44);
+            __m512i t1 = _mm512_shuffle_i32x4(v[8 + i], v[12 + i], 0x44);
+            __m512i t2 = _mm512_shuffle_i32x4(v[i], v[4 + i], 0xee);
+            __m512i t3 = _mm512_shuffle_i32x4(v[8 + i], v[12 + i], 0xee);
+            _mm512_storeu_si512((void *)(c + i * 64), _mm512_shuffle_i32x4(t0, t1, 0x88));
+            _mm512_storeu_si512((void *)(c + (4 + i) * 64), _mm512_shuffle_i32x4(t0, t1, 0xdd));
+            _mm512_storeu_si512((void *)(c + (8 + i) * 64), _mm512_shuffle_i32x4(t2, t3, 0x88));
+            _mm512_storeu_si512((void *)(c + (12 + i) * 64), _mm512_shuffle_i32x4(t2, t3, 0xdd));
+        }
+    }
+    chacha8_get_keystream_avx2(x, pos, n_blocks, c);
+}
+
+#if defined(_MSC_VER)
+static int chacha8_have_avx2(void)
+{
+    int regs[4];
+    __cpuid(regs, 1);
+    /* OSXSAVE, and the OS saves the XMM and YMM registers */
+    if (!((regs[2] >> 27) & 1) || (_xgetbv(0) & 0x6) != 0x6) {
+        return 0;
+    }
+    __cpuidex(regs, 7, 0);
+    return (regs[1] >> 5) & 1;
+}
+
+static int chacha8_have_avx512f(void)
+{
+    int regs[4];
+    /* The OS also saves the opmask and ZMM registers */
+    if (!chacha8_have_avx2() || (_xgetbv(0) & 0xe6) != 0xe6) {
+        return 0;
+    }
+    __cpuidex(regs, 7, 0);
+    return (regs[1] >> 16) & 1;
+}
+#else
+static int chacha8_have_avx2(void) { return __builtin_cpu_supports("avx2"); }
+
+static int chacha8_have_avx512f(void) { return __builtin_cpu_supports("avx512f"); }
+#endif
+
+typedef void (*chacha8_kernel_t)(const struct chacha8_ctx *, uint64_t, uint32_t, uint8_t *);
+
+static chacha8_kernel_t chacha8_detect_kernel(void)
+{
+    if (chacha8_have_avx512f()) {
+        return chacha8_get_keystream_avx512;
+    }
+    if (chacha8_have_avx2()) {
+        return chacha8_get_keystream_avx2;
+    }
+    return chacha8_get_keystream_sse2;
+}
+
+#endif /* defined(_WIN32) || defined(__x86_64__) */
+
+void chacha8_get_keystream(const struct chacha8_ctx *x, uint64_t pos, uint32_t n_blocks, uint8_t *c)
+{
+#if defined(_WIN32) || defined(__x86_64__)
+    /* Every thread computes the same value, so racing on it is harmless */
+    static volatile chacha8_kernel_t kernel = 0;
+    chacha8_kernel_t k = kernel;
+
+    if (n_blocks < 4) {
+        chacha8_get_keystream_portable(x, pos, n_blocks, c);
+        return;
+    }
+    if (!k) {
+        k = chacha8_detect_kernel();
+        kernel = k;
+    }
+    k(x, pos, n_blocks, c);
+#else
+    chacha8_get_keystream_portable(x, pos, n_blocks, c);
+#endif
+}
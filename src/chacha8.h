@@ -18,6 +18,34 @@ void chacha8_get_keystream(
     uint32_t n_blocks,
     uint8_t *c);
 
+/*
+ * The kernels chacha8_get_keystream() picks from. They produce the same output,
+ * and only exist separately for testing. The SIMD ones must only be called if
+ * the CPU supports them.
+ */
+void chacha8_get_keystream_portable(
+    const struct chacha8_ctx *x,
+    uint64_t pos,
+    uint32_t n_blocks,
+    uint8_t *c);
+#if defined(_WIN32) || defined(__x86_64__)
+void chacha8_get_keystream_sse2(
+    const struct chacha8_ctx *x,
+    uint64_t pos,
+    uint32_t n_blocks,
+    uint8_t *c);
+void chacha8_get_keystream_avx2(
+    const struct chacha8_ctx *x,
+    uint64_t pos,
+    uint32_t n_blocks,
+    uint8_t *c);
+void chacha8_get_keystream_avx512(
+    const struct chacha8_ctx *x,
+    uint64_t pos,
+    uint32_t n_blocks,
+    uint8_t *c);
+#endif
+
 #ifdef __cplusplus
 }
 #endif
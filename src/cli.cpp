@@ -17,6 +17,7 @@
 
 #include "cxxopts.hpp"
 #include "../lib/include/picosha2.hpp"
+#include "plot_scheduler.hpp"
 #include "plotter_disk.hpp"
 #include "prover_disk.hpp"
 #include "verifier.hpp"
@@ -57,6 +58,9 @@ void HelpAndQuit(cxxopts::Options options)
 {
     cout << options.help({""}) << endl;
     cout << "./ProofOfSpace create" << endl;
+    cout << "./ProofOfSpace pipeline -n <count> -i <id1,id2,...> -m <memo1,memo2,...>" << endl;
+    cout << "    (one id and one memo per plot, since the memo holds the keys that farm it)"
+         << endl;
     cout << "./ProofOfSpace prove <challenge>" << endl;
     cout << "./ProofOfSpace verify <proof> <challenge>" << endl;
     cout << "./ProofOfSpace check" << endl;
@@ -83,7 +87,19 @@ int main(int argc, char *argv[]) try {
     string id = "022fb42c08c12de3a6af053880199806532e79515f94e83461612101f9412f9e";
     bool nobitfield = false;
     bool show_progress = false;
+    bool direct_io = false;
+    bool uring = false;
+    bool dynamic_stripes = false;
+    bool in_memory = false;
+    bool packed_temp = false;
+    bool compressed_temp = false;
+    uint32_t bucket_ram_megabytes = 0;
     uint32_t buffmegabytes = 0;
+    bool background_copy = false;
+    uint32_t copy_megabytes_per_second = 0;
+    uint32_t num_plots = 1;
+    uint32_t memory_megabytes = 0;
+    bool pin_threads = false;
 
     options.allow_unrecognised_options().add_options()(
             "k, size", "Plot size", cxxopts::value<uint8_t>(k))(
@@ -94,14 +110,39 @@ int main(int argc, char *argv[]) try {
         "2, tempdir2", "Second Temporary directory", cxxopts::value<string>(tempdir2))(
         "d, finaldir", "Final directory", cxxopts::value<string>(finaldir))(
         "f, file", "Filename", cxxopts::value<string>(filename))(
-        "m, memo", "Memo to insert into the plot", cxxopts::value<string>(memo))(
-        "i, id", "Unique 32-byte seed for the plot", cxxopts::value<string>(id))(
+        "m, memo", "Memo to insert into the plot (pipeline: one per plot, comma separated)",
+        cxxopts::value<string>(memo))(
+        "i, id", "Unique 32-byte seed for the plot (pipeline: one per plot, comma separated)",
+        cxxopts::value<string>(id))(
         "e, nobitfield", "Disable bitfield", cxxopts::value<bool>(nobitfield))(
         "b, buffer",
         "Megabytes to be used as buffer for sorting and plotting",
         cxxopts::value<uint32_t>(buffmegabytes))(
         "p, progress", "Display progress percentage during plotting",
         cxxopts::value<bool>(show_progress))(
+        "direct", "Bypass the page cache (O_DIRECT) for temp files",
+        cxxopts::value<bool>(direct_io))(
+        "uring", "Queue temp file writes through io_uring (Linux only)",
+        cxxopts::value<bool>(uring))(
+        "dynamic-stripes", "Phase 1 threads claim stripes as they go, rather than in turns",
+        cxxopts::value<bool>(dynamic_stripes))(
+        "in-memory", "Keep all temp files in memory, only write the final plot file",
+        cxxopts::value<bool>(in_memory))(
+        "packed", "Bit-pack the entries in the sort buckets, to write fewer temp bytes",
+        cxxopts::value<bool>(packed_temp))(
+        "compress", "Compress the sort bucket files, trading CPU time for temp I/O",
+        cxxopts::value<bool>(compressed_temp))(
+        "bucket-ram", "Megabytes of sort buckets to keep in memory before spilling to disk",
+        cxxopts::value<uint32_t>(bucket_ram_megabytes))(
+        "background-copy", "Copy the plot to the final directory on a thread of its own",
+        cxxopts::value<bool>(background_copy))(
+        "copy-limit", "Megabytes per second to copy the plot to the final directory at, at most",
+        cxxopts::value<uint32_t>(copy_megabytes_per_second))(
+        "n, count", "Number of plots the pipeline creates", cxxopts::value<uint32_t>(num_plots))(
+        "memory", "Megabytes the pipeline's overlapping plots may use together",
+        cxxopts::value<uint32_t>(memory_megabytes))(
+        "pin-threads", "Pin each plotting thread to a core of its own (Linux only)",
+        cxxopts::value<bool>(pin_threads))(
         "help", "Print help");
 
     auto result = options.parse(argc, argv);
@@ -111,28 +152,48 @@ int main(int argc, char *argv[]) try {
     }
     operation = argv[1];
     std::cout << "operation: " << operation << std::endl;
+    if (pin_threads) {
+        ThreadPool::Global().SetPinning(true);
+    }
+    if (uring) {
+        FileDisk::URingEnabled() = true;
+    }
 
     if (operation == "help") {
         HelpAndQuit(options);
-    } else if (operation == "create") {
+    } else if (operation == "create" || operation == "pipeline") {
         cout << "Generating plot for k=" << static_cast<int>(k) << " filename=" << filename
              << " id=" << id << endl
              << endl;
-        id = Strip0x(id);
-        if (id.size() != 64) {
-            cout << "Invalid ID, should be 32 bytes (hex)" << endl;
+        // Every plot needs an id and a memo of its own: a plot can only be
+        // farmed with the keys in its memo, which are tied to its id. A
+        // single plot takes them as they are.
+        bool const pipeline = operation == "pipeline";
+        vector<string> const ids = pipeline ? Util::SplitList(id) : vector<string>{id};
+        vector<string> const memos = pipeline ? Util::SplitList(memo) : vector<string>{memo};
+        uint32_t const plots = pipeline ? num_plots : 1;
+        if (ids.size() != plots || memos.size() != plots) {
+            cout << "Expected " << plots << " ids and memos, one per plot, got " << ids.size()
+                 << " ids and " << memos.size() << " memos" << endl;
             exit(1);
         }
-        memo = Strip0x(memo);
-        if (memo.size() % 2 != 0) {
-            cout << "Invalid memo, should be only whole bytes (hex)" << endl;
-            exit(1);
+        vector<std::array<uint8_t, 32>> id_bytes(plots);
+        vector<vector<uint8_t>> memo_bytes(plots);
+        for (uint32_t i = 0; i < plots; i++) {
+            string const plot_id = Strip0x(ids[i]);
+            if (plot_id.size() != 64) {
+                cout << "Invalid ID, should be 32 bytes (hex)" << endl;
+                exit(1);
+            }
+            string const plot_memo = Strip0x(memos[i]);
+            if (plot_memo.size() % 2 != 0) {
+                cout << "Invalid memo, should be only whole bytes (hex)" << endl;
+                exit(1);
+            }
+            memo_bytes[i].resize(plot_memo.size() / 2);
+            HexToBytes(plot_memo, memo_bytes[i].data());
+            HexToBytes(plot_id, id_bytes[i].data());
         }
-        std::vector<uint8_t> memo_bytes(memo.size() / 2);
-        std::array<uint8_t, 32> id_bytes;
-
-        HexToBytes(memo, memo_bytes.data());
-        HexToBytes(id, id_bytes.data());
 
         DiskPlotter plotter = DiskPlotter();
         uint8_t phases_flags = 0;
@@ -142,21 +203,75 @@ int main(int argc, char *argv[]) try {
         if (show_progress) {
             phases_flags = phases_flags | SHOW_PROGRESS;
         }
-        plotter.CreatePlotDisk(
-                tempdir,
-                tempdir2,
-                finaldir,
-                filename,
-                k,
-                memo_bytes.data(),
-                memo_bytes.size(),
-                id_bytes.data(),
-                id_bytes.size(),
-                buffmegabytes,
-                num_buckets,
-                num_stripes,
-                num_threads,
-                phases_flags);
+        if (direct_io) {
+            phases_flags = phases_flags | DIRECT_IO;
+        }
+        if (dynamic_stripes) {
+            phases_flags = phases_flags | DYNAMIC_STRIPES;
+        }
+        if (in_memory) {
+            phases_flags = phases_flags | IN_MEMORY;
+        }
+        if (packed_temp) {
+            phases_flags = phases_flags | PACKED_TEMP;
+        }
+        if (compressed_temp) {
+            phases_flags = phases_flags | COMPRESSED_TEMP;
+        }
+        if (pipeline) {
+            // Two plots overlap by default
+            if (memory_megabytes == 0) {
+                memory_megabytes = 2 * (buffmegabytes == 0 ? 4608 : buffmegabytes);
+            }
+            PlotScheduler scheduler(memory_megabytes, num_threads);
+            fs::path const name(filename);
+            for (uint32_t i = 0; i < num_plots; i++) {
+                PlotJob job;
+                job.tmp_dirname = tempdir;
+                job.tmp2_dirname = tempdir2;
+                job.final_dirname = finaldir;
+                job.memo = memo_bytes[i];
+                job.id.assign(id_bytes[i].begin(), id_bytes[i].end());
+                job.filename = filename;
+                if (i > 0) {
+                    // The following plots are named plot-1.dat etc.
+                    job.filename =
+                        name.stem().string() + "-" + std::to_string(i) + name.extension().string();
+                }
+                job.k = k;
+                job.buf_megabytes = buffmegabytes;
+                job.num_buckets = num_buckets;
+                job.stripe_size = num_stripes;
+                job.phases_flags = phases_flags;
+                job.bucket_ram_megabytes = bucket_ram_megabytes;
+                job.copy_megabytes_per_second = copy_megabytes_per_second;
+                scheduler.Add(std::move(job));
+            }
+            scheduler.Run();
+        } else {
+            plotter.CreatePlotDisk(
+                    tempdir,
+                    tempdir2,
+                    finaldir,
+                    filename,
+                    k,
+                    memo_bytes[0].data(),
+                    memo_bytes[0].size(),
+                    id_bytes[0].data(),
+                    id_bytes[0].size(),
+                    buffmegabytes,
+                    num_buckets,
+                    num_stripes,
+                    num_threads,
+                    phases_flags,
+                    bucket_ram_megabytes,
+                    copy_megabytes_per_second,
+                    background_copy);
+            if (plotter.PendingCopies() > 0) {
+                cout << "Waiting for the plot to be copied to " << finaldir << endl;
+            }
+            plotter.WaitForCopies();
+        }
     } else if (operation == "prove") {
         if (argc < 3) {
             HelpAndQuit(options);
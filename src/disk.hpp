@@ -16,6 +16,7 @@
 #define SRC_CPP_DISK_HPP_
 
 #include <algorithm>
+#include <atomic>
 #include <fstream>
 #include <iostream>
 #include <string>
@@ -23,6 +24,11 @@
 #include <thread>
 #include <chrono>
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 // enables disk I/O logging to disk.log
 // use tools/disk.gnuplot to generate a plot
 #define ENABLE_LOGGING 0
@@ -34,10 +40,88 @@ using namespace std::chrono_literals; // for operator""min;
 #include "./bits.hpp"
 #include "./util.hpp"
 #include "bitfield.hpp"
+#include "phases.hpp"
+#include "uring.hpp"
+
+#if defined(__linux__) && defined(O_DIRECT)
+#define HAVE_DIRECT_IO 1
+#endif
 
 constexpr uint64_t write_cache = 1024 * 1024;
 constexpr uint64_t read_ahead = 1024 * 1024;
 
+// With io_uring, how many bytes of writes each FileDisk may have in flight.
+// A single larger write is still allowed.
+constexpr uint64_t uring_in_flight = 2 * 1024 * 1024;
+// Writes are passed to the kernel in batches of this many
+constexpr uint32_t uring_batch = 4;
+
+// With direct I/O, file offsets, lengths and memory buffers have to be aligned
+// to this
+constexpr uint64_t direct_alignment = 4096;
+// Direct I/O that isn't aligned goes through a bounce buffer of this size
+constexpr uint64_t direct_buffer = 1024 * 1024;
+
+// Each region of a RegionWriter buffers this much
+constexpr uint64_t region_buffer = 4 * 1024 * 1024;
+
+// In-memory files are allocated in chunks of this size
+constexpr uint64_t memory_chunk = 64 * 1024 * 1024;
+// The in-memory part of files with a MemoryBudget grows in steps of this size
+constexpr uint64_t tier_chunk = 4 * 1024 * 1024;
+
+// Memory shared by a group of FileDisks (e.g. the buckets of the sort
+// managers) to keep the start of their data in. What doesn't fit goes to the
+// files.
+class MemoryBudget {
+public:
+    explicit MemoryBudget(uint64_t const bytes) : available_(bytes) {}
+
+    // Takes bytes from the budget. Returns false, taking nothing, if there
+    // isn't that much left
+    bool Take(uint64_t const bytes)
+    {
+        uint64_t available = available_.load();
+        do {
+            if (available < bytes) return false;
+        } while (!available_.compare_exchange_weak(available, available - bytes));
+        return true;
+    }
+
+    void Give(uint64_t const bytes) { available_ += bytes; }
+
+    uint64_t Available() const { return available_; }
+
+private:
+    std::atomic<uint64_t> available_;
+};
+
+// Where a FileDisk keeps its data
+enum class file_mode_t : uint8_t {
+    // A file, going through the page cache
+    buffered,
+    // A file, bypassing the page cache where the platform supports it
+    direct,
+    // Only in memory, the file is never created
+    memory,
+};
+
+// The mode of the temp files, given the phase flags
+inline file_mode_t TempFileMode(uint8_t const flags)
+{
+    if (flags & IN_MEMORY) return file_mode_t::memory;
+    if (flags & DIRECT_IO) return file_mode_t::direct;
+    return file_mode_t::buffered;
+}
+
+// Returns the first address in buffer that's aligned for direct I/O. buffer
+// must have direct_alignment - 1 bytes to spare.
+inline uint8_t *AlignForDirectIO(uint8_t *buffer)
+{
+    uintptr_t const p = reinterpret_cast<uintptr_t>(buffer);
+    return buffer + ((direct_alignment - p % direct_alignment) % direct_alignment);
+}
+
 struct Disk {
     virtual uint8_t const* Read(uint64_t begin, uint64_t length) = 0;
     virtual void Write(uint64_t begin, const uint8_t *memcache, uint64_t length) = 0;
@@ -98,7 +182,26 @@ void disk_log(fs::path const& filename, op_t const op, uint64_t offset, uint64_t
 #endif
 
 struct FileDisk {
-    explicit FileDisk(const fs::path &filename)
+    // In direct mode, the file bypasses the page cache where the platform
+    // supports it. On Linux that means O_DIRECT, with unaligned reads and
+    // writes going through an aligned bounce buffer. If the filesystem doesn't
+    // support it, the file is opened normally.
+    //
+    // In memory mode, no file is created. The data is kept in chunks of
+    // memory_chunk bytes, and stays until the FileDisk is truncated, removed or
+    // destroyed. Closing it doesn't drop the data.
+    //
+    // Otherwise, with a budget, the start of the data is kept in memory, as
+    // long as the budget lasts, and the rest goes to the file. Once anything
+    // has gone to the file, the in-memory part stops growing.
+    explicit FileDisk(
+        const fs::path &filename,
+        file_mode_t const mode = file_mode_t::buffered,
+        MemoryBudget *const budget = nullptr)
+        : direct_(mode == file_mode_t::direct)
+        , memory_(mode == file_mode_t::memory)
+        , budget_(memory_ ? nullptr : budget)
+        , chunk_size_(memory_ ? memory_chunk : tier_chunk)
     {
         filename_ = filename;
         Open(writeFlag);
@@ -107,7 +210,11 @@ struct FileDisk {
     void Open(uint8_t flags = 0)
     {
         // if the file is already open, don't do anything
-        if (f_) return;
+        if (f_ || memory_) return;
+#if HAVE_DIRECT_IO
+        if (fd_ >= 0) return;
+        if (direct_ && OpenDirect(flags)) return;
+#endif
 
         // Opens the file for reading and writing
         do {
@@ -115,6 +222,11 @@ struct FileDisk {
             f_ = ::_wfopen(filename_.c_str(), (flags & writeFlag) ? L"w+b" : L"r+b");
 #else
             f_ = ::fopen(filename_.c_str(), (flags & writeFlag) ? "w+b" : "r+b");
+#endif
+#ifdef __APPLE__
+            if (f_ != nullptr && direct_) {
+                ::fcntl(fileno(f_), F_NOCACHE, 1);
+            }
 #endif
             if (f_ == nullptr) {
                 std::string error_message =
@@ -134,6 +246,32 @@ struct FileDisk {
         filename_ = std::move(fd.filename_);
         f_ = fd.f_;
         fd.f_ = nullptr;
+        direct_ = fd.direct_;
+        memory_ = fd.memory_;
+        chunks_ = std::move(fd.chunks_);
+        fd.chunks_.clear();
+        memory_size_ = fd.memory_size_;
+        budget_ = fd.budget_;
+        chunk_size_ = fd.chunk_size_;
+        ram_end_ = fd.ram_end_;
+        frozen_ = fd.frozen_;
+#if HAVE_DIRECT_IO
+        fd_ = fd.fd_;
+        fd.fd_ = -1;
+        data_end_ = fd.data_end_;
+        padded_end_ = fd.padded_end_;
+        direct_alloc_ = std::move(fd.direct_alloc_);
+        direct_buf_ = fd.direct_buf_;
+        tail_block_ = fd.tail_block_;
+        tail_block_offset_ = fd.tail_block_offset_;
+#endif
+#if HAVE_URING
+        ring_ = std::move(fd.ring_);
+        pending_writes_ = std::move(fd.pending_writes_);
+        in_flight_ = fd.in_flight_;
+        fd.in_flight_ = 0;
+        last_id_ = fd.last_id_;
+#endif
     }
 
     FileDisk(const FileDisk &) = delete;
@@ -141,21 +279,195 @@ struct FileDisk {
 
     void Close()
     {
+#if HAVE_DIRECT_IO
+        if (fd_ >= 0) {
+            CloseDirect();
+            return;
+        }
+#endif
         if (f_ == nullptr) return;
+#if HAVE_URING
+        WaitForWrites();
+        ring_.reset();
+#endif
         ::fclose(f_);
         f_ = nullptr;
         readPos = 0;
         writePos = 0;
     }
 
-    ~FileDisk() { Close(); }
+    ~FileDisk()
+    {
+        Close();
+        if (budget_) {
+            budget_->Give(chunks_.size() * chunk_size_);
+        }
+    }
+
+    // On Linux, reads and writes can go through an io_uring, if the kernel
+    // supports it. Writes are then copied and queued, so several of them can be
+    // in flight while the caller carries on. It's off by default. This turns it
+    // on or off for FileDisks opened from now on.
+    static std::atomic<bool> &URingEnabled()
+    {
+        static std::atomic<bool> enabled{false};
+        return enabled;
+    }
 
     void Read(uint64_t begin, uint8_t *memcache, uint64_t length)
     {
+        if (memory_) {
+            ReadMemory(begin, memcache, length);
+            return;
+        }
+        if (budget_) {
+            if (begin < ram_end_) {
+                uint64_t const n = std::min(length, ram_end_ - begin);
+                ReadMemory(begin, memcache, n);
+                begin += n;
+                memcache += n;
+                length -= n;
+                if (length == 0) return;
+            }
+            // the file holds what comes after the in-memory part
+            begin -= ram_end_;
+        }
         Open(retryOpenFlag);
 #if ENABLE_LOGGING
         disk_log(filename_, op_t::read, begin, length);
 #endif
+#if HAVE_DIRECT_IO
+        if (fd_ >= 0) {
+            ReadDirect(begin, memcache, length);
+            return;
+        }
+#endif
+#if HAVE_URING
+        if (NeedRing()) {
+            // a read may overlap any of the queued writes
+            WaitForWrites();
+            while (length > 0) {
+                uint32_t const chunk = std::min<uint64_t>(length, 1U << 30);
+                uint64_t const id = ++last_id_;
+                int32_t result = -EAGAIN;
+                if (ring_->Prepare(IORING_OP_READ, fileno(f_), memcache, chunk, begin, id)) {
+                    WaitCompletion(id, result);
+                }
+                if (result <= 0 || uint32_t(result) > chunk) {
+                    // errors, and reading past the end, are handled by the
+                    // stdio path
+                    break;
+                }
+                begin += result;
+                memcache += result;
+                length -= result;
+            }
+            if (length == 0) return;
+            // drop anything stdio buffered from earlier reads, it may be stale
+            ::fflush(f_);
+        }
+#endif
+        ReadStdio(begin, memcache, length);
+    }
+
+    void Write(uint64_t begin, const uint8_t *memcache, uint64_t length)
+    {
+        if (memory_) {
+            WriteMemory(begin, memcache, length);
+            return;
+        }
+        if (budget_) {
+            writeMax = std::max(writeMax, begin + length);
+            if (!frozen_ && begin + length > ram_end_) {
+                ReserveMemory(begin + length);
+            }
+            if (begin < ram_end_) {
+                uint64_t const n = std::min(length, ram_end_ - begin);
+                WriteMemory(begin, memcache, n);
+                begin += n;
+                memcache += n;
+                length -= n;
+                if (length == 0) return;
+            }
+            // anything not written in the in-memory part reads as zeros
+            frozen_ = true;
+            memory_size_ = ram_end_;
+            begin -= ram_end_;
+        }
+        Open(writeFlag | retryOpenFlag);
+#if ENABLE_LOGGING
+        disk_log(filename_, op_t::write, begin, length);
+#endif
+#if HAVE_DIRECT_IO
+        if (fd_ >= 0) {
+            WriteDirect(begin, memcache, length);
+            return;
+        }
+#endif
+#if HAVE_URING
+        if (NeedRing()) {
+            WriteURing(begin, memcache, length);
+            return;
+        }
+#endif
+        WriteStdio(begin, memcache, length);
+    }
+
+    std::string GetFileName() { return filename_.string(); }
+
+    uint64_t GetWriteMax() const noexcept { return writeMax; }
+
+    // Whether the file bypasses the page cache. Readers and writers can then
+    // avoid the bounce buffer by using aligned buffers and offsets.
+    bool IsDirect() const noexcept { return direct_; }
+
+    bool IsInMemory() const noexcept { return memory_; }
+
+    void Truncate(uint64_t new_size)
+    {
+        if (memory_) {
+            TruncateMemory(new_size);
+            return;
+        }
+        if (budget_) {
+            if (new_size <= ram_end_) {
+                uint64_t const keep = cdiv(new_size, chunk_size_);
+                budget_->Give((chunks_.size() - keep) * chunk_size_);
+                TruncateMemory(new_size);
+                ram_end_ = keep * chunk_size_;
+                frozen_ = false;
+                Close();
+                // the file may never have been created, or already removed
+                if (fs::exists(filename_)) {
+                    fs::resize_file(filename_, 0);
+                }
+                return;
+            }
+            new_size -= ram_end_;
+        }
+        Close();
+        fs::resize_file(filename_, new_size);
+    }
+
+    // Closes and deletes the file, and frees the memory it used
+    void Remove()
+    {
+        if (budget_) {
+            budget_->Give(chunks_.size() * chunk_size_);
+        }
+        chunks_.clear();
+        memory_size_ = 0;
+        ram_end_ = 0;
+        frozen_ = false;
+        if (memory_) return;
+        Close();
+        fs::remove(filename_);
+    }
+
+private:
+
+    void ReadStdio(uint64_t begin, uint8_t *memcache, uint64_t length)
+    {
         // Seek, read, and replace into memcache
         uint64_t amtread;
         do {
@@ -185,12 +497,8 @@ struct FileDisk {
         } while (amtread != length);
     }
 
-    void Write(uint64_t begin, const uint8_t *memcache, uint64_t length)
+    void WriteStdio(uint64_t begin, const uint8_t *memcache, uint64_t length)
     {
-        Open(writeFlag | retryOpenFlag);
-#if ENABLE_LOGGING
-        disk_log(filename_, op_t::write, begin, length);
-#endif
         // Seek and write from memcache
         uint64_t amtwritten;
         do {
@@ -233,17 +541,458 @@ struct FileDisk {
         } while (amtwritten != length);
     }
 
-    std::string GetFileName() { return filename_.string(); }
+#if HAVE_URING
+    struct pending_write_t {
+        // The user_data of its operations. 0 while the slot is free.
+        uint64_t id = 0;
+        uint64_t begin;
+        uint64_t length;
+        // Bytes the kernel wrote so far
+        uint64_t done;
+        std::unique_ptr<uint8_t[]> buffer;
+    };
+
+    // Sets up the ring on first use. Returns false if io_uring can't be used
+    bool NeedRing()
+    {
+        if (ring_) return true;
+        if (!URingEnabled()) return false;
+        ring_ = URing::Create(uring_batch * 4);
+        if (!ring_) return false;
+        // anything stdio still buffers has to reach the file before the ring
+        // touches it
+        ::fflush(f_);
+        pending_writes_.resize(uring_batch * 4);
+        return true;
+    }
 
-    uint64_t GetWriteMax() const noexcept { return writeMax; }
+    void WriteURing(uint64_t const begin, const uint8_t *memcache, uint64_t const length)
+    {
+        if (length == 0) return;
+        // Writes of 1 GiB or more are rare enough to not be worth splitting
+        if (length >= (1U << 30)) {
+            WaitForWrites();
+            WriteStdio(begin, memcache, length);
+            ::fflush(f_);
+            return;
+        }
+        while (in_flight_ > 0 && in_flight_ + length > uring_in_flight) {
+            CompleteWrite();
+        }
+        // The kernel may complete queued writes in any order, so a write
+        // waits for the ones in flight it overlaps
+        while (Overlaps(begin, length)) {
+            CompleteWrite();
+        }
 
-    void Truncate(uint64_t new_size)
+        pending_write_t *w = FreeSlot();
+        while (w == nullptr) {
+            CompleteWrite();
+            w = FreeSlot();
+        }
+        w->buffer.reset(new uint8_t[length]);
+        ::memcpy(w->buffer.get(), memcache, length);
+        w->id = ++last_id_;
+        w->begin = begin;
+        w->length = length;
+        w->done = 0;
+        in_flight_ += length;
+        PrepareWrite(*w);
+        if (ring_->Queued() >= uring_batch) {
+            ring_->Submit(0);
+        }
+        writeMax = std::max(writeMax, begin + length);
+    }
+
+    bool Overlaps(uint64_t const begin, uint64_t const length) const
     {
-        Close();
-        fs::resize_file(filename_, new_size);
+        for (pending_write_t const &w : pending_writes_) {
+            if (w.id != 0 && w.begin < begin + length && begin < w.begin + w.length) {
+                return true;
+            }
+        }
+        return false;
     }
 
-private:
+    pending_write_t *FreeSlot()
+    {
+        for (pending_write_t &w : pending_writes_) {
+            if (w.id == 0) return &w;
+        }
+        return nullptr;
+    }
+
+    // Queues what's left of w. The ring has room for every slot.
+    void PrepareWrite(pending_write_t &w)
+    {
+        ring_->Prepare(
+            IORING_OP_WRITE,
+            fileno(f_),
+            w.buffer.get() + w.done,
+            w.length - w.done,
+            w.begin + w.done,
+            w.id);
+    }
+
+    // Waits for the operation with user_data id to complete. Writes that
+    // complete in the meantime are finished.
+    void WaitCompletion(uint64_t const id, int32_t &result)
+    {
+        for (;;) {
+            uint64_t user_data;
+            ring_->WaitCompletion(user_data, result);
+            if (user_data == id) return;
+            FinishWrite(user_data, result);
+        }
+    }
+
+    // Waits for one queued write to complete
+    void CompleteWrite()
+    {
+        uint64_t user_data;
+        int32_t result;
+        ring_->WaitCompletion(user_data, result);
+        FinishWrite(user_data, result);
+    }
+
+    // Frees the slot of the write with user_data id once all of it is written.
+    // What's left of a short write is queued again, and failures are retried
+    // every five minutes, like the stdio path. The write stays in flight until
+    // then, so no later write overlapping it lands first.
+    void FinishWrite(uint64_t const id, int32_t const result)
+    {
+        auto w = std::find_if(
+            pending_writes_.begin(), pending_writes_.end(), [id](pending_write_t const &p) {
+                return p.id == id;
+            });
+        if (w == pending_writes_.end()) return;
+        if (result <= 0 || uint64_t(result) > w->length - w->done) {
+            if (result != -EINTR && result != -EAGAIN) {
+                std::cout << "Only wrote " << w->done << " of " << w->length
+                          << " bytes at offset " << w->begin << " to " << filename_
+                          << ". Error " << -result << ". Retrying in five minutes."
+                          << std::endl;
+                std::this_thread::sleep_for(5min);
+            }
+        } else {
+            w->done += result;
+        }
+        if (w->done < w->length) {
+            PrepareWrite(*w);
+            ring_->Submit(0);
+            return;
+        }
+        in_flight_ -= w->length;
+        w->id = 0;
+        w->length = 0;
+        w->buffer.reset();
+    }
+
+    void WaitForWrites()
+    {
+        if (!ring_) return;
+        while (in_flight_ > 0) {
+            CompleteWrite();
+        }
+    }
+
+    std::unique_ptr<URing> ring_;
+    // The writes in flight, in no particular order
+    std::vector<pending_write_t> pending_writes_;
+    uint64_t in_flight_ = 0;
+    // The user_data of the last operation queued
+    uint64_t last_id_ = 0;
+#endif
+
+#if HAVE_DIRECT_IO
+    // Returns false if the file should be opened with stdio instead
+    bool OpenDirect(uint8_t const flags)
+    {
+        int const oflags = O_RDWR | O_DIRECT | O_CLOEXEC
+            | ((flags & writeFlag) ? O_CREAT | O_TRUNC : 0);
+        do {
+            fd_ = ::open(filename_.c_str(), oflags, 0644);
+            if (fd_ < 0) {
+                if (errno == EINVAL) {
+                    // The filesystem doesn't support O_DIRECT (e.g. tmpfs)
+                    static std::atomic<bool> warned{false};
+                    if (!warned.exchange(true)) {
+                        std::cout << "Direct I/O is not supported for " << filename_
+                                  << ", using buffered I/O" << std::endl;
+                    }
+                    direct_ = false;
+                    return false;
+                }
+                std::string error_message =
+                    "Could not open " + filename_.string() + ": " + ::strerror(errno) + ".";
+                if (flags & retryOpenFlag) {
+                    std::cout << error_message << " Retrying in five minutes." << std::endl;
+                    std::this_thread::sleep_for(5min);
+                } else {
+                    throw InvalidValueException(error_message);
+                }
+            }
+        } while (fd_ < 0);
+
+        data_end_ = ::lseek(fd_, 0, SEEK_END);
+        padded_end_ = data_end_;
+        tail_block_offset_ = UINT64_MAX;
+        if (!direct_alloc_) {
+            direct_alloc_.reset(new uint8_t[direct_buffer + 2 * direct_alignment - 1]);
+            direct_buf_ = AlignForDirectIO(direct_alloc_.get());
+            tail_block_ = direct_buf_ + direct_buffer;
+        }
+        return true;
+    }
+
+    void CloseDirect()
+    {
+        // Writes are padded to whole blocks, cut the file back to the data
+        if (padded_end_ > data_end_) {
+            if (::ftruncate(fd_, data_end_) != 0) {
+                std::cout << "Could not truncate " << filename_ << " to " << data_end_
+                          << ". Error " << ::strerror(errno) << std::endl;
+            }
+        }
+        ::close(fd_);
+        fd_ = -1;
+    }
+
+    // Reads or writes exactly length bytes, where offset, length and buffer
+    // are aligned. Reads past the end of the file return zeros.
+    void TransferDirect(
+        bool const write,
+        uint64_t const offset,
+        uint8_t *buffer,
+        uint64_t const length)
+    {
+        uint64_t done = 0;
+        while (done < length) {
+            ssize_t const ret = write
+                ? ::pwrite(fd_, buffer + done, length - done, offset + done)
+                : ::pread(fd_, buffer + done, length - done, offset + done);
+            if (ret < 0 && errno == EINTR) {
+                continue;
+            }
+            if (ret == 0 && !write) {
+                ::memset(buffer + done, 0, length - done);
+                return;
+            }
+            if (ret <= 0) {
+                std::cout << "Only " << (write ? "wrote " : "read ") << done << " of " << length
+                          << " bytes at offset " << offset << (write ? " to " : " from ")
+                          << filename_ << " with length " << writeMax << ". Error "
+                          << ::strerror(errno) << ". Retrying in five minutes." << std::endl;
+                // Close, and reopen the file to recover in case the
+                // filesystem has been remounted.
+                CloseDirect();
+                std::this_thread::sleep_for(5min);
+                Open(retryOpenFlag);
+                continue;
+            }
+            done += ret;
+        }
+    }
+
+    // Reads the aligned block at offset into dest, the part of it that has been
+    // written, at least
+    void LoadBlock(uint64_t const offset, uint8_t *dest)
+    {
+        if (offset == tail_block_offset_) {
+            ::memcpy(dest, tail_block_, direct_alignment);
+        } else if (offset >= data_end_) {
+            ::memset(dest, 0, direct_alignment);
+        } else {
+            TransferDirect(false, offset, dest, direct_alignment);
+        }
+    }
+
+    void ReadDirect(uint64_t begin, uint8_t *memcache, uint64_t length)
+    {
+        if (begin + length > data_end_) {
+            std::cout << "Only read " << (begin < data_end_ ? data_end_ - begin : 0) << " of "
+                      << length << " bytes at offset " << begin << " from " << filename_
+                      << " with length " << data_end_ << std::endl;
+            throw InvalidStateException("Read past the end of " + filename_.string());
+        }
+        while (length > 0) {
+            if (begin % direct_alignment == 0 && AlignForDirectIO(memcache) == memcache
+                && length >= direct_alignment) {
+                uint64_t const n = std::min<uint64_t>(length, 1U << 30) & ~(direct_alignment - 1);
+                TransferDirect(false, begin, memcache, n);
+                begin += n;
+                memcache += n;
+                length -= n;
+                continue;
+            }
+            uint64_t const block = begin & ~(direct_alignment - 1);
+            uint64_t const span = std::min(
+                (begin + length - block + direct_alignment - 1) & ~(direct_alignment - 1),
+                direct_buffer);
+            TransferDirect(false, block, direct_buf_, span);
+            uint64_t const n = std::min(length, block + span - begin);
+            ::memcpy(memcache, direct_buf_ + (begin - block), n);
+            begin += n;
+            memcache += n;
+            length -= n;
+        }
+    }
+
+    void WriteDirect(uint64_t begin, const uint8_t *memcache, uint64_t length)
+    {
+        uint64_t const end = begin + length;
+        writeMax = std::max(writeMax, end);
+        data_end_ = std::max(data_end_, end);
+        while (begin < end) {
+            if (begin % direct_alignment == 0
+                && AlignForDirectIO(const_cast<uint8_t *>(memcache)) == memcache
+                && end - begin >= direct_alignment) {
+                uint64_t const n =
+                    std::min<uint64_t>(end - begin, 1U << 30) & ~(direct_alignment - 1);
+                TransferDirect(true, begin, const_cast<uint8_t *>(memcache), n);
+                if (tail_block_offset_ >= begin && tail_block_offset_ < begin + n) {
+                    tail_block_offset_ = UINT64_MAX;
+                }
+                padded_end_ = std::max(padded_end_, begin + n);
+                begin += n;
+                memcache += n;
+                continue;
+            }
+            // Read-modify-write of the blocks the write only covers part of
+            uint64_t const block = begin & ~(direct_alignment - 1);
+            uint64_t const span = std::min(
+                (end - block + direct_alignment - 1) & ~(direct_alignment - 1), direct_buffer);
+            uint64_t const last_block = block + span - direct_alignment;
+            if (begin > block) {
+                LoadBlock(block, direct_buf_);
+            }
+            if (end < block + span && (last_block != block || begin == block)) {
+                LoadBlock(last_block, direct_buf_ + span - direct_alignment);
+            }
+            uint64_t const n = std::min(end, block + span) - begin;
+            ::memcpy(direct_buf_ + (begin - block), memcache, n);
+            TransferDirect(true, block, direct_buf_, span);
+
+            if (end < block + span) {
+                // The next sequential write will start in this block, keep it
+                // around rather than reading it back
+                ::memcpy(tail_block_, direct_buf_ + span - direct_alignment, direct_alignment);
+                tail_block_offset_ = last_block;
+            } else if (tail_block_offset_ >= block && tail_block_offset_ < block + span) {
+                tail_block_offset_ = UINT64_MAX;
+            }
+            padded_end_ = std::max(padded_end_, block + span);
+            begin += n;
+            memcache += n;
+        }
+    }
+
+    int fd_ = -1;
+    // The end of the data written to the file. The file itself may extend
+    // further, to the end of the last block, until it's closed
+    uint64_t data_end_ = 0;
+    uint64_t padded_end_ = 0;
+    std::unique_ptr<uint8_t[]> direct_alloc_;
+    // aligned, direct_buffer bytes
+    uint8_t *direct_buf_ = nullptr;
+    // A copy of the block at tail_block_offset_, which the last write ended
+    // in the middle of
+    uint8_t *tail_block_ = nullptr;
+    uint64_t tail_block_offset_ = UINT64_MAX;
+#endif
+
+    void ReadMemory(uint64_t begin, uint8_t *memcache, uint64_t length)
+    {
+        if (begin + length > memory_size_) {
+            throw InvalidStateException(
+                "Read past the end of in-memory file " + filename_.string() + " (" +
+                std::to_string(begin + length) + " > " + std::to_string(memory_size_) + ")");
+        }
+        while (length > 0) {
+            uint64_t const offset = begin % chunk_size_;
+            uint64_t const n = std::min(length, chunk_size_ - offset);
+            auto const &chunk = chunks_[begin / chunk_size_];
+            if (chunk) {
+                ::memcpy(memcache, chunk.get() + offset, n);
+            } else {
+                // never written to
+                ::memset(memcache, 0, n);
+            }
+            begin += n;
+            memcache += n;
+            length -= n;
+        }
+    }
+
+    void WriteMemory(uint64_t begin, const uint8_t *memcache, uint64_t length)
+    {
+        uint64_t const end = begin + length;
+        if (end > memory_size_) {
+            memory_size_ = end;
+            chunks_.resize(std::max<uint64_t>(chunks_.size(), cdiv(end, chunk_size_)));
+        }
+        writeMax = std::max(writeMax, end);
+        while (length > 0) {
+            uint64_t const offset = begin % chunk_size_;
+            uint64_t const n = std::min(length, chunk_size_ - offset);
+            auto &chunk = chunks_[begin / chunk_size_];
+            if (!chunk) {
+                // calloc() gets large blocks straight from the OS, so only the
+                // pages that are written to take up memory
+                chunk.reset(static_cast<uint8_t *>(::calloc(chunk_size_, 1)));
+                if (!chunk) {
+                    throw InsufficientMemoryException(
+                        "Could not allocate memory for in-memory file " + filename_.string());
+                }
+            }
+            ::memcpy(chunk.get() + offset, memcache, n);
+            begin += n;
+            memcache += n;
+            length -= n;
+        }
+    }
+
+    void TruncateMemory(uint64_t const new_size)
+    {
+        chunks_.resize(cdiv(new_size, chunk_size_));
+        uint64_t const tail = new_size % chunk_size_;
+        if (new_size < memory_size_ && tail != 0 && chunks_.back()) {
+            // if the file grows again, this has to read as zeros
+            ::memset(chunks_.back().get() + tail, 0, chunk_size_ - tail);
+        }
+        memory_size_ = new_size;
+    }
+
+    // Grows the in-memory part to cover end, as far as the budget allows
+    void ReserveMemory(uint64_t const end)
+    {
+        while (ram_end_ < end) {
+            if (!budget_->Take(chunk_size_)) {
+                frozen_ = true;
+                return;
+            }
+            chunks_.emplace_back();
+            ram_end_ += chunk_size_;
+        }
+    }
+
+    struct free_deleter {
+        void operator()(uint8_t *p) const { ::free(p); }
+    };
+
+    bool direct_ = false;
+    bool memory_ = false;
+    // The data of an in-memory file. Chunks that were never written to are
+    // null, and read as zeros
+    std::vector<std::unique_ptr<uint8_t, free_deleter>> chunks_;
+    uint64_t memory_size_ = 0;
+    // With a budget, the first ram_end_ bytes are in chunks_, taken from
+    // budget_, and the file holds the rest. Once frozen_, the file has data,
+    // and ram_end_ can't move.
+    MemoryBudget *budget_ = nullptr;
+    uint64_t chunk_size_ = memory_chunk;
+    uint64_t ram_end_ = 0;
+    bool frozen_ = false;
 
     uint64_t readPos = 0;
     uint64_t writePos = 0;
@@ -272,7 +1021,7 @@ struct BufferedDisk : Disk
             && read_buffer_start_ + read_ahead >= begin + length + 7)
         {
             // if the read is entirely inside the buffer, just return it
-            return read_buffer_.get() + (begin - read_buffer_start_);
+            return read_buffer_ + (begin - read_buffer_start_);
         }
         else if (begin >= read_buffer_start_ || begin == 0 || read_buffer_start_ == std::uint64_t(-1)) {
 
@@ -284,11 +1033,15 @@ struct BufferedDisk : Disk
             // begin == 0 won't reliably detect that case, sinec we may have
             // discarded the first entry and start at some low offset but still
             // greater than 0
-            read_buffer_start_ = begin;
+            // With direct I/O, start at a block boundary so the read can go
+            // straight into the (aligned) buffer
+            read_buffer_start_ =
+                disk_->IsDirect() ? begin & ~(direct_alignment - 1) : begin;
+            assert(begin - read_buffer_start_ + length + 7 <= read_ahead);
             uint64_t const amount_to_read = std::min(file_size_ - read_buffer_start_, read_ahead);
-            disk_->Read(begin, read_buffer_.get(), amount_to_read);
+            disk_->Read(read_buffer_start_, read_buffer_, amount_to_read);
             read_buffer_size_ = amount_to_read;
-            return read_buffer_.get();
+            return read_buffer_ + (begin - read_buffer_start_);
         }
         else {
             // ideally this won't happen
@@ -315,8 +1068,11 @@ struct BufferedDisk : Disk
     {
         NeedWriteCache();
         if (begin == write_buffer_start_ + write_buffer_size_) {
+            if (write_buffer_size_ + length > write_cache && disk_->IsDirect()) {
+                FlushAlignedPart();
+            }
             if (write_buffer_size_ + length <= write_cache) {
-                ::memcpy(write_buffer_.get() + write_buffer_size_, memcache, length);
+                ::memcpy(write_buffer_ + write_buffer_size_, memcache, length);
                 write_buffer_size_ += length;
                 return;
             }
@@ -325,7 +1081,7 @@ struct BufferedDisk : Disk
 
         if (write_buffer_size_ == 0 && write_cache >= length) {
             write_buffer_start_ = begin;
-            ::memcpy(write_buffer_.get() + write_buffer_size_, memcache, length);
+            ::memcpy(write_buffer_ + write_buffer_size_, memcache, length);
             write_buffer_size_ = length;
             return;
         }
@@ -347,8 +1103,10 @@ struct BufferedDisk : Disk
     {
         FlushCache();
 
-        read_buffer_.reset();
-        write_buffer_.reset();
+        read_alloc_.reset();
+        write_alloc_.reset();
+        read_buffer_ = nullptr;
+        write_buffer_ = nullptr;
         read_buffer_size_ = 0;
         write_buffer_size_ = 0;
     }
@@ -357,16 +1115,35 @@ struct BufferedDisk : Disk
     {
         if (write_buffer_size_ == 0) return;
 
-        disk_->Write(write_buffer_start_, write_buffer_.get(), write_buffer_size_);
+        disk_->Write(write_buffer_start_, write_buffer_, write_buffer_size_);
         write_buffer_size_ = 0;
     }
 
 private:
 
+    // Writes the write buffer up to the last block boundary, and moves the
+    // rest to the front. Once the buffer starts at a block boundary, it keeps
+    // doing so, which lets direct I/O skip the bounce buffer.
+    void FlushAlignedPart()
+    {
+        uint64_t const end =
+            (write_buffer_start_ + write_buffer_size_) & ~(direct_alignment - 1);
+        if (end <= write_buffer_start_) {
+            FlushCache();
+            return;
+        }
+        uint64_t const n = end - write_buffer_start_;
+        disk_->Write(write_buffer_start_, write_buffer_, n);
+        ::memmove(write_buffer_, write_buffer_ + n, write_buffer_size_ - n);
+        write_buffer_start_ = end;
+        write_buffer_size_ -= n;
+    }
+
     void NeedReadCache()
     {
         if (read_buffer_) return;
-        read_buffer_.reset(new uint8_t[read_ahead]);
+        read_alloc_.reset(new uint8_t[read_ahead + direct_alignment - 1]);
+        read_buffer_ = AlignForDirectIO(read_alloc_.get());
         read_buffer_start_ = -1;
         read_buffer_size_ = 0;
     }
@@ -374,7 +1151,8 @@ private:
     void NeedWriteCache()
     {
         if (write_buffer_) return;
-        write_buffer_.reset(new uint8_t[write_cache]);
+        write_alloc_.reset(new uint8_t[write_cache + direct_alignment - 1]);
+        write_buffer_ = AlignForDirectIO(write_alloc_.get());
         write_buffer_start_ = -1;
         write_buffer_size_ = 0;
     }
@@ -385,16 +1163,131 @@ private:
 
     // the file offset the read buffer was read from
     uint64_t read_buffer_start_ = -1;
-    std::unique_ptr<uint8_t[]> read_buffer_;
+    // the buffers are aligned for direct I/O, inside the allocations
+    std::unique_ptr<uint8_t[]> read_alloc_;
+    uint8_t *read_buffer_ = nullptr;
     uint64_t read_buffer_size_ = 0;
 
     // the file offset the write buffer should be written back to
     // the write buffer is *only* for contiguous and sequential writes
     uint64_t write_buffer_start_ = -1;
-    std::unique_ptr<uint8_t[]> write_buffer_;
+    std::unique_ptr<uint8_t[]> write_alloc_;
+    uint8_t *write_buffer_ = nullptr;
     uint64_t write_buffer_size_ = 0;
 };
 
+// Combines the writes to a few regions of a file into large writes. Each
+// region is written (mostly) front to back, and has a buffer of its own, so
+// interleaving writes to different regions doesn't turn into a seek per write.
+// Writes to a region may skip ahead (the gap is filled with zeros) or come a
+// little out of order, as long as they don't go back before what has already
+// been written out; those go straight to the file. A full buffer is written
+// out up to its last block boundary, and the rest is kept.
+//
+// Nothing that's written is visible in the file until it's flushed.
+class RegionWriter {
+public:
+    explicit RegionWriter(FileDisk& disk, uint64_t const buffer_size = region_buffer)
+        : disk_(disk), buffer_size_(buffer_size)
+    {
+    }
+
+    RegionWriter(RegionWriter const&) = delete;
+    RegionWriter& operator=(RegionWriter const&) = delete;
+
+    ~RegionWriter() { Flush(); }
+
+    // Adds a region, whose first write is at begin. Returns its index
+    size_t AddRegion(uint64_t const begin)
+    {
+        regions_.emplace_back();
+        region_t& r = regions_.back();
+        r.alloc.reset(new uint8_t[buffer_size_ + direct_alignment - 1]);
+        r.buffer = AlignForDirectIO(r.alloc.get());
+        r.start = begin;
+        r.end = begin;
+        return regions_.size() - 1;
+    }
+
+    void Write(size_t const region, uint64_t begin, const uint8_t* data, uint64_t length)
+    {
+        region_t& r = regions_[region];
+        if (begin + length > r.start + buffer_size_) {
+            FlushAlignedPart(r);
+            if (begin + length > r.start + buffer_size_) {
+                // skipping far ahead, or too large to buffer
+                FlushRegion(r);
+                if (begin > r.end) {
+                    r.start = r.end = begin;
+                }
+            }
+        }
+        if (begin < r.start) {
+            // already written out
+            uint64_t const n = std::min(length, r.start - begin);
+            disk_.Write(begin, data, n);
+            begin += n;
+            data += n;
+            length -= n;
+            if (length == 0) return;
+        }
+        if (length > buffer_size_) {
+            // the buffer is empty at this point
+            disk_.Write(begin, data, length);
+            r.start = r.end = begin + length;
+            return;
+        }
+        if (begin > r.end) {
+            memset(r.buffer + (r.end - r.start), 0, begin - r.end);
+        }
+        memcpy(r.buffer + (begin - r.start), data, length);
+        r.end = std::max(r.end, begin + length);
+    }
+
+    // Writes out all buffered data
+    void Flush()
+    {
+        for (region_t& r : regions_) {
+            FlushRegion(r);
+        }
+    }
+
+private:
+    struct region_t {
+        // the file offsets the buffer holds
+        uint64_t start;
+        uint64_t end;
+        std::unique_ptr<uint8_t[]> alloc;
+        uint8_t* buffer;
+    };
+
+    void FlushRegion(region_t& r)
+    {
+        if (r.end > r.start) {
+            disk_.Write(r.start, r.buffer, r.end - r.start);
+        }
+        r.start = r.end;
+    }
+
+    // Like BufferedDisk, keeps the bytes after the last block boundary, so
+    // the next write out starts on one
+    void FlushAlignedPart(region_t& r)
+    {
+        uint64_t const cut = r.end & ~(direct_alignment - 1);
+        if (cut <= r.start) {
+            FlushRegion(r);
+            return;
+        }
+        disk_.Write(r.start, r.buffer, cut - r.start);
+        ::memmove(r.buffer, r.buffer + (cut - r.start), r.end - cut);
+        r.start = cut;
+    }
+
+    FileDisk& disk_;
+    uint64_t const buffer_size_;
+    std::vector<region_t> regions_;
+};
+
 struct FilteredDisk : Disk
 {
     FilteredDisk(BufferedDisk underlying, bitfield filter, int entry_size)
@@ -61,7 +61,10 @@ public:
     void CTAssign(double R, FSE_CTable *ct)
     {
         std::lock_guard<std::mutex> l(memoMutex);
-        CT_MEMO[R] = ct;
+        // Another thread may have built the same table in the meantime
+        if (!CT_MEMO.emplace(R, ct).second) {
+            FSE_freeCTable(ct);
+        }
     }
 
     void DTAssign(double R, FSE_DTable *dt)
@@ -0,0 +1,366 @@
+// Copyright 2018 Chia Network Inc
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//    http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SRC_CPP_FINAL_COPY_HPP_
+#define SRC_CPP_FINAL_COPY_HPP_
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <system_error>
+#include <thread>
+
+#include "chia_filesystem.hpp"
+#include "exceptions.hpp"
+#include "thread_pool.hpp"
+#include "util.hpp"
+
+// The most bytes copied at a time
+constexpr uint64_t kCopyChunk = 64 * 1024 * 1024;
+
+// Bytes copied at a time. With a bandwidth limit, the chunks are smaller, so
+// the copy is throttled smoothly.
+inline uint64_t CopyChunkSize(uint64_t const bytes_per_second)
+{
+    if (bytes_per_second == 0) {
+        return kCopyChunk;
+    }
+    return std::min(kCopyChunk, std::max<uint64_t>(bytes_per_second / 4, 4096));
+}
+
+// Sleeps until copying copied bytes, since start, took at least as long as
+// bytes_per_second allows. 0 is unlimited.
+inline void ThrottleCopy(
+    uint64_t const copied,
+    uint64_t const bytes_per_second,
+    std::chrono::steady_clock::time_point const start)
+{
+    if (bytes_per_second == 0) {
+        return;
+    }
+    auto const due = start + std::chrono::microseconds(copied * 1000000 / bytes_per_second);
+    std::this_thread::sleep_until(due);
+}
+
+// Copies from to to, a chunk at a time, with stdio. Used where the kernel
+// can't copy the file by itself.
+inline void StreamFile(
+    const fs::path &from,
+    const fs::path &to,
+    uint64_t const bytes_per_second,
+    std::error_code &ec)
+{
+    FILE *in = fopen(from.string().c_str(), "rb");
+    if (in == nullptr) {
+        ec = std::error_code(errno, std::generic_category());
+        return;
+    }
+    FILE *out = fopen(to.string().c_str(), "wb");
+    if (out == nullptr) {
+        ec = std::error_code(errno, std::generic_category());
+        fclose(in);
+        return;
+    }
+    uint64_t const chunk = CopyChunkSize(bytes_per_second);
+    std::unique_ptr<uint8_t[]> buf(new uint8_t[chunk]);
+    auto const start = std::chrono::steady_clock::now();
+    uint64_t copied = 0;
+    for (;;) {
+        size_t const n = fread(buf.get(), 1, chunk, in);
+        if (n > 0 && fwrite(buf.get(), 1, n, out) != n) {
+            ec = std::error_code(errno, std::generic_category());
+            break;
+        }
+        if (n < chunk) {
+            if (ferror(in)) {
+                ec = std::error_code(errno, std::generic_category());
+            }
+            break;
+        }
+        copied += n;
+        ThrottleCopy(copied, bytes_per_second, start);
+    }
+    fclose(in);
+    if (fclose(out) != 0 && !ec) {
+        ec = std::error_code(errno, std::generic_category());
+    }
+}
+
+// Copies the file from to to, overwriting to. On Linux the copy is made by the
+// kernel: it's a reflink (FICLONE) if both files are on a file system that
+// supports it, otherwise copy_file_range() copies large chunks without passing
+// them through user space. Elsewhere, or if neither works across the two file
+// systems, the file is streamed through a buffer. At most bytes_per_second are
+// copied per second, 0 is unlimited. The copy is synced to disk before this
+// returns, since the caller removes from afterwards.
+inline void CopyPlotFile(
+    const fs::path &from,
+    const fs::path &to,
+    uint64_t const bytes_per_second,
+    std::error_code &ec)
+{
+    ec.clear();
+#ifdef __linux__
+    int const in = ::open(from.c_str(), O_RDONLY);
+    if (in < 0) {
+        ec = std::error_code(errno, std::generic_category());
+        return;
+    }
+    int const out = ::open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+        ec = std::error_code(errno, std::generic_category());
+        ::close(in);
+        return;
+    }
+    bool copied_by_kernel = false;
+#ifdef FICLONE
+    if (::ioctl(out, FICLONE, in) == 0) {
+        std::cout << "Cloned " << from << " to " << to << std::endl;
+        copied_by_kernel = true;
+    }
+#endif
+#ifdef __NR_copy_file_range
+    if (!copied_by_kernel) {
+        uint64_t const chunk = CopyChunkSize(bytes_per_second);
+        auto const start = std::chrono::steady_clock::now();
+        uint64_t copied = 0;
+        for (;;) {
+            long const n =
+                ::syscall(__NR_copy_file_range, in, nullptr, out, nullptr, chunk, 0);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                // Not supported by the kernel, or across these file systems.
+                // Nothing was copied yet, so it's streamed instead.
+                if (copied == 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL ||
+                                    errno == EOPNOTSUPP)) {
+                    break;
+                }
+                ec = std::error_code(errno, std::generic_category());
+                break;
+            }
+            if (n == 0) {
+                copied_by_kernel = true;
+                break;
+            }
+            copied += n;
+            ThrottleCopy(copied, bytes_per_second, start);
+        }
+    }
+#endif
+    if (copied_by_kernel && ::fsync(out) != 0) {
+        ec = std::error_code(errno, std::generic_category());
+    }
+    ::close(in);
+    ::close(out);
+    if (copied_by_kernel || ec) {
+        return;
+    }
+#endif
+    StreamFile(from, to, bytes_per_second, ec);
+#ifndef _WIN32
+    if (!ec) {
+        int const out_fd = ::open(to.c_str(), O_WRONLY);
+        if (out_fd >= 0) {
+            ::fsync(out_fd);
+            ::close(out_fd);
+        }
+    }
+#endif
+}
+
+// Lets another thread stop FinalizePlot() from retrying
+class CopyCancel {
+public:
+    void Cancel()
+    {
+        {
+            std::lock_guard<std::mutex> l(m_);
+            cancelled_ = true;
+        }
+        cv_.notify_all();
+    }
+
+    // Sleeps for duration, or until Cancel() is called. Returns whether it was.
+    template <typename Duration>
+    bool SleepFor(Duration const duration)
+    {
+        std::unique_lock<std::mutex> l(m_);
+        return cv_.wait_for(l, duration, [this]() { return cancelled_; });
+    }
+
+private:
+    std::mutex m_;
+    std::condition_variable cv_;
+    bool cancelled_ = false;
+};
+
+// Moves the finished plot tmp_2_filename to final_filename. If they're in the
+// same directory, it's renamed. Otherwise it's copied to final_2_filename,
+// next to final_filename, and renamed once it's complete, so a partial plot
+// never has the final name. Failures are retried every five minutes, until
+// cancel, if given, is cancelled. That throws, and leaves the files as they are.
+inline void FinalizePlot(
+    const fs::path &tmp_2_filename,
+    const fs::path &final_2_filename,
+    const fs::path &final_filename,
+    uint64_t const bytes_per_second,
+    CopyCancel *cancel = nullptr)
+{
+    bool bCopied = false;
+    bool bRenamed = false;
+    Timer copy;
+    do {
+        std::error_code ec;
+        if (tmp_2_filename.parent_path() == final_filename.parent_path()) {
+            fs::rename(tmp_2_filename, final_filename, ec);
+            if (ec.value() != 0) {
+                std::cout << "Could not rename " << tmp_2_filename << " to " << final_filename
+                          << ". Error " << ec.message() << ". Retrying in five minutes."
+                          << std::endl;
+            } else {
+                bRenamed = true;
+                std::cout << "Renamed final file from " << tmp_2_filename << " to "
+                          << final_filename << std::endl;
+            }
+        } else {
+            if (!bCopied) {
+                CopyPlotFile(tmp_2_filename, final_2_filename, bytes_per_second, ec);
+                if (ec.value() != 0) {
+                    std::cout << "Could not copy " << tmp_2_filename << " to "
+                              << final_2_filename << ". Error " << ec.message()
+                              << ". Retrying in five minutes." << std::endl;
+                } else {
+                    std::cout << "Copied final file from " << tmp_2_filename << " to "
+                              << final_2_filename << std::endl;
+                    copy.PrintElapsed("Copy time =");
+                    bCopied = true;
+
+                    bool removed_2 = fs::remove(tmp_2_filename);
+                    std::cout << "Removed temp2 file " << tmp_2_filename << "? " << removed_2
+                              << std::endl;
+                }
+            }
+            if (bCopied && (!bRenamed)) {
+                fs::rename(final_2_filename, final_filename, ec);
+                if (ec.value() != 0) {
+                    std::cout << "Could not rename " << tmp_2_filename << " to "
+                              << final_filename << ". Error " << ec.message()
+                              << ". Retrying in five minutes." << std::endl;
+                } else {
+                    std::cout << "Renamed final file from " << final_2_filename << " to "
+                              << final_filename << std::endl;
+                    bRenamed = true;
+                }
+            }
+        }
+
+        if (!bRenamed) {
+            if (cancel != nullptr) {
+                if (cancel->SleepFor(std::chrono::minutes(5))) {
+                    throw InvalidStateException(
+                        "Gave up moving " + tmp_2_filename.string() + " to " +
+                        final_filename.string());
+                }
+            } else {
+#ifdef _WIN32
+                Sleep(5 * 60000);
+#else
+                sleep(5 * 60);
+#endif
+            }
+        }
+    } while (!bRenamed);
+}
+
+// Runs FinalizePlot() on a pool thread, so the next plot can be started
+// while the last one is still being copied. Destroying it waits for a copy in
+// progress, but gives up retrying a failed one.
+class PlotFinalizer {
+public:
+    PlotFinalizer(
+        fs::path tmp_2_filename,
+        fs::path final_2_filename,
+        fs::path final_filename,
+        uint64_t const bytes_per_second)
+        : final_filename_(final_filename)
+    {
+        finished_ = ThreadPool::Global().Submit([=]() {
+            try {
+                FinalizePlot(
+                    tmp_2_filename, final_2_filename, final_filename, bytes_per_second, &cancel_);
+            } catch (...) {
+                error_ = std::current_exception();
+            }
+            done_ = true;
+        });
+    }
+
+    PlotFinalizer(PlotFinalizer const &) = delete;
+    PlotFinalizer &operator=(PlotFinalizer const &) = delete;
+
+    ~PlotFinalizer()
+    {
+        cancel_.Cancel();
+        finished_.wait();
+    }
+
+    const fs::path &GetFilename() const { return final_filename_; }
+
+    // Whether the plot has its final name
+    bool Done() const { return done_; }
+
+    // Waits until the plot has its final name. Rethrows what the copy threw,
+    // if anything
+    void Wait()
+    {
+        finished_.wait();
+        if (error_) {
+            std::rethrow_exception(error_);
+        }
+    }
+
+private:
+    fs::path const final_filename_;
+    std::atomic<bool> done_{false};
+    std::exception_ptr error_;
+    CopyCancel cancel_;
+    std::future<void> finished_;
+};
+
+#endif  // SRC_CPP_FINAL_COPY_HPP_
@@ -24,6 +24,9 @@
 #include <stdio.h>
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
 #include <fstream>
 #include <iostream>
 #include <map>
@@ -38,19 +41,50 @@
 
 #include "chia_filesystem.hpp"
 
+#include "bitfield.hpp"
 #include "calculate_bucket.hpp"
 #include "entry_sizes.hpp"
 #include "exceptions.hpp"
 #include "pos_constants.hpp"
 #include "sort_manager.hpp"
+#include "thread_pool.hpp"
 #include "threading.hpp"
 #include "util.hpp"
 #include "progress.hpp"
 
+// The output of a stripe, waiting in the reorder buffer to be committed
+struct stripe_output_t {
+    std::unique_ptr<uint8_t[]> left_buf;
+    std::unique_ptr<uint8_t[]> right_buf;
+    uint64_t left_count;
+    uint64_t right_count;
+    // The position in the stripe's left table entries that the positions in
+    // its right entries are relative to
+    uint64_t start_correction;
+    uint64_t matches;
+};
+
+// With dynamic scheduling, F1 threads claim this many batches at a time
+const uint64_t kF1ChunkBatches = 16;
+
+// How the batches of F1 are spread over the threads, and how that went
+struct f1_schedule_t {
+    bool dynamic;
+    // The next batch to be claimed, with dynamic
+    std::atomic<uint64_t> next{0};
+    std::chrono::steady_clock::time_point start;
+    // Per thread, the batches computed and when it finished, in seconds
+    std::vector<uint64_t> batches;
+    std::vector<double> finished;
+};
+
 struct THREADDATA {
     int index;
-    Sem::type* mine;
-    Sem::type* theirs;
+    StripeScheduler* scheduler;
+    // One per slot of the scheduler
+    stripe_output_t* outputs;
+    // Serializes writes to the table files
+    std::mutex* disk_mutex;
     uint64_t right_entry_size_bytes;
     uint8_t k;
     uint8_t table_index;
@@ -60,6 +94,52 @@ struct THREADDATA {
     uint64_t prevtableentries;
     uint32_t compressed_entry_size_bytes;
     std::vector<FileDisk>* ptmp_1_disks;
+    // While computing table 7, if set, the entries of table 6 that table 7
+    // refers to are marked in it
+    bitfield* table6_used;
+};
+
+// The entries of one kBC bucket of the left table, as a struct of arrays. Matching
+// only scans y, the other fields are only touched for entries that are used.
+struct bucket_entries_t {
+    std::vector<uint64_t> y;
+    // The position of the entry within the left table
+    std::vector<uint64_t> pos;
+    // The combined pos and offset that the entry points to
+    std::vector<uint64_t> read_posoffset;
+    std::vector<metadata_t> metadata;
+    // Whether the entry took part in a match with the bucket to its left or right
+    std::vector<uint8_t> used;
+
+    size_t size() const { return y.size(); }
+    bool empty() const { return y.empty(); }
+
+    void clear()
+    {
+        y.clear();
+        pos.clear();
+        read_posoffset.clear();
+        metadata.clear();
+        used.clear();
+    }
+
+    void push_back(const PlotEntry& entry)
+    {
+        y.push_back(entry.y);
+        pos.push_back(entry.pos);
+        read_posoffset.push_back(entry.read_posoffset);
+        metadata.push_back({entry.left_metadata, entry.right_metadata});
+        used.push_back(0);
+    }
+};
+
+// A match between two entries of the left table, waiting to be written to the
+// right table
+struct match_t {
+    uint64_t L_pos;
+    uint64_t R_pos;
+    uint64_t f;
+    metadata_t c;
 };
 
 struct GlobalData {
@@ -118,6 +198,76 @@ PlotEntry GetLeftEntry(
     return left_entry;
 }
 
+// Writes out a computed stripe, whose place in the left and right tables is
+// now known
+void CommitStripe(
+    THREADDATA* ptd,
+    StripeScheduler::ready_t const& r,
+    SortManager::ConcurrentWriter* R_writer)
+{
+    uint8_t const k = ptd->k;
+    uint8_t const table_index = ptd->table_index;
+    uint8_t const pos_size = ptd->pos_size;
+    uint64_t const right_entry_size_bytes = ptd->right_entry_size_bytes;
+    uint32_t const compressed_entry_size_bytes = ptd->compressed_entry_size_bytes;
+    stripe_output_t& out = ptd->outputs[r.stripe % ptd->scheduler->Window()];
+
+    uint32_t const ysize = (table_index + 1 == 7) ? k : k + kExtraBits;
+    uint32_t const startbyte = ysize / 8;
+    uint32_t const endbyte = (ysize + pos_size + 7) / 8 - 1;
+    uint64_t const shiftamt = (8 - ((ysize + pos_size) % 8)) % 8;
+    uint64_t const correction = (r.left_begin - out.start_correction) << shiftamt;
+
+    // Correct positions
+    for (uint32_t i = 0; i < out.right_count; i++) {
+        uint64_t posaccum = 0;
+        uint8_t* entrybuf = out.right_buf.get() + i * right_entry_size_bytes;
+
+        for (uint32_t j = startbyte; j <= endbyte; j++) {
+            posaccum = (posaccum << 8) | (entrybuf[j]);
+        }
+        posaccum += correction;
+        for (uint32_t j = endbyte; j >= startbyte; --j) {
+            entrybuf[j] = posaccum & 0xff;
+            posaccum = posaccum >> 8;
+        }
+    }
+    if (table_index < 6) {
+        for (uint64_t i = 0; i < out.right_count; i++) {
+            R_writer->Add(out.right_buf.get() + i * right_entry_size_bytes);
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> l(*ptd->disk_mutex);
+        if (table_index == 6) {
+            // Writes out the right table for table 7
+            (*ptd->ptmp_1_disks)[table_index + 1].Write(
+                r.right_begin * right_entry_size_bytes,
+                out.right_buf.get(),
+                out.right_count * right_entry_size_bytes);
+        }
+        if (ptd->table6_used) {
+            // Phase 2 would otherwise have to read table 7 back for this
+            for (uint32_t i = 0; i < out.right_count; i++) {
+                uint64_t const pos_offset = Util::SliceInt64FromBytes(
+                    out.right_buf.get() + i * right_entry_size_bytes,
+                    ysize,
+                    pos_size + kOffsetSize);
+                uint64_t const pos = pos_offset >> kOffsetSize;
+                ptd->table6_used->set(pos);
+                ptd->table6_used->set(pos + (pos_offset & ((1U << kOffsetSize) - 1)));
+            }
+        }
+        (*ptd->ptmp_1_disks)[table_index].Write(
+            r.left_begin * compressed_entry_size_bytes,
+            out.left_buf.get(),
+            out.left_count * compressed_entry_size_bytes);
+        globals.matches += out.matches;
+    }
+    ptd->scheduler->Committed(r.stripe);
+}
+
 void* phase1_thread(THREADDATA* ptd)
 {
     uint64_t const right_entry_size_bytes = ptd->right_entry_size_bytes;
@@ -128,17 +278,42 @@ void* phase1_thread(THREADDATA* ptd)
     uint8_t const pos_size = ptd->pos_size;
     uint64_t const prevtableentries = ptd->prevtableentries;
     uint32_t const compressed_entry_size_bytes = ptd->compressed_entry_size_bytes;
-    std::vector<FileDisk>* ptmp_1_disks = ptd->ptmp_1_disks;
 
     // Streams to read and right to tables. We will have handles to two tables. We will
     // read through the left table, compute matches, and evaluate f for matching entries,
     // writing results to the right table.
     uint64_t left_buf_entries = 5000 + (uint64_t)((1.1) * (globals.stripe_size));
     uint64_t right_buf_entries = 5000 + (uint64_t)((1.1) * (globals.stripe_size));
-    std::unique_ptr<uint8_t[]> right_writer_buf(new uint8_t[right_buf_entries * right_entry_size_bytes + 7]);
-    std::unique_ptr<uint8_t[]> left_writer_buf(new uint8_t[left_buf_entries * compressed_entry_size_bytes + 7]);
+    StripeScheduler& scheduler = *ptd->scheduler;
+
+    // Right entries of tables 2-6 are staged per thread, since the order
+    // entries are added to the sort manager in doesn't matter
+    std::unique_ptr<SortManager::ConcurrentWriter> R_writer;
+    if (table_index < 6) {
+        R_writer = std::make_unique<SortManager::ConcurrentWriter>(*globals.R_sort_manager);
+    }
+    std::vector<StripeScheduler::ready_t> ready;
 
     FxCalculator f(k, table_index + 1);
+    // Size of the metadata of the right table's entries
+    uint32_t const new_metadata_size = table_index + 1 < 7 ? kVectorLens[table_index + 2] * k : 0;
+
+    // This is a sliding window of entries, since things in bucket i can match with things in
+    // bucket i + 1. At the end of each bucket, we find matches between the two previous buckets.
+    // These are reused for all groups, so they only allocate while growing.
+    bucket_entries_t bucket_L;
+    bucket_entries_t bucket_R;
+
+    // Matches of the previous and the current group, waiting to be written out
+    std::vector<match_t> current_entries_to_write;
+    std::vector<match_t> future_entries_to_write;
+
+    // Inputs and outputs of the batched f evaluation of each group of matches
+    std::vector<uint64_t> match_y;
+    std::vector<metadata_t> match_L_metadata;
+    std::vector<metadata_t> match_R_metadata;
+    std::vector<uint64_t> match_f;
+    std::vector<metadata_t> match_c;
 
     // Stores map of old positions to new positions (positions after dropping entries from L
     // table that did not match) Map ke
@@ -150,11 +325,12 @@ void* phase1_thread(THREADDATA* ptd)
 
     // Start at left table pos = 0 and iterate through the whole table. Note that the left table
     // will already be sorted by y
-    uint64_t totalstripes = (prevtableentries + globals.stripe_size - 1) / globals.stripe_size;
-    uint64_t threadstripes = (totalstripes + globals.num_threads - 1) / globals.num_threads;
-
-    for (uint64_t stripe = 0; stripe < threadstripes; stripe++) {
-        uint64_t pos = (stripe * globals.num_threads + ptd->index) * globals.stripe_size;
+    uint64_t stripe;
+    while (scheduler.Claim(ptd->index, stripe)) {
+        stripe_output_t& out = ptd->outputs[stripe % scheduler.Window()];
+        uint8_t* const right_writer_buf = out.right_buf.get();
+        uint8_t* const left_writer_buf = out.left_buf.get();
+        uint64_t pos = stripe * globals.stripe_size;
         uint64_t const endpos = pos + globals.stripe_size + 1;  // one y value overlap
         uint64_t left_reader = pos * entry_size_bytes;
         uint64_t left_writer_count = 0;
@@ -163,11 +339,10 @@ void* phase1_thread(THREADDATA* ptd)
         uint64_t right_writer_count = 0;
         uint64_t matches = 0;  // Total matches
 
-        // This is a sliding window of entries, since things in bucket i can match with things in
-        // bucket
-        // i + 1. At the end of each bucket, we find matches between the two previous buckets.
-        std::vector<PlotEntry> bucket_L;
-        std::vector<PlotEntry> bucket_R;
+        bucket_L.clear();
+        bucket_R.clear();
+        current_entries_to_write.clear();
+        future_entries_to_write.clear();
 
         uint64_t bucket = 0;
         bool end_of_table = false;  // We finished all entries in the left table
@@ -180,19 +355,11 @@ void* phase1_thread(THREADDATA* ptd)
 
         bool bStripePregamePair = false;
         bool bStripeStartPair = false;
-        bool need_new_bucket = false;
-        bool first_thread = ptd->index % globals.num_threads == 0;
-        bool last_thread = ptd->index % globals.num_threads == globals.num_threads - 1;
 
         uint64_t L_position_base = 0;
         uint64_t R_position_base = 0;
         uint64_t newlpos = 0;
         uint64_t newrpos = 0;
-        std::vector<std::tuple<PlotEntry, PlotEntry, std::pair<Bits, Bits>>>
-            current_entries_to_write;
-        std::vector<std::tuple<PlotEntry, PlotEntry, std::pair<Bits, Bits>>>
-            future_entries_to_write;
-        std::vector<PlotEntry*> not_dropped;  // Pointers are stored to avoid copying entries
 
         if (pos == 0) {
             bMatch = true;
@@ -202,19 +369,14 @@ void* phase1_thread(THREADDATA* ptd)
             stripe_start_correction = 0;
         }
 
-        Sem::Wait(ptd->theirs);
-        need_new_bucket = globals.L_sort_manager->CloseToNewBucket(left_reader);
-        if (need_new_bucket) {
-            if (!first_thread) {
-                Sem::Wait(ptd->theirs);
-            }
+        // Stripes start in order. Moving the left table on to its next bucket
+        // drops the entries before this stripe, so every stripe before it has
+        // to be done reading them.
+        if (globals.L_sort_manager->CloseToNewBucket(left_reader)) {
+            scheduler.WaitForComputed(stripe);
             globals.L_sort_manager->TriggerNewBucket(left_reader);
         }
-        if (!last_thread) {
-            // Do not post if we are the last thread, because first thread has already
-            // waited for us to finish when it starts
-            Sem::Post(ptd->mine);
-        }
+        scheduler.Started(stripe);
 
         while (pos < prevtableentries + 1) {
             PlotEntry left_entry = PlotEntry();
@@ -257,9 +419,9 @@ void* phase1_thread(THREADDATA* ptd)
 
             // Keep reading left entries into bucket_L and R, until we run out of things
             if (y_bucket == bucket) {
-                bucket_L.emplace_back(left_entry);
+                bucket_L.push_back(left_entry);
             } else if (y_bucket == bucket + 1) {
-                bucket_R.emplace_back(left_entry);
+                bucket_R.push_back(left_entry);
             } else {
                 // cout << "matching! " << bucket << " and " << bucket + 1 << endl;
                 // This is reached when we have finished adding stuff to bucket_R and bucket_L,
@@ -271,46 +433,28 @@ void* phase1_thread(THREADDATA* ptd)
                 int32_t idx_count=0;
 
                 if (!bucket_L.empty()) {
-                    not_dropped.clear();
-
                     if (!bucket_R.empty()) {
                         // Compute all matches between the two buckets and save indeces.
-                        idx_count = f.FindMatches(bucket_L, bucket_R, idx_L, idx_R);
+                        idx_count = f.FindMatches(
+                            bucket_L.y.data(),
+                            bucket_L.size(),
+                            bucket_R.y.data(),
+                            bucket_R.size(),
+                            idx_L,
+                            idx_R);
                         if(idx_count >= 10000) {
                             std::cout << "sanity check: idx_count exceeded 10000!" << std::endl;
                             exit(0);
                         }
                         // We mark entries as used if they took part in a match.
                         for (int32_t i=0; i < idx_count; i++) {
-                            bucket_L[idx_L[i]].used = true;
+                            bucket_L.used[idx_L[i]] = 1;
                             if (end_of_table) {
-                                bucket_R[idx_R[i]].used = true;
+                                bucket_R.used[idx_R[i]] = 1;
                             }
                         }
                     }
 
-                    // Adds L_bucket entries that are used to not_dropped. They are used if they
-                    // either matched with something to the left (in the previous iteration), or
-                    // matched with something in bucket_R (in this iteration).
-                    for (size_t bucket_index = 0; bucket_index < bucket_L.size(); bucket_index++) {
-                        PlotEntry& L_entry = bucket_L[bucket_index];
-                        if (L_entry.used) {
-                            not_dropped.emplace_back(&bucket_L[bucket_index]);
-                        }
-                    }
-                    if (end_of_table) {
-                        // In the last two buckets, we will not get a chance to enter the next
-                        // iteration due to breaking from loop. Therefore to write the final
-                        // bucket in this iteration, we have to add the R entries to the
-                        // not_dropped list.
-                        for (size_t bucket_index = 0; bucket_index < bucket_R.size();
-                             bucket_index++) {
-                            PlotEntry& R_entry = bucket_R[bucket_index];
-                            if (R_entry.used) {
-                                not_dropped.emplace_back(&R_entry);
-                            }
-                        }
-                    }
                     // We keep maps from old positions to new positions. We only need two maps,
                     // one for L bucket and one for R bucket, and we cycle through them. Map
                     // keys are stored as positions % 2^10 for efficiency. Map values are stored
@@ -319,70 +463,90 @@ void* phase1_thread(THREADDATA* ptd)
                     L_position_base = R_position_base;
                     R_position_base = stripe_left_writer_count;
 
-                    for (PlotEntry*& entry : not_dropped) {
-                        // The new position for this entry = the total amount of thing written
-                        // to L so far. Since we only write entries in not_dropped, about 14% of
-                        // entries are dropped.
-                        R_position_map[entry->pos % position_map_size] =
-                            stripe_left_writer_count - R_position_base;
-
-                        if (bStripeStartPair) {
-                            if (stripe_start_correction == 0xffffffffffffffff) {
-                                stripe_start_correction = stripe_left_writer_count;
+                    // Keeps the entries of a bucket that are used. They are used if they either
+                    // matched with something to the left (in the previous iteration), or
+                    // matched with something in bucket_R (in this iteration).
+                    auto const write_not_dropped = [&](const bucket_entries_t& entries) {
+                        for (size_t bucket_index = 0; bucket_index < entries.size();
+                             bucket_index++) {
+                            if (!entries.used[bucket_index]) {
+                                continue;
                             }
-
-                            if (left_writer_count >= left_buf_entries) {
-                                throw InvalidStateException("Left writer count overrun");
+                            // The new position for this entry = the total amount of thing
+                            // written to L so far. Since we only write used entries, about 14%
+                            // of entries are dropped.
+                            R_position_map[entries.pos[bucket_index] % position_map_size] =
+                                stripe_left_writer_count - R_position_base;
+
+                            if (bStripeStartPair) {
+                                if (stripe_start_correction == 0xffffffffffffffff) {
+                                    stripe_start_correction = stripe_left_writer_count;
+                                }
+
+                                if (left_writer_count >= left_buf_entries) {
+                                    throw InvalidStateException("Left writer count overrun");
+                                }
+                                uint8_t* tmp_buf = left_writer_buf +
+                                                   left_writer_count * compressed_entry_size_bytes;
+
+                                left_writer_count++;
+
+                                // Rewrite left entry with just pos and offset, to reduce working
+                                // space
+                                uint64_t new_left_entry;
+                                if (table_index == 1)
+                                    new_left_entry = entries.metadata[bucket_index].left;
+                                else
+                                    new_left_entry = entries.read_posoffset[bucket_index];
+                                new_left_entry <<=
+                                    64 - (table_index == 1 ? k : pos_size + kOffsetSize);
+                                Util::IntToEightBytes(tmp_buf, new_left_entry);
                             }
-                            uint8_t* tmp_buf =
-                                left_writer_buf.get() + left_writer_count * compressed_entry_size_bytes;
-
-                            left_writer_count++;
-                            // memset(tmp_buf, 0xff, compressed_entry_size_bytes);
-
-                            // Rewrite left entry with just pos and offset, to reduce working space
-                            uint64_t new_left_entry;
-                            if (table_index == 1)
-                                new_left_entry = entry->left_metadata;
-                            else
-                                new_left_entry = entry->read_posoffset;
-                            new_left_entry <<= 64 - (table_index == 1 ? k : pos_size + kOffsetSize);
-                            Util::IntToEightBytes(tmp_buf, new_left_entry);
+                            stripe_left_writer_count++;
                         }
-                        stripe_left_writer_count++;
+                    };
+                    write_not_dropped(bucket_L);
+                    if (end_of_table) {
+                        // In the last two buckets, we will not get a chance to enter the next
+                        // iteration due to breaking from loop. Therefore to write the final
+                        // bucket in this iteration, we have to keep the R entries as well.
+                        write_not_dropped(bucket_R);
                     }
 
                     // Two vectors to keep track of things from previous iteration and from this
                     // iteration.
-                    current_entries_to_write = std::move(future_entries_to_write);
+                    std::swap(current_entries_to_write, future_entries_to_write);
                     future_entries_to_write.clear();
 
+                    match_y.resize(idx_count);
+                    match_L_metadata.resize(idx_count);
+                    match_R_metadata.resize(idx_count);
+                    match_f.resize(idx_count);
+                    match_c.resize(idx_count);
                     for (int32_t i=0; i < idx_count; i++) {
-                        PlotEntry& L_entry = bucket_L[idx_L[i]];
-                        PlotEntry& R_entry = bucket_R[idx_R[i]];
-
                         if (bStripeStartPair)
                             matches++;
 
                         // Sets the R entry to used so that we don't drop in next iteration
-                        R_entry.used = true;
-                        // Computes the output pair (fx, new_metadata)
-                        if (metadata_size <= 128) {
-                            const std::pair<Bits, Bits>& f_output = f.CalculateBucket(
-                                Bits(L_entry.y, k + kExtraBits),
-                                Bits(L_entry.left_metadata, metadata_size),
-                                Bits(R_entry.left_metadata, metadata_size));
-                            future_entries_to_write.emplace_back(L_entry, R_entry, f_output);
-                        } else {
-                            // Metadata does not fit into 128 bits
-                            const std::pair<Bits, Bits>& f_output = f.CalculateBucket(
-                                Bits(L_entry.y, k + kExtraBits),
-                                Bits(L_entry.left_metadata, 128) +
-                                    Bits(L_entry.right_metadata, metadata_size - 128),
-                                Bits(R_entry.left_metadata, 128) +
-                                    Bits(R_entry.right_metadata, metadata_size - 128));
-                            future_entries_to_write.emplace_back(L_entry, R_entry, f_output);
-                        }
+                        bucket_R.used[idx_R[i]] = 1;
+                        match_y[i] = bucket_L.y[idx_L[i]];
+                        match_L_metadata[i] = bucket_L.metadata[idx_L[i]];
+                        match_R_metadata[i] = bucket_R.metadata[idx_R[i]];
+                    }
+
+                    // Computes the output pairs (fx, new_metadata) of all the matches at once
+                    f.CalculateBuckets(
+                        idx_count,
+                        match_y.data(),
+                        match_L_metadata.data(),
+                        match_R_metadata.data(),
+                        match_f.data(),
+                        match_c.data());
+
+                    future_entries_to_write.resize(idx_count);
+                    for (int32_t i=0; i < idx_count; i++) {
+                        future_entries_to_write[i] = {
+                            bucket_L.pos[idx_L[i]], bucket_R.pos[idx_R[i]], match_f[i], match_c[i]};
                     }
 
                     // At this point, future_entries_to_write contains the matches of buckets L
@@ -398,25 +562,19 @@ void* phase1_thread(THREADDATA* ptd)
                             future_entries_to_write.end());
                     }
                     for (size_t i = 0; i < current_entries_to_write.size(); i++) {
-                        const auto& [L_entry, R_entry, f_output] = current_entries_to_write[i];
-
-                        // We only need k instead of k + kExtraBits bits for the last table
-                        Bits new_entry = table_index + 1 == 7 ? std::get<0>(f_output).Slice(0, k)
-                                                              : std::get<0>(f_output);
+                        const match_t& match = current_entries_to_write[i];
 
                         // Maps the new positions. If we hit end of pos, we must write things in
                         // both final_entries to write and current_entries_to_write, which are
                         // in both position maps.
                         if (!end_of_table || i < final_current_entry_size) {
                             newlpos =
-                                L_position_map[L_entry.pos % position_map_size] + L_position_base;
+                                L_position_map[match.L_pos % position_map_size] + L_position_base;
                         } else {
                             newlpos =
-                                R_position_map[L_entry.pos % position_map_size] + R_position_base;
+                                R_position_map[match.L_pos % position_map_size] + R_position_base;
                         }
-                        newrpos = R_position_map[R_entry.pos % position_map_size] + R_position_base;
-                        // Position in the previous table
-                        new_entry.AppendValue(newlpos, pos_size);
+                        newrpos = R_position_map[match.R_pos % position_map_size] + R_position_base;
 
                         // Offset for matching entry
                         if (newrpos - newlpos > (1U << kOffsetSize) * 97 / 100) {
@@ -424,18 +582,37 @@ void* phase1_thread(THREADDATA* ptd)
                                 "Offset too large: " + std::to_string(newrpos - newlpos));
                         }
 
-                        new_entry.AppendValue(newrpos - newlpos, kOffsetSize);
-                        // New metadata which will be used to compute the next f
-                        new_entry += std::get<1>(f_output);
-
                         if (right_writer_count >= right_buf_entries) {
                             throw InvalidStateException("Left writer count overrun");
                         }
 
                         if (bStripeStartPair) {
                             uint8_t* right_buf =
-                                right_writer_buf.get() + right_writer_count * right_entry_size_bytes;
-                            new_entry.ToBytes(right_buf);
+                                right_writer_buf + right_writer_count * right_entry_size_bytes;
+                            memset(right_buf, 0, right_entry_size_bytes);
+
+                            // We only need k instead of k + kExtraBits bits for the last table
+                            uint32_t const y_size = table_index + 1 == 7 ? k : k + kExtraBits;
+                            Util::SetInt64InBytes(
+                                right_buf, 0, match.f >> (k + kExtraBits - y_size), y_size);
+                            // Position in the previous table
+                            Util::SetInt64InBytes(right_buf, y_size, newlpos, pos_size);
+                            Util::SetInt64InBytes(
+                                right_buf, y_size + pos_size, newrpos - newlpos, kOffsetSize);
+                            // New metadata which will be used to compute the next f
+                            uint32_t const metadata_start = y_size + pos_size + kOffsetSize;
+                            if (new_metadata_size > 128) {
+                                Util::SetInt128InBytes(
+                                    right_buf, metadata_start, match.c.left, 128);
+                                Util::SetInt128InBytes(
+                                    right_buf,
+                                    metadata_start + 128,
+                                    match.c.right,
+                                    new_metadata_size - 128);
+                            } else {
+                                Util::SetInt128InBytes(
+                                    right_buf, metadata_start, match.c.left, new_metadata_size);
+                            }
                             right_writer_count++;
                         }
                     }
@@ -461,16 +638,16 @@ void* phase1_thread(THREADDATA* ptd)
                 if (y_bucket == bucket + 2) {
                     // We saw a bucket that is 2 more than the current, so we just set L = R, and R
                     // = [entry]
-                    bucket_L = std::move(bucket_R);
+                    std::swap(bucket_L, bucket_R);
                     bucket_R.clear();
-                    bucket_R.emplace_back(std::move(left_entry));
+                    bucket_R.push_back(left_entry);
                     ++bucket;
                 } else {
                     // We saw a bucket that >2 more than the current, so we just set L = [entry],
                     // and R = []
                     bucket = y_bucket;
                     bucket_L.clear();
-                    bucket_L.emplace_back(std::move(left_entry));
+                    bucket_L.push_back(left_entry);
                     bucket_R.clear();
                 }
             }
@@ -478,59 +655,27 @@ void* phase1_thread(THREADDATA* ptd)
             ++pos;
         }
 
-        // If we needed new bucket, we already waited
-        // Do not wait if we are the first thread, since we are guaranteed that everything is written
-        if (!need_new_bucket && !first_thread) {
-            Sem::Wait(ptd->theirs);
+        out.left_count = left_writer_count;
+        out.right_count = right_writer_count;
+        out.start_correction = stripe_start_correction;
+        out.matches = matches;
+
+        // This thread commits whichever stripes are now next in line, which
+        // may include stripes computed by other threads
+        ready.clear();
+        scheduler.Computed(stripe, left_writer_count, right_writer_count, ready);
+        for (StripeScheduler::ready_t const& r : ready) {
+            CommitStripe(ptd, r, R_writer.get());
         }
-
-        uint32_t const ysize = (table_index + 1 == 7) ? k : k + kExtraBits;
-        uint32_t const startbyte = ysize / 8;
-        uint32_t const endbyte = (ysize + pos_size + 7) / 8 - 1;
-        uint64_t const shiftamt = (8 - ((ysize + pos_size) % 8)) % 8;
-        uint64_t const correction = (globals.left_writer_count - stripe_start_correction) << shiftamt;
-
-        // Correct positions
-        for (uint32_t i = 0; i < right_writer_count; i++) {
-            uint64_t posaccum = 0;
-            uint8_t* entrybuf = right_writer_buf.get() + i * right_entry_size_bytes;
-
-            for (uint32_t j = startbyte; j <= endbyte; j++) {
-                posaccum = (posaccum << 8) | (entrybuf[j]);
-            }
-            posaccum += correction;
-            for (uint32_t j = endbyte; j >= startbyte; --j) {
-                entrybuf[j] = posaccum & 0xff;
-                posaccum = posaccum >> 8;
-            }
-        }
-        if (table_index < 6) {
-            for (uint64_t i = 0; i < right_writer_count; i++) {
-                globals.R_sort_manager->AddToCache(right_writer_buf.get() + i * right_entry_size_bytes);
-            }
-        } else {
-            // Writes out the right table for table 7
-            (*ptmp_1_disks)[table_index + 1].Write(
-                globals.right_writer,
-                right_writer_buf.get(),
-                right_writer_count * right_entry_size_bytes);
-        }
-        globals.right_writer += right_writer_count * right_entry_size_bytes;
-        globals.right_writer_count += right_writer_count;
-
-        (*ptmp_1_disks)[table_index].Write(
-            globals.left_writer, left_writer_buf.get(), left_writer_count * compressed_entry_size_bytes);
-        globals.left_writer += left_writer_count * compressed_entry_size_bytes;
-        globals.left_writer_count += left_writer_count;
-
-        globals.matches += matches;
-        Sem::Post(ptd->mine);
+    }
+    if (R_writer) {
+        R_writer->Flush();
     }
 
     return 0;
 }
 
-void* F1thread(int const index, uint8_t const k, const uint8_t* id, std::mutex* smm)
+void* F1thread(int const index, uint8_t const k, const uint8_t* id, f1_schedule_t* schedule)
 {
     uint32_t const entry_size_bytes = 16;
     uint64_t const max_value = ((uint64_t)1 << (k));
@@ -542,49 +687,83 @@ void* F1thread(int const index, uint8_t const k, const uint8_t* id, std::mutex*
 
     std::unique_ptr<uint8_t[]> right_writer_buf(new uint8_t[right_buf_entries * entry_size_bytes]);
 
-    // Instead of computing f1(1), f1(2), etc, for each x, we compute them in batches
-    // to increase CPU efficency.
-    for (uint64_t lp = index; lp <= (((uint64_t)1) << (k - kBatchSizes));
-         lp = lp + globals.num_threads)
-    {
-        // For each pair x, y in the batch
-
-        uint64_t right_writer_count = 0;
-        uint64_t x = lp * (1 << (kBatchSizes));
-
-        uint64_t const loopcount = std::min(max_value - x, (uint64_t)1 << (kBatchSizes));
-
-        // Instead of computing f1(1), f1(2), etc, for each x, we compute them in batches
-        // to increase CPU efficency.
-        f1.CalculateBuckets(x, loopcount, f1_entries.get());
-        for (uint32_t i = 0; i < loopcount; i++) {
-            uint128_t entry;
+    // Each thread stages its own entries, so there's no lock around the sort manager
+    SortManager::ConcurrentWriter writer(*globals.L_sort_manager);
 
-            entry = (uint128_t)f1_entries[i] << (128 - kExtraBits - k);
-            entry |= (uint128_t)x << (128 - kExtraBits - 2 * k);
-            Util::IntTo16Bytes(&right_writer_buf[i * entry_size_bytes], entry);
-            right_writer_count++;
-            x++;
-        }
-
-        std::lock_guard<std::mutex> l(*smm);
+    // Instead of computing f1(1), f1(2), etc, for each x, we compute them in batches
+    // to increase CPU efficency. Threads either take every num_threads'th
+    // batch, or claim chunks of batches as they go.
+    uint64_t const num_batches = (((uint64_t)1) << (k - kBatchSizes)) + 1;
+    uint64_t const chunk = schedule->dynamic ? kF1ChunkBatches : 1;
+    auto const claim = [&](uint64_t const prev) {
+        return schedule->dynamic ? schedule->next.fetch_add(chunk) : prev + globals.num_threads;
+    };
+    for (uint64_t first = schedule->dynamic ? claim(0) : index; first < num_batches;
+         first = claim(first)) {
+        for (uint64_t lp = first; lp < std::min(first + chunk, num_batches); lp++) {
+            schedule->batches[index]++;
+            // For each pair x, y in the batch
+
+            uint64_t right_writer_count = 0;
+            uint64_t x = lp * (1 << (kBatchSizes));
+
+            uint64_t const loopcount = std::min(max_value - x, (uint64_t)1 << (kBatchSizes));
+
+            // Instead of computing f1(1), f1(2), etc, for each x, we compute them in batches
+            // to increase CPU efficency.
+            f1.CalculateBuckets(x, loopcount, f1_entries.get());
+            for (uint32_t i = 0; i < loopcount; i++) {
+                uint128_t entry;
+
+                entry = (uint128_t)f1_entries[i] << (128 - kExtraBits - k);
+                entry |= (uint128_t)x << (128 - kExtraBits - 2 * k);
+                Util::IntTo16Bytes(&right_writer_buf[i * entry_size_bytes], entry);
+                right_writer_count++;
+                x++;
+            }
 
-        // Write it out
-        for (uint32_t i = 0; i < right_writer_count; i++) {
-            globals.L_sort_manager->AddToCache(&(right_writer_buf[i * entry_size_bytes]));
+            // Write it out
+            for (uint32_t i = 0; i < right_writer_count; i++) {
+                writer.Add(&(right_writer_buf[i * entry_size_bytes]));
+            }
         }
     }
+    writer.Flush();
+    schedule->finished[index] = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - schedule->start).count();
 
     return 0;
 }
 
+// Prints how the work of a table was spread over the threads: the units of
+// work (what) each thread did, and the share of the table's time it was busy
+void PrintThreadUtilization(
+    const char* what,
+    std::vector<uint64_t> const& done,
+    std::vector<double> const& utilization)
+{
+    std::cout << "\t" << what << " per thread (utilization):";
+    for (size_t i = 0; i < done.size(); i++) {
+        std::cout << " " << done[i] << " (" << std::lround(utilization[i] * 100) << "%)";
+    }
+    std::cout << std::endl;
+}
+
+struct Phase1Results {
+    // The number of entries in each table, table_sizes[0] is 0
+    std::vector<uint64_t> table_sizes;
+    // With ENABLE_BITFIELD, the entries of table 6 that table 7 refers to,
+    // for phase 2
+    std::unique_ptr<bitfield> table6_used;
+};
+
 // This is Phase 1, or forward propagation. During this phase, all of the 7 tables,
 // and f functions, are evaluated. The result is an intermediate plot file, that is
 // several times larger than what the final file will be, but that has all of the
 // proofs of space in it. First, F1 is computed, which is special since it uses
 // ChaCha8, and each encryption provides multiple output values. Then, the rest of the
 // f functions are computed, and a sort on disk happens for each table.
-std::vector<uint64_t> RunPhase1(
+Phase1Results RunPhase1(
     std::vector<FileDisk>& tmp_1_disks,
     uint8_t const k,
     const uint8_t* const id,
@@ -595,7 +774,8 @@ std::vector<uint64_t> RunPhase1(
     uint32_t const log_num_buckets,
     uint32_t const stripe_size,
     uint8_t const num_threads,
-    uint8_t const flags)
+    uint8_t const flags,
+    MemoryBudget* const bucket_memory = nullptr)
 {
     std::cout << "Computing table 1" << std::endl;
     globals.stripe_size = stripe_size;
@@ -613,24 +793,38 @@ std::vector<uint64_t> RunPhase1(
         tmp_dirname,
         filename + ".p1.t1",
         0,
-        globals.stripe_size);
+        globals.stripe_size,
+        strategy_t::uniform,
+        1,
+        TempFileMode(flags),
+        bucket_memory,
+        // f1, x
+        (flags & (PACKED_TEMP | COMPRESSED_TEMP)) ? k + kExtraBits + k : 0,
+        (flags & COMPRESSED_TEMP) != 0);
 
     // These are used for sorting on disk. The sort on disk code needs to know how
     // many elements are in each bucket.
     std::vector<uint64_t> table_sizes = std::vector<uint64_t>(8, 0);
-    std::mutex sort_manager_mutex;
 
     {
         // Start of parallel execution
-        std::vector<std::thread> threads;
-        for (int i = 0; i < num_threads; i++) {
-            threads.emplace_back(F1thread, i, k, id, &sort_manager_mutex);
-        }
+        f1_schedule_t schedule;
+        schedule.dynamic = flags & DYNAMIC_STRIPES;
+        schedule.start = std::chrono::steady_clock::now();
+        schedule.batches.resize(num_threads, 0);
+        schedule.finished.resize(num_threads, 0.0);
+
+        ThreadPool::Global().RunConcurrently(
+            num_threads, [&](uint32_t const i) { F1thread(i, k, id, &schedule); });
+        // end of parallel execution
 
-        for (auto& t : threads) {
-            t.join();
+        // F1 threads don't wait for each other, they're only idle once done
+        double const wall = *std::max_element(schedule.finished.begin(), schedule.finished.end());
+        std::vector<double> utilization(num_threads, 1.0);
+        for (int i = 0; i < num_threads; i++) {
+            if (wall > 0) utilization[i] = schedule.finished[i] / wall;
         }
-        // end of parallel execution
+        PrintThreadUtilization("Batches", schedule.batches, utilization);
     }
 
     uint64_t prevtableentries = 1ULL << k;
@@ -641,6 +835,7 @@ std::vector<uint64_t> RunPhase1(
     // Store positions to previous tables, in k bits.
     uint8_t pos_size = k;
     uint32_t right_entry_size_bytes = 0;
+    std::unique_ptr<bitfield> table6_used;
 
     // For tables 1 through 6, sort the table, calculate matches, and write
     // the next table. This is the left table index.
@@ -662,6 +857,11 @@ std::vector<uint64_t> RunPhase1(
                 right_entry_size_bytes = EntrySizes::GetKeyPosOffsetSize(k);
             }
         }
+        // The bits of the right entries that are used: f (only k bits for
+        // table 7), pos, offset and the metadata for the next table
+        uint32_t const right_entry_bits =
+            (table_index + 1 == 7 ? k : k + kExtraBits) + pos_size + kOffsetSize +
+            (table_index + 1 < 7 ? kVectorLens[table_index + 2] * k : 0);
 
         std::cout << "Computing table " << int{table_index + 1} << std::endl;
         // Start of parallel execution
@@ -682,25 +882,45 @@ std::vector<uint64_t> RunPhase1(
             tmp_dirname,
             filename + ".p1.t" + std::to_string(table_index + 1),
             0,
-            globals.stripe_size);
+            globals.stripe_size,
+            strategy_t::uniform,
+            1,
+            TempFileMode(flags),
+            bucket_memory,
+            (flags & (PACKED_TEMP | COMPRESSED_TEMP)) ? right_entry_bits : 0,
+            (flags & COMPRESSED_TEMP) != 0);
 
         globals.L_sort_manager->TriggerNewBucket(0);
 
+        if (flags & ENABLE_BITFIELD && table_index == 6) {
+            // Sized like the bitfields of phase 2, which only hold tables 1
+            // to 6, so it can be handed over as is
+            table6_used = std::make_unique<bitfield>(
+                *std::max_element(table_sizes.begin() + 1, table_sizes.begin() + 7));
+        }
+
         Timer computation_pass_timer;
 
         auto td = std::make_unique<THREADDATA[]>(num_threads);
-        auto mutex = std::make_unique<Sem::type[]>(num_threads);
 
-        std::vector<std::thread> threads;
-
-        for (int i = 0; i < num_threads; i++) {
-            mutex[i] = Sem::Create();
+        // Each thread can have a stripe waiting to be committed while it
+        // computes the next one
+        uint64_t const total_stripes = (prevtableentries + stripe_size - 1) / stripe_size;
+        StripeScheduler scheduler(
+            total_stripes, num_threads, 2 * num_threads, flags & DYNAMIC_STRIPES);
+        uint64_t const buf_entries = 5000 + (uint64_t)((1.1) * (stripe_size));
+        std::vector<stripe_output_t> outputs(scheduler.Window());
+        for (stripe_output_t& out : outputs) {
+            out.left_buf.reset(new uint8_t[buf_entries * compressed_entry_size_bytes + 7]);
+            out.right_buf.reset(new uint8_t[buf_entries * right_entry_size_bytes + 7]);
         }
+        std::mutex disk_mutex;
 
         for (int i = 0; i < num_threads; i++) {
             td[i].index = i;
-            td[i].mine = &mutex[i];
-            td[i].theirs = &mutex[(num_threads + i - 1) % num_threads];
+            td[i].scheduler = &scheduler;
+            td[i].outputs = outputs.data();
+            td[i].disk_mutex = &disk_mutex;
 
             td[i].prevtableentries = prevtableentries;
             td[i].right_entry_size_bytes = right_entry_size_bytes;
@@ -711,20 +931,26 @@ std::vector<uint64_t> RunPhase1(
             td[i].pos_size = pos_size;
             td[i].compressed_entry_size_bytes = compressed_entry_size_bytes;
             td[i].ptmp_1_disks = &tmp_1_disks;
-
-            threads.emplace_back(phase1_thread, &td[i]);
+            td[i].table6_used = table_index == 6 ? table6_used.get() : nullptr;
         }
-        Sem::Post(&mutex[num_threads - 1]);
 
-        for (auto& t : threads) {
-            t.join();
-        }
+        ThreadPool::Global().RunConcurrently(
+            num_threads, [&](uint32_t const i) { phase1_thread(&td[i]); });
 
+        // end of parallel execution
+
+        std::vector<uint64_t> stripes(num_threads);
+        std::vector<double> utilization(num_threads);
         for (int i = 0; i < num_threads; i++) {
-            Sem::Destroy(mutex[i]);
+            stripes[i] = scheduler.Stripes(i);
+            utilization[i] = scheduler.Utilization(i);
         }
+        PrintThreadUtilization("Stripes", stripes, utilization);
 
-        // end of parallel execution
+        globals.left_writer_count = scheduler.LeftTotal();
+        globals.left_writer = globals.left_writer_count * compressed_entry_size_bytes;
+        globals.right_writer_count = scheduler.RightTotal();
+        globals.right_writer = globals.right_writer_count * right_entry_size_bytes;
 
         // Total matches found in the left table
         std::cout << "\tTotal matches: " << globals.matches << std::endl;
@@ -758,7 +984,7 @@ std::vector<uint64_t> RunPhase1(
     }
     table_sizes[0] = 0;
     globals.R_sort_manager.reset();
-    return table_sizes;
+    return {std::move(table_sizes), std::move(table6_used)};
 }
 
 #endif  // SRC_CPP_PHASE1_HPP
@@ -15,12 +15,16 @@
 #ifndef SRC_CPP_PHASE2_HPP_
 #define SRC_CPP_PHASE2_HPP_
 
+#include <atomic>
+#include <mutex>
+
 #include "disk.hpp"
 #include "entry_sizes.hpp"
 #include "sort_manager.hpp"
 #include "bitfield.hpp"
 #include "bitfield_index.hpp"
 #include "progress.hpp"
+#include "thread_pool.hpp"
 
 struct Phase2Results
 {
@@ -36,6 +40,58 @@ struct Phase2Results
     std::vector<uint64_t> table_sizes;
 };
 
+// The number of entries phase 2 scans at a time. It's a multiple of 64, so
+// chunks start on a bitfield word, and of direct_alignment, so they start on a
+// block boundary.
+inline int64_t Phase2ChunkEntries(uint32_t const entry_size)
+{
+    return std::max<int64_t>(read_ahead / entry_size / direct_alignment, 1) * direct_alignment;
+}
+
+// Reads the table_size entries of file a chunk (of chunk_entries) at a time,
+// on num_threads threads, and calls fn(thread_index, entries, begin, end) for
+// each chunk, with entries holding the entries [begin, end). The chunks are
+// handed out in order, but may finish in any order. If write_back is set, each
+// chunk is written back to the file as fn leaves it.
+template <typename Fn>
+void ScanTableParallel(
+    FileDisk& file,
+    int64_t const table_size,
+    uint32_t const entry_size,
+    int64_t const chunk_entries,
+    uint8_t const num_threads,
+    bool const write_back,
+    Fn const& fn)
+{
+    int64_t const num_chunks = cdiv(table_size, chunk_entries);
+    // FileDisk keeps track of its own position, so only one thread at a time
+    // may use it
+    std::mutex file_mutex;
+    std::atomic<int64_t> next_chunk{0};
+    auto worker = [&](uint32_t const thread_index) {
+        uint64_t const buffer_size = chunk_entries * entry_size;
+        // aligned for direct I/O, and 7 bytes head-room for
+        // SliceInt64FromBytes()
+        std::unique_ptr<uint8_t[]> alloc(new uint8_t[buffer_size + direct_alignment - 1 + 7]);
+        uint8_t* buffer = AlignForDirectIO(alloc.get());
+        for (int64_t chunk = next_chunk++; chunk < num_chunks; chunk = next_chunk++) {
+            int64_t const begin = chunk * chunk_entries;
+            int64_t const end = std::min(begin + chunk_entries, table_size);
+            uint64_t const size = (end - begin) * entry_size;
+            {
+                std::lock_guard<std::mutex> l(file_mutex);
+                file.Read(begin * entry_size, buffer, size);
+            }
+            fn(thread_index, buffer, begin, end);
+            if (write_back) {
+                std::lock_guard<std::mutex> l(file_mutex);
+                file.Write(begin * entry_size, buffer, size);
+            }
+        }
+    };
+    ThreadPool::Global().RunConcurrently(num_threads, worker);
+}
+
 // Backpropagate takes in as input, a file on which forward propagation has been done.
 // The purpose of backpropagate is to eliminate any dead entries that don't contribute
 // to final values in f7, to minimize disk usage. A sort on disk is applied to each table,
@@ -50,7 +106,10 @@ Phase2Results RunPhase2(
     uint64_t memory_size,
     uint32_t const num_buckets,
     uint32_t const log_num_buckets,
-    uint8_t const flags)
+    uint8_t const num_threads,
+    uint8_t const flags,
+    MemoryBudget* const bucket_memory = nullptr,
+    std::unique_ptr<bitfield> table6_used = nullptr)
 {
     // After pruning each table will have 0.865 * 2^k or fewer entries on
     // average
@@ -79,10 +138,18 @@ Phase2Results RunPhase2(
     // At the end of the iteration, we transfer the next_bitfield to the current bitfield
     // to use it to prune the next table to scan.
 
+    // If phase 1 already marked the entries table 7 refers to, the first scan
+    // of table 7 is skipped, and its bitfield is used as the first
+    // next_bitfield. It's only big enough for tables 1 to 6, which is all the
+    // bitfields are used for.
+
     int64_t const max_table_size = *std::max_element(table_sizes.begin()
         , table_sizes.end());
 
-    bitfield next_bitfield(max_table_size);
+    bool const table7_scanned = table6_used != nullptr;
+    bitfield next_bitfield =
+        table7_scanned ? std::move(*table6_used) : bitfield(max_table_size);
+    table6_used.reset();
     bitfield current_bitfield(max_table_size);
 
     std::vector<std::unique_ptr<SortManager>> output_files;
@@ -100,41 +167,52 @@ Phase2Results RunPhase2(
 
         Timer scan_timer;
 
-        next_bitfield.clear();
+        bool const skip_scan = table_index == 7 && table7_scanned;
+        if (!skip_scan) {
+            next_bitfield.clear();
+        }
 
         int64_t const table_size = table_sizes[table_index];
         int16_t const entry_size = cdiv(k + kOffsetSize + (table_index == 7 ? k : 0), 8);
-
-        BufferedDisk disk(&tmp_1_disks[table_index], table_size * entry_size);
-
-        // read_index is the number of entries we've processed so far (in the
-        // current table) i.e. the index to the current entry. This is not used
-        // for table 7
-
-        int64_t read_cursor = 0;
-        for (int64_t read_index = 0; read_index < table_size; ++read_index, read_cursor += entry_size)
-        {
-            uint8_t const* entry = disk.Read(read_cursor, entry_size);
-
-            uint64_t entry_pos_offset = 0;
-            if (table_index == 7) {
-                // table 7 is special, we never drop anything, so just build
-                // next_bitfield
-                entry_pos_offset = Util::SliceInt64FromBytes(entry, k, pos_offset_size);
-            } else {
-                if (!current_bitfield.get(read_index))
-                {
-                    // This entry should be dropped.
-                    continue;
-                }
-                entry_pos_offset = Util::SliceInt64FromBytes(entry, 0, pos_offset_size);
-            }
-
-            uint64_t entry_pos = entry_pos_offset >> kOffsetSize;
-            uint64_t entry_offset = entry_pos_offset & ((1U << kOffsetSize) - 1);
-            // mark the two matching entries as used (pos and pos+offset)
-            next_bitfield.set(entry_pos);
-            next_bitfield.set(entry_pos + entry_offset);
+        int64_t const chunk_entries = Phase2ChunkEntries(entry_size);
+        FileDisk& disk = tmp_1_disks[table_index];
+
+        // The first scan. The threads each take a chunk of the table at a
+        // time, and only meet in next_bitfield
+        if (!skip_scan) {
+            ScanTableParallel(
+                disk,
+                table_size,
+                entry_size,
+                chunk_entries,
+                num_threads,
+                false,
+                [&](uint32_t, uint8_t* entries, int64_t const begin, int64_t const end) {
+                    for (int64_t read_index = begin; read_index < end; ++read_index) {
+                        uint8_t const* entry = entries + (read_index - begin) * entry_size;
+
+                        uint64_t entry_pos_offset = 0;
+                        if (table_index == 7) {
+                            // table 7 is special, we never drop anything, so just build
+                            // next_bitfield
+                            entry_pos_offset =
+                                Util::SliceInt64FromBytes(entry, k, pos_offset_size);
+                        } else {
+                            if (!current_bitfield.get(read_index)) {
+                                // This entry should be dropped.
+                                continue;
+                            }
+                            entry_pos_offset =
+                                Util::SliceInt64FromBytes(entry, 0, pos_offset_size);
+                        }
+
+                        uint64_t entry_pos = entry_pos_offset >> kOffsetSize;
+                        uint64_t entry_offset = entry_pos_offset & ((1U << kOffsetSize) - 1);
+                        // mark the two matching entries as used (pos and pos+offset)
+                        next_bitfield.set_concurrent(entry_pos);
+                        next_bitfield.set_concurrent(entry_pos + entry_offset);
+                    }
+                });
         }
 
         std::cout << "scanned table " << table_index << std::endl;
@@ -154,80 +232,120 @@ Phase2Results RunPhase2(
         // table 1 is already sorted, so we can use all memory for sorting
         // table 2.
 
-        auto sort_manager = std::make_unique<SortManager>(
-            table_index == 2 ? memory_size : memory_size / 2,
-            num_buckets,
-            log_num_buckets,
-            new_entry_size,
-            tmp_dirname,
-            filename + ".p2.t" + std::to_string(table_index),
-            uint32_t(k),
-            0,
-            strategy_t::quicksort_last);
+        std::unique_ptr<SortManager> sort_manager;
+        // one writer per thread, so they don't contend on the sort manager
+        std::vector<std::unique_ptr<SortManager::ConcurrentWriter>> writers;
+        if (table_index != 7) {
+            sort_manager = std::make_unique<SortManager>(
+                table_index == 2 ? memory_size : memory_size / 2,
+                num_buckets,
+                log_num_buckets,
+                new_entry_size,
+                tmp_dirname,
+                filename + ".p2.t" + std::to_string(table_index),
+                uint32_t(k),
+                0,
+                strategy_t::parallel_radix,
+                num_threads,
+                TempFileMode(flags),
+                bucket_memory,
+                // sort_key, pos, offset
+                (flags & (PACKED_TEMP | COMPRESSED_TEMP)) ? k + pos_offset_size : 0,
+                (flags & COMPRESSED_TEMP) != 0);
+            for (uint32_t i = 0; i < std::max<uint32_t>(num_threads, 1); i++) {
+                writers.push_back(
+                    std::make_unique<SortManager::ConcurrentWriter>(*sort_manager));
+            }
+        }
+
+        // The sort_key of an entry is the number of entries kept before it,
+        // so every chunk needs to know where its count starts
+        std::vector<int64_t> chunk_write_counters;
+        int64_t write_counter = 0;
+        for (int64_t begin = 0; begin < table_size; begin += chunk_entries) {
+            int64_t const end = std::min(begin + chunk_entries, table_size);
+            chunk_write_counters.push_back(write_counter);
+            write_counter +=
+                table_index == 7 ? end - begin : current_bitfield.count(begin, end);
+        }
 
         // as we scan the table for the second time, we'll also need to remap
         // the positions and offsets based on the next_bitfield.
         bitfield_index const index(next_bitfield);
 
-        read_cursor = 0;
-        int64_t write_counter = 0;
-        for (int64_t read_index = 0; read_index < table_size; ++read_index, read_cursor += entry_size)
-        {
-            uint8_t const* entry = disk.Read(read_cursor, entry_size);
-
-            uint64_t entry_f7 = 0;
-            uint64_t entry_pos_offset;
-            if (table_index == 7) {
-                // table 7 is special, we never drop anything, so just build
-                // next_bitfield
-                entry_f7 = Util::SliceInt64FromBytes(entry, 0, k);
-                entry_pos_offset = Util::SliceInt64FromBytes(entry, k, pos_offset_size);
-            } else {
-                // skipping
-                if (!current_bitfield.get(read_index)) continue;
-
-                entry_pos_offset = Util::SliceInt64FromBytes(entry, 0, pos_offset_size);
-            }
-
-            uint64_t entry_pos = entry_pos_offset >> kOffsetSize;
-            uint64_t entry_offset = entry_pos_offset & ((1U << kOffsetSize) - 1);
-
-            // assemble the new entry and write it to the sort manager
-
-            // map the pos and offset to the new, compacted, positions and
-            // offsets
-            std::tie(entry_pos, entry_offset) = index.lookup(entry_pos, entry_offset);
-            entry_pos_offset = (entry_pos << kOffsetSize) | entry_offset;
-
-            uint8_t bytes[16];
-            if (table_index == 7) {
-                // table 7 is already sorted by pos, so we just rewrite the
-                // pos and offset in-place
-                uint128_t new_entry = (uint128_t)entry_f7 << f7_shift;
-                new_entry |= (uint128_t)entry_pos_offset << t7_pos_offset_shift;
-                Util::IntTo16Bytes(bytes, new_entry);
-
-                disk.Write(read_index * entry_size, bytes, entry_size);
-            }
-            else {
-                // The new entry is slightly different. Metadata is dropped, to
-                // save space, and the counter of the entry is written (sort_key). We
-                // use this instead of (y + pos + offset) since its smaller.
-                uint128_t new_entry = (uint128_t)write_counter << write_counter_shift;
-                new_entry |= (uint128_t)entry_pos_offset << pos_offset_shift;
-                Util::IntTo16Bytes(bytes, new_entry);
-
-                sort_manager->AddToCache(bytes);
-            }
-            ++write_counter;
-        }
+        ScanTableParallel(
+            disk,
+            table_size,
+            entry_size,
+            chunk_entries,
+            num_threads,
+            // table 7 is rewritten in place
+            table_index == 7,
+            [&](uint32_t const thread_index,
+                uint8_t* entries,
+                int64_t const begin,
+                int64_t const end) {
+                int64_t entry_write_counter = chunk_write_counters[begin / chunk_entries];
+                for (int64_t read_index = begin; read_index < end; ++read_index) {
+                    uint8_t* entry = entries + (read_index - begin) * entry_size;
+
+                    uint64_t entry_f7 = 0;
+                    uint64_t entry_pos_offset;
+                    if (table_index == 7) {
+                        // table 7 is special, we never drop anything, so just build
+                        // next_bitfield
+                        entry_f7 = Util::SliceInt64FromBytes(entry, 0, k);
+                        entry_pos_offset = Util::SliceInt64FromBytes(entry, k, pos_offset_size);
+                    } else {
+                        // skipping
+                        if (!current_bitfield.get(read_index)) continue;
+
+                        entry_pos_offset = Util::SliceInt64FromBytes(entry, 0, pos_offset_size);
+                    }
+
+                    uint64_t entry_pos = entry_pos_offset >> kOffsetSize;
+                    uint64_t entry_offset = entry_pos_offset & ((1U << kOffsetSize) - 1);
+
+                    // assemble the new entry and write it to the sort manager
+
+                    // map the pos and offset to the new, compacted, positions and
+                    // offsets
+                    std::tie(entry_pos, entry_offset) = index.lookup(entry_pos, entry_offset);
+                    entry_pos_offset = (entry_pos << kOffsetSize) | entry_offset;
+
+                    uint8_t bytes[16];
+                    if (table_index == 7) {
+                        // table 7 is already sorted by pos, so we just rewrite the
+                        // pos and offset in-place
+                        uint128_t new_entry = (uint128_t)entry_f7 << f7_shift;
+                        new_entry |= (uint128_t)entry_pos_offset << t7_pos_offset_shift;
+                        Util::IntTo16Bytes(bytes, new_entry);
+
+                        memcpy(entry, bytes, entry_size);
+                    }
+                    else {
+                        // The new entry is slightly different. Metadata is dropped, to
+                        // save space, and the counter of the entry is written (sort_key). We
+                        // use this instead of (y + pos + offset) since its smaller.
+                        uint128_t new_entry = (uint128_t)entry_write_counter << write_counter_shift;
+                        new_entry |= (uint128_t)entry_pos_offset << pos_offset_shift;
+                        Util::IntTo16Bytes(bytes, new_entry);
+
+                        writers[thread_index]->Add(bytes);
+                    }
+                    ++entry_write_counter;
+                }
+            });
 
         if (table_index != 7) {
+            for (auto& writer : writers) {
+                writer->Flush();
+            }
+            writers.clear();
             sort_manager->FlushCache();
             sort_timer.PrintElapsed("sort time = ");
 
             // clear disk caches
-            disk.FreeMemory();
             sort_manager->FreeMemory();
 
             output_files[table_index - 2] = std::move(sort_manager);
@@ -15,12 +15,17 @@
 #ifndef SRC_CPP_PHASE3_HPP_
 #define SRC_CPP_PHASE3_HPP_
 
+#include <exception>
+#include <mutex>
+#include <future>
+
 #include "encoding.hpp"
 #include "entry_sizes.hpp"
 #include "exceptions.hpp"
 #include "pos_constants.hpp"
 #include "sort_manager.hpp"
 #include "progress.hpp"
+#include "threading.hpp"
 
 // Results of phase 3. These are passed into Phase 4, so the checkpoint tables
 // can be properly built.
@@ -42,10 +47,8 @@ struct Phase3Results {
 // have many entries in each park, we can approximate how much space each park with take. Format
 // is: [2k bits of first_line_point]  [EPP-1 stubs] [Deltas size] [EPP-1 deltas]....
 // [first_line_point] ...
-void WriteParkToFile(
-    FileDisk &final_disk,
-    uint64_t table_start,
-    uint64_t park_index,
+// EncodePark() writes park_size_bytes bytes of the park to park_buffer.
+void EncodePark(
     uint32_t park_size_bytes,
     uint128_t first_line_point,
     const std::vector<uint8_t> &park_deltas,
@@ -55,9 +58,6 @@ void WriteParkToFile(
     uint8_t *park_buffer,
     uint64_t const park_buffer_size)
 {
-    // Parks are fixed size, so we know where to start writing. The deltas will not go over
-    // into the next park.
-    uint64_t writer = table_start + park_index * park_size_bytes;
     uint8_t *index = park_buffer;
 
     first_line_point <<= 128 - 2 * k;
@@ -101,10 +101,255 @@ void WriteParkToFile(
             " bytes. Space: " + std::to_string(park_buffer_size));
     }
     memset(index, 0x00, park_size_bytes - (index - park_buffer));
+}
+
+void WriteParkToFile(
+    FileDisk &final_disk,
+    uint64_t table_start,
+    uint64_t park_index,
+    uint32_t park_size_bytes,
+    uint128_t first_line_point,
+    const std::vector<uint8_t> &park_deltas,
+    const std::vector<uint64_t> &park_stubs,
+    uint8_t k,
+    uint8_t table_index,
+    uint8_t *park_buffer,
+    uint64_t const park_buffer_size)
+{
+    EncodePark(
+        park_size_bytes,
+        first_line_point,
+        park_deltas,
+        park_stubs,
+        k,
+        table_index,
+        park_buffer,
+        park_buffer_size);
 
+    // Parks are fixed size, so we know where to start writing. The deltas will not go over
+    // into the next park.
+    uint64_t writer = table_start + park_index * park_size_bytes;
     final_disk.Write(writer, (uint8_t *)park_buffer, park_size_bytes);
 }
 
+// Encodes parks and writes them to a region of the final file on num_threads
+// background threads, so the second pass of phase 3 can carry on reading the
+// sort manager. Parks have a fixed size, and so a fixed place in the file, which
+// lets them be encoded and written in any order. At most kParksPerThread parks
+// per thread are queued, Add() waits while the queue is full.
+class ParkWriter {
+public:
+    static const uint32_t kParksPerThread = 4;
+
+    ParkWriter(
+        RegionWriter &final_file,
+        size_t const region,
+        uint8_t const k,
+        uint32_t const num_threads)
+        : final_file_(final_file)
+        , region_(region)
+        , k_(k)
+        , park_buffer_size_(
+              EntrySizes::CalculateLinePointSize(k) + EntrySizes::CalculateStubsSize(k) + 2 +
+              EntrySizes::CalculateMaxDeltasSize(k, 1))
+        , tasks_(num_threads, kParksPerThread * std::max<uint32_t>(num_threads, 1))
+    {
+    }
+
+    // Queues a park, see WriteParkToFile()
+    void Add(
+        uint64_t const table_start,
+        uint64_t const park_index,
+        uint32_t const park_size_bytes,
+        uint128_t const first_line_point,
+        std::vector<uint8_t> park_deltas,
+        std::vector<uint64_t> park_stubs,
+        uint8_t const table_index)
+    {
+        tasks_.Add([this,
+                    begin = table_start + park_index * park_size_bytes,
+                    park_size_bytes,
+                    first_line_point,
+                    park_deltas = std::move(park_deltas),
+                    park_stubs = std::move(park_stubs),
+                    table_index]() {
+            std::unique_ptr<uint8_t[]> park_buffer(new uint8_t[park_buffer_size_]);
+            EncodePark(
+                park_size_bytes,
+                first_line_point,
+                park_deltas,
+                park_stubs,
+                k_,
+                table_index,
+                park_buffer.get(),
+                park_buffer_size_);
+            std::lock_guard<std::mutex> l(file_mutex_);
+            final_file_.Write(region_, begin, park_buffer.get(), park_size_bytes);
+        });
+    }
+
+    // Waits until all queued parks are written. Throws the first error any of
+    // them ran into.
+    void Flush() { tasks_.Wait(); }
+
+private:
+    RegionWriter &final_file_;
+    size_t const region_;
+    uint8_t const k_;
+    uint64_t const park_buffer_size_;
+    // only one thread at a time may write to the RegionWriter
+    std::mutex file_mutex_;
+    // last, so the threads are stopped before anything else goes away
+    TaskQueue tasks_;
+};
+
+// The first pass of phase 3 runs as a pipeline. Two threads read the right and
+// the left table (sorting their buckets as they get to them), the calling
+// thread matches them up and computes the line points, and another thread adds
+// those to the sort manager. The stages pass each other batches of
+// kPipelineBatch values, through queues of kPipelineQueue batches.
+const uint32_t kPipelineBatch = 4096;
+const uint32_t kPipelineQueue = 4;
+
+// Calls read() count times on a pool thread, and hands out the values it
+// returns, in order, through Next()
+template <typename T>
+class BatchReader {
+public:
+    template <typename Fn>
+    BatchReader(uint64_t const count, Fn read) : queue_(kPipelineQueue)
+    {
+        done_ = ThreadPool::Global().Submit([this, count, read]() mutable {
+            try {
+                std::vector<T> batch;
+                batch.reserve(kPipelineBatch);
+                for (uint64_t i = 0; i < count; i++) {
+                    batch.push_back(read());
+                    if (batch.size() == kPipelineBatch || i + 1 == count) {
+                        if (!queue_.Push(std::move(batch))) {
+                            // cancelled
+                            return;
+                        }
+                        batch = std::vector<T>();
+                        batch.reserve(kPipelineBatch);
+                    }
+                }
+            } catch (...) {
+                error_ = std::current_exception();
+            }
+            queue_.Close();
+        });
+    }
+
+    BatchReader(BatchReader const &) = delete;
+    BatchReader &operator=(BatchReader const &) = delete;
+
+    // Stops the thread, whether or not all values have been read
+    ~BatchReader()
+    {
+        queue_.Cancel();
+        done_.wait();
+    }
+
+    T Next()
+    {
+        if (next_ == batch_.size()) {
+            next_ = 0;
+            if (!queue_.Pop(batch_)) {
+                if (error_) {
+                    std::rethrow_exception(error_);
+                }
+                throw InvalidStateException("Read past the end of the table");
+            }
+        }
+        return batch_[next_++];
+    }
+
+private:
+    SPSCQueue<std::vector<T>> queue_;
+    std::exception_ptr error_;
+    std::vector<T> batch_;
+    size_t next_ = 0;
+    // ready once the thread is done
+    std::future<void> done_;
+};
+
+// Calls write(value) on a pool thread, for each value passed to Add(),
+// in order
+template <typename T>
+class BatchWriter {
+public:
+    template <typename Fn>
+    explicit BatchWriter(Fn write) : queue_(kPipelineQueue)
+    {
+        batch_.reserve(kPipelineBatch);
+        done_ = ThreadPool::Global().Submit([this, write]() mutable {
+            try {
+                std::vector<T> batch;
+                while (queue_.Pop(batch)) {
+                    for (T const &value : batch) {
+                        write(value);
+                    }
+                }
+            } catch (...) {
+                error_ = std::current_exception();
+                // unblocks Add()
+                queue_.Cancel();
+            }
+        });
+    }
+
+    BatchWriter(BatchWriter const &) = delete;
+    BatchWriter &operator=(BatchWriter const &) = delete;
+
+    ~BatchWriter()
+    {
+        if (done_.valid()) {
+            queue_.Cancel();
+            done_.wait();
+        }
+    }
+
+    void Add(T const &value)
+    {
+        batch_.push_back(value);
+        if (batch_.size() == kPipelineBatch) {
+            PushBatch();
+        }
+    }
+
+    // Waits until all values have been written
+    void Finish()
+    {
+        if (!batch_.empty()) {
+            PushBatch();
+        }
+        queue_.Close();
+        done_.get();
+        if (error_) {
+            std::rethrow_exception(error_);
+        }
+    }
+
+private:
+    void PushBatch()
+    {
+        if (!queue_.Push(std::move(batch_))) {
+            // the thread has failed
+            done_.get();
+            std::rethrow_exception(error_);
+        }
+        batch_ = std::vector<T>();
+        batch_.reserve(kPipelineBatch);
+    }
+
+    SPSCQueue<std::vector<T>> queue_;
+    std::exception_ptr error_;
+    std::vector<T> batch_;
+    // ready once the thread is done
+    std::future<void> done_;
+};
+
 // Compresses the plot file tables into the final file. In order to do this, entries must be
 // reorganized from the (pos, offset) bucket sorting order, to a more free line_point sorting
 // order. In (pos, offset ordering), we store two pointers two the previous table, (x, y) which
@@ -128,7 +373,9 @@ Phase3Results RunPhase3(
     uint64_t memory_size,
     uint32_t num_buckets,
     uint32_t log_num_buckets,
-    const uint8_t flags)
+    uint8_t const num_threads,
+    const uint8_t flags,
+    MemoryBudget* const bucket_memory = nullptr)
 {
     uint8_t const pos_size = k;
     uint8_t const line_point_size = 2 * k - 1;
@@ -136,9 +383,15 @@ Phase3Results RunPhase3(
     std::vector<uint64_t> final_table_begin_pointers(12, 0);
     final_table_begin_pointers[1] = header_size;
 
+    // The table pointers in the header, and the parks of the tables, are
+    // each written front to back, so their writes are combined
+    RegionWriter final_file(tmp2_disk);
+    size_t const pointers_region = final_file.AddRegion(header_size - 10 * 8);
+    size_t const parks_region = final_file.AddRegion(header_size);
+
     uint8_t table_pointer_bytes[8];
     Util::IntToEightBytes(table_pointer_bytes, final_table_begin_pointers[1]);
-    tmp2_disk.Write(header_size - 10 * 8, table_pointer_bytes, 8);
+    final_file.Write(pointers_region, header_size - 10 * 8, table_pointer_bytes, 8);
 
     uint64_t final_entries_written = 0;
     uint32_t right_entry_size_bytes = 0;
@@ -147,12 +400,8 @@ Phase3Results RunPhase3(
     std::unique_ptr<SortManager> L_sort_manager;
     std::unique_ptr<SortManager> R_sort_manager;
 
-    // These variables are used in the WriteParkToFile method. They are preallocatted here
-    // to save time.
-    uint64_t const park_buffer_size = EntrySizes::CalculateLinePointSize(k)
-        + EntrySizes::CalculateStubsSize(k) + 2
-        + EntrySizes::CalculateMaxDeltasSize(k, 1);
-    std::unique_ptr<uint8_t[]> park_buffer(new uint8_t[park_buffer_size]);
+    // The parks of the final tables are encoded and written in the background
+    ParkWriter park_writer(final_file, parks_region, k, num_threads);
 
     // Iterates through all tables, starting at 1, with L and R pointers.
     // For each table, R entries are rewritten with line points. Then, the right table is
@@ -184,7 +433,6 @@ Phase3Results RunPhase3(
         uint32_t p2_entry_size_bytes = EntrySizes::GetKeyPosOffsetSize(k);
         right_entry_size_bytes = EntrySizes::GetMaxEntrySize(k, table_index + 1, false);
 
-        uint64_t left_reader = 0;
         uint64_t right_reader = 0;
         uint64_t left_reader_count = 0;
         uint64_t right_reader_count = 0;
@@ -205,7 +453,14 @@ Phase3Results RunPhase3(
             filename + ".p3.t" + std::to_string(table_index + 1),
             0,
             0,
-            strategy_t::quicksort_last);
+            strategy_t::parallel_radix,
+            num_threads,
+            TempFileMode(flags),
+            bucket_memory,
+            // line_point, sort_key
+            (flags & (PACKED_TEMP | COMPRESSED_TEMP)) ? line_point_size + right_sort_key_size
+                                                      : 0,
+            (flags & COMPRESSED_TEMP) != 0);
 
         bool should_read_entry = true;
         std::vector<uint64_t> left_new_pos(kCachedPositionsSize);
@@ -221,13 +476,63 @@ Phase3Results RunPhase3(
         uint64_t end_of_table_pos = 0;
         uint64_t greatest_pos = 0;
 
-        uint8_t const* left_entry_disk_buf = nullptr;
+        uint64_t left_entry_new_pos = 0;
 
         uint64_t entry_sort_key, entry_pos, entry_offset;
         uint64_t cached_entry_sort_key = 0;
         uint64_t cached_entry_pos = 0;
         uint64_t cached_entry_offset = 0;
 
+        // The right entries are in the format from backprop, (sort_key, pos,
+        // offset)
+        struct right_entry_t {
+            uint64_t sort_key;
+            uint64_t pos;
+            uint64_t offset;
+        };
+        auto right_entries = std::make_unique<BatchReader<right_entry_t>>(
+            res2.table_sizes[table_index + 1],
+            [&, reader = uint64_t(0)]() mutable {
+                uint8_t const* right_entry_buf = right_disk.Read(reader, p2_entry_size_bytes);
+                reader += p2_entry_size_bytes;
+                return right_entry_t{
+                    Util::SliceInt64FromBytes(right_entry_buf, 0, right_sort_key_size),
+                    Util::SliceInt64FromBytes(right_entry_buf, right_sort_key_size, pos_size),
+                    Util::SliceInt64FromBytes(
+                        right_entry_buf, right_sort_key_size + pos_size, kOffsetSize)};
+            });
+
+        // We read the "new_pos" from the L table, which for table 1 is just x. For
+        // other tables, the new_pos
+        auto left_new_positions = std::make_unique<BatchReader<uint64_t>>(
+            res2.table_sizes[table_index], [&, reader = uint64_t(0)]() mutable {
+                // The left entries are in the new format: (sort_key, new_pos), except for
+                // table 1: (y, x).
+
+                // TODO: unify these cases once SortManager implements
+                // the ReadDisk interface
+                if (table_index == 1) {
+                    uint8_t const* left_entry_disk_buf =
+                        left_disk.Read(reader, left_entry_size_bytes);
+                    reader += left_entry_size_bytes;
+                    // Only k bits, since this is x
+                    return Util::SliceInt64FromBytes(left_entry_disk_buf, 0, k);
+                }
+                uint8_t const* left_entry_disk_buf = L_sort_manager->ReadEntry(reader);
+                reader += new_pos_entry_size_bytes;
+                // k+1 bits in case it overflows
+                return Util::SliceInt64FromBytes(left_entry_disk_buf, right_sort_key_size, k);
+            });
+
+        // (line_point, sort_key), left aligned
+        uint8_t const line_point_shift = 128 - line_point_size;
+        uint8_t const right_sort_key_shift = line_point_shift - right_sort_key_size;
+        BatchWriter<uint128_t> line_points([&](uint128_t const entry) {
+            uint8_t bytes[16];
+            Util::IntTo16Bytes(bytes, entry);
+            R_sort_manager->AddToCache(bytes);
+        });
+
         // Similar algorithm as Backprop, to read both L and R tables simultaneously
         while (!end_of_right_table || (current_pos - end_of_table_pos <= kReadMinusWrite)) {
             old_counters[current_pos % kReadMinusWrite] = 0;
@@ -238,21 +543,14 @@ Phase3Results RunPhase3(
                         if (right_reader_count == res2.table_sizes[table_index + 1]) {
                             end_of_right_table = true;
                             end_of_table_pos = current_pos;
-                            right_disk.FreeMemory();
                             break;
                         }
-                        // The right entries are in the format from backprop, (sort_key, pos,
-                        // offset)
-                        uint8_t const* right_entry_buf = right_disk.Read(right_reader, p2_entry_size_bytes);
-                        right_reader += p2_entry_size_bytes;
+                        right_entry_t const right_entry = right_entries->Next();
                         right_reader_count++;
 
-                        entry_sort_key =
-                            Util::SliceInt64FromBytes(right_entry_buf, 0, right_sort_key_size);
-                        entry_pos = Util::SliceInt64FromBytes(
-                            right_entry_buf, right_sort_key_size, pos_size);
-                        entry_offset = Util::SliceInt64FromBytes(
-                            right_entry_buf, right_sort_key_size + pos_size, kOffsetSize);
+                        entry_sort_key = right_entry.sort_key;
+                        entry_pos = right_entry.pos;
+                        entry_offset = right_entry.offset;
                     } else if (cached_entry_pos == current_pos) {
                         entry_sort_key = cached_entry_sort_key;
                         entry_pos = cached_entry_pos;
@@ -282,32 +580,10 @@ Phase3Results RunPhase3(
                 }
 
                 if (left_reader_count < res2.table_sizes[table_index]) {
-                    // The left entries are in the new format: (sort_key, new_pos), except for table
-                    // 1: (y, x).
-
-                    // TODO: unify these cases once SortManager implements
-                    // the ReadDisk interface
-                    if (table_index == 1) {
-                        left_entry_disk_buf = left_disk.Read(left_reader, left_entry_size_bytes);
-                        left_reader += left_entry_size_bytes;
-                    } else {
-                        left_entry_disk_buf = L_sort_manager->ReadEntry(left_reader);
-                        left_reader += new_pos_entry_size_bytes;
-                    }
+                    left_entry_new_pos = left_new_positions->Next();
                     left_reader_count++;
                 }
-
-                // We read the "new_pos" from the L table, which for table 1 is just x. For
-                // other tables, the new_pos
-                if (table_index == 1) {
-                    // Only k bits, since this is x
-                    left_new_pos[current_pos % kCachedPositionsSize] =
-                        Util::SliceInt64FromBytes(left_entry_disk_buf, 0, k);
-                } else {
-                    // k+1 bits in case it overflows
-                    left_new_pos[current_pos % kCachedPositionsSize] =
-                        Util::SliceInt64FromBytes(left_entry_disk_buf, right_sort_key_size, k);
-                }
+                left_new_pos[current_pos % kCachedPositionsSize] = left_entry_new_pos;
             }
 
             uint64_t const write_pointer_pos = current_pos - kReadMinusWrite + 1;
@@ -337,17 +613,22 @@ Phase3Results RunPhase3(
                             abort();
                         }
                     }
-                    Bits to_write = Bits(line_point, line_point_size);
-                    to_write.AppendValue(
-                        old_sort_keys[write_pointer_pos % kReadMinusWrite][counter],
-                        right_sort_key_size);
+                    uint128_t to_write = line_point << line_point_shift;
+                    to_write |= (uint128_t)old_sort_keys[write_pointer_pos % kReadMinusWrite]
+                                                        [counter]
+                                << right_sort_key_shift;
 
-                    R_sort_manager->AddToCache(to_write);
+                    line_points.Add(to_write);
                     total_r_entries++;
                 }
             }
             current_pos += 1;
         }
+        // The readers may be ahead, past what's been needed
+        right_entries.reset();
+        left_new_positions.reset();
+        line_points.Finish();
+        right_disk.FreeMemory();
         computation_pass_1_timer.PrintElapsed("\tFirst computation pass time:");
 
         // Remove no longer needed file
@@ -390,7 +671,15 @@ Phase3Results RunPhase3(
             filename + ".p3s.t" + std::to_string(table_index + 1),
             0,
             0,
-            strategy_t::quicksort_last);
+            strategy_t::parallel_radix,
+            num_threads,
+            TempFileMode(flags),
+            bucket_memory,
+            // sort_key, new_pos
+            (flags & (PACKED_TEMP | COMPRESSED_TEMP))
+                ? right_sort_key_size + k + (table_index == 6 ? 1 : 0)
+                : 0,
+            (flags & COMPRESSED_TEMP) != 0);
 
         std::vector<uint8_t> park_deltas;
         std::vector<uint64_t> park_stubs;
@@ -428,20 +717,16 @@ Phase3Results RunPhase3(
             // Every EPP entries, writes a park
             if (index % kEntriesPerPark == 0) {
                 if (index != 0) {
-                    WriteParkToFile(
-                        tmp2_disk,
+                    final_entries_written += (park_stubs.size() + 1);
+                    park_writer.Add(
                         final_table_begin_pointers[table_index],
                         park_index,
                         park_size_bytes,
                         checkpoint_line_point,
-                        park_deltas,
-                        park_stubs,
-                        k,
-                        table_index,
-                        park_buffer.get(),
-                        park_buffer_size);
+                        std::move(park_deltas),
+                        std::move(park_stubs),
+                        table_index);
                     park_index += 1;
-                    final_entries_written += (park_stubs.size() + 1);
                 }
                 park_deltas.clear();
                 park_stubs.clear();
@@ -475,20 +760,18 @@ Phase3Results RunPhase3(
 
         if (park_deltas.size() > 0) {
             // Since we don't have a perfect multiple of EPP entries, this writes the last ones
-            WriteParkToFile(
-                tmp2_disk,
+            final_entries_written += (park_stubs.size() + 1);
+            park_writer.Add(
                 final_table_begin_pointers[table_index],
                 park_index,
                 park_size_bytes,
                 checkpoint_line_point,
-                park_deltas,
-                park_stubs,
-                k,
-                table_index,
-                park_buffer.get(),
-                park_buffer_size);
-            final_entries_written += (park_stubs.size() + 1);
+                std::move(park_deltas),
+                std::move(park_stubs),
+                table_index);
         }
+        // The table pointer below goes through the same RegionWriter
+        park_writer.Flush();
 
         Encoding::ANSFree(kRValues[table_index - 1]);
         std::cout << "\tWrote " << final_entries_written << " entries" << std::endl;
@@ -498,7 +781,7 @@ Phase3Results RunPhase3(
 
         final_table_writer = header_size - 8 * (10 - table_index);
         Util::IntToEightBytes(table_pointer_bytes, final_table_begin_pointers[table_index + 1]);
-        tmp2_disk.Write(final_table_writer, (table_pointer_bytes), 8);
+        final_file.Write(pointers_region, final_table_writer, (table_pointer_bytes), 8);
         final_table_writer += 8;
 
         table_timer.PrintElapsed("Total compress table time:");
@@ -509,7 +792,7 @@ Phase3Results RunPhase3(
     }
 
     L_sort_manager->FreeMemory();
-    park_buffer.reset();
+    final_file.Flush();
 
     // These results will be used to write table P7 and the checkpoint tables in phase 4.
     return Phase3Results{
@@ -40,7 +40,8 @@
 // C2 (checkpoint values into)
 // C3 (deltas of f7s between C1 checkpoints)
 void RunPhase4(uint8_t k, uint8_t pos_size, FileDisk &tmp2_disk, Phase3Results &res,
-               const uint8_t flags, const int max_phase4_progress_updates)
+               const uint8_t flags, const int max_phase4_progress_updates,
+               uint8_t const num_threads = 1)
 {
     uint32_t P7_park_size = Util::ByteAlign((k + 1) * kEntriesPerPark) / 8;
     uint64_t number_of_p7_parks =
@@ -62,71 +63,115 @@ void RunPhase4(uint8_t k, uint8_t pos_size, FileDisk &tmp2_disk, Phase3Results &
     res.final_table_begin_pointers[10] = begin_byte_C3;
     res.final_table_begin_pointers[11] = end_byte;
 
-    uint64_t plot_file_reader = 0;
+    // The P7 parks, the C1 and C2 entries, and the C3 entries are written
+    // interleaved, but each front to back, so their writes are combined
+    RegionWriter final_file(tmp2_disk);
+    size_t const P7_region = final_file.AddRegion(res.final_table_begin_pointers[7]);
+    size_t const C1_region = final_file.AddRegion(begin_byte_C1);
+    size_t const C3_region = final_file.AddRegion(begin_byte_C3);
+
     uint64_t final_file_writer_1 = begin_byte_C1;
-    uint64_t final_file_writer_2 = begin_byte_C3;
-    uint64_t final_file_writer_3 = res.final_table_begin_pointers[7];
+
+    // Only one thread at a time may write to final_file
+    std::mutex file_mutex;
+    auto write = [&](size_t const region,
+                     uint64_t const begin,
+                     const uint8_t *data,
+                     uint64_t const length) {
+        std::lock_guard<std::mutex> l(file_mutex);
+        final_file.Write(region, begin, data, length);
+    };
+
+    // P7 parks and C3 entries have fixed sizes, so each of them is encoded,
+    // and written, by a task of its own
+    TaskQueue encoders(
+        num_threads, ParkWriter::kParksPerThread * std::max<uint32_t>(num_threads, 1));
+
+    auto add_P7_park = [&](uint64_t const park_index, std::vector<uint64_t> positions) {
+        encoders.Add([&, park_index, positions = std::move(positions)]() {
+            ParkBits to_write_p7;
+            for (uint64_t const new_pos : positions) {
+                to_write_p7 += ParkBits(new_pos, k + 1);
+            }
+            std::unique_ptr<uint8_t[]> P7_entry_buf(new uint8_t[P7_park_size]());
+            to_write_p7.ToBytes(P7_entry_buf.get());
+            write(
+                P7_region,
+                res.final_table_begin_pointers[7] + park_index * P7_park_size,
+                P7_entry_buf.get(),
+                P7_park_size);
+        });
+    };
+
+    auto add_C3_entry = [&](uint64_t const C1_index, std::vector<uint8_t> deltas) {
+        encoders.Add([&, C1_index, deltas = std::move(deltas)]() {
+            std::unique_ptr<uint8_t[]> C3_entry_buf(new uint8_t[size_C3]);
+            size_t num_bytes = Encoding::ANSEncodeDeltas(deltas, kC3R, C3_entry_buf.get() + 2);
+
+            // We need to be careful because deltas are variable sized, and they need to fit
+            assert(size_C3 * 8 > num_bytes + 2);
+
+            // Write the size
+            Util::IntToTwoBytes(C3_entry_buf.get(), num_bytes);
+            memset(C3_entry_buf.get() + num_bytes + 2, 0, size_C3 - (num_bytes + 2));
+
+            write(
+                C3_region, begin_byte_C3 + C1_index * size_C3, C3_entry_buf.get(), size_C3);
+        });
+    };
 
     uint64_t prev_y = 0;
     std::vector<Bits> C2;
     uint64_t num_C1_entries = 0;
     std::vector<uint8_t> deltas_to_write;
+    std::vector<uint64_t> park_positions;
+    uint64_t park_index = 0;
     uint32_t right_entry_size_bytes = res.right_entry_size_bits / 8;
 
-    uint8_t *right_entry_buf;
     auto C1_entry_buf = new uint8_t[Util::ByteAlign(k) / 8];
-    auto C3_entry_buf = new uint8_t[size_C3];
-    auto P7_entry_buf = new uint8_t[P7_park_size];
 
     std::cout << "\tStarting to write C1 and C3 tables" << std::endl;
 
-    ParkBits to_write_p7;
     const int progress_update_increment = res.final_entries_written / max_phase4_progress_updates;
 
+    // Table 7 is read, and its buckets are sorted, on a thread of its own
+    auto table7_entries = std::make_unique<BatchReader<std::pair<uint64_t, uint64_t>>>(
+        res.final_entries_written, [&, plot_file_reader = uint64_t(0)]() mutable {
+            uint8_t *right_entry_buf = res.table7_sm->ReadEntry(plot_file_reader);
+            plot_file_reader += right_entry_size_bytes;
+            return std::make_pair(
+                Util::SliceInt64FromBytes(right_entry_buf, 0, k),
+                Util::SliceInt64FromBytes(right_entry_buf, k, pos_size));
+        });
+
     // We read each table7 entry, which is sorted by f7, but we don't need f7 anymore. Instead,
     // we will just store pos6, and the deltas in table C3, and checkpoints in tables C1 and C2.
     for (uint64_t f7_position = 0; f7_position < res.final_entries_written; f7_position++) {
-        right_entry_buf = res.table7_sm->ReadEntry(plot_file_reader);
-
-        plot_file_reader += right_entry_size_bytes;
-        uint64_t entry_y = Util::SliceInt64FromBytes(right_entry_buf, 0, k);
-        uint64_t entry_new_pos = Util::SliceInt64FromBytes(right_entry_buf, k, pos_size);
+        std::pair<uint64_t, uint64_t> const entry = table7_entries->Next();
+        uint64_t const entry_y = entry.first;
+        uint64_t const entry_new_pos = entry.second;
 
         Bits entry_y_bits = Bits(entry_y, k);
 
         if (f7_position % kEntriesPerPark == 0 && f7_position > 0) {
-            memset(P7_entry_buf, 0, P7_park_size);
-            to_write_p7.ToBytes(P7_entry_buf);
-            tmp2_disk.Write(final_file_writer_3, (P7_entry_buf), P7_park_size);
-            final_file_writer_3 += P7_park_size;
-            to_write_p7 = ParkBits();
+            add_P7_park(park_index++, std::move(park_positions));
+            park_positions = std::vector<uint64_t>();
         }
 
-        to_write_p7 += ParkBits(entry_new_pos, k + 1);
+        park_positions.push_back(entry_new_pos);
 
         if (f7_position % kCheckpoint1Interval == 0) {
             entry_y_bits.ToBytes(C1_entry_buf);
-            tmp2_disk.Write(final_file_writer_1, (C1_entry_buf), Util::ByteAlign(k) / 8);
+            write(C1_region, final_file_writer_1, (C1_entry_buf), Util::ByteAlign(k) / 8);
             final_file_writer_1 += Util::ByteAlign(k) / 8;
             if (num_C1_entries > 0) {
-                final_file_writer_2 = begin_byte_C3 + (num_C1_entries - 1) * size_C3;
-                size_t num_bytes =
-                    Encoding::ANSEncodeDeltas(deltas_to_write, kC3R, C3_entry_buf + 2) + 2;
-
-                // We need to be careful because deltas are variable sized, and they need to fit
-                assert(size_C3 * 8 > num_bytes);
-
-                // Write the size
-                Util::IntToTwoBytes(C3_entry_buf, num_bytes - 2);
-
-                tmp2_disk.Write(final_file_writer_2, (C3_entry_buf), num_bytes);
-                final_file_writer_2 += num_bytes;
+                add_C3_entry(num_C1_entries - 1, std::move(deltas_to_write));
             }
             prev_y = entry_y;
             if (f7_position % (kCheckpoint1Interval * kCheckpoint2Interval) == 0) {
                 C2.emplace_back(std::move(entry_y_bits));
             }
-            deltas_to_write.clear();
+            deltas_to_write = std::vector<uint8_t>();
             ++num_C1_entries;
         } else {
             deltas_to_write.push_back(entry_y - prev_y);
@@ -136,58 +181,47 @@ void RunPhase4(uint8_t k, uint8_t pos_size, FileDisk &tmp2_disk, Phase3Results &
             progress(4, f7_position, res.final_entries_written);
         }
     }
-    Encoding::ANSFree(kC3R);
+    table7_entries.reset();
     res.table7_sm.reset();
 
     // Writes the final park to disk
-    memset(P7_entry_buf, 0, P7_park_size);
-    to_write_p7.ToBytes(P7_entry_buf);
-
-    tmp2_disk.Write(final_file_writer_3, (P7_entry_buf), P7_park_size);
-    final_file_writer_3 += P7_park_size;
+    add_P7_park(park_index, std::move(park_positions));
 
     if (!deltas_to_write.empty()) {
-        size_t num_bytes = Encoding::ANSEncodeDeltas(deltas_to_write, kC3R, C3_entry_buf + 2);
-        memset(C3_entry_buf + num_bytes + 2, 0, size_C3 - (num_bytes + 2));
-        final_file_writer_2 = begin_byte_C3 + (num_C1_entries - 1) * size_C3;
-
-        // Write the size
-        Util::IntToTwoBytes(C3_entry_buf, num_bytes);
-
-        tmp2_disk.Write(final_file_writer_2, (C3_entry_buf), size_C3);
-        final_file_writer_2 += size_C3;
-        Encoding::ANSFree(kC3R);
+        add_C3_entry(num_C1_entries - 1, std::move(deltas_to_write));
     }
+    encoders.Wait();
+    Encoding::ANSFree(kC3R);
 
     Bits(0, Util::ByteAlign(k)).ToBytes(C1_entry_buf);
-    tmp2_disk.Write(final_file_writer_1, (C1_entry_buf), Util::ByteAlign(k) / 8);
+    write(C1_region, final_file_writer_1, (C1_entry_buf), Util::ByteAlign(k) / 8);
     final_file_writer_1 += Util::ByteAlign(k) / 8;
     std::cout << "\tFinished writing C1 and C3 tables" << std::endl;
     std::cout << "\tWriting C2 table" << std::endl;
 
     for (Bits &C2_entry : C2) {
         C2_entry.ToBytes(C1_entry_buf);
-        tmp2_disk.Write(final_file_writer_1, (C1_entry_buf), Util::ByteAlign(k) / 8);
+        write(C1_region, final_file_writer_1, (C1_entry_buf), Util::ByteAlign(k) / 8);
         final_file_writer_1 += Util::ByteAlign(k) / 8;
     }
     Bits(0, Util::ByteAlign(k)).ToBytes(C1_entry_buf);
-    tmp2_disk.Write(final_file_writer_1, (C1_entry_buf), Util::ByteAlign(k) / 8);
+    write(C1_region, final_file_writer_1, (C1_entry_buf), Util::ByteAlign(k) / 8);
     final_file_writer_1 += Util::ByteAlign(k) / 8;
     std::cout << "\tFinished writing C2 table" << std::endl;
 
-    delete[] C3_entry_buf;
     delete[] C1_entry_buf;
-    delete[] P7_entry_buf;
 
     final_file_writer_1 = res.header_size - 8 * 3;
+    size_t const pointers_region = final_file.AddRegion(final_file_writer_1);
     uint8_t table_pointer_bytes[8];
 
     // Writes the pointers to the start of the tables, for proving
     for (int i = 8; i <= 10; i++) {
         Util::IntToEightBytes(table_pointer_bytes, res.final_table_begin_pointers[i]);
-        tmp2_disk.Write(final_file_writer_1, table_pointer_bytes, 8);
+        final_file.Write(pointers_region, final_file_writer_1, table_pointer_bytes, 8);
         final_file_writer_1 += 8;
     }
+    final_file.Flush();
 
     std::cout << "\tFinal table pointers:" << std::endl << std::hex;
 
@@ -22,6 +22,18 @@
 enum phase_flags : uint8_t {
     ENABLE_BITFIELD = 1 << 0,
     SHOW_PROGRESS = 1 << 1,
+    // Temp files bypass the page cache
+    DIRECT_IO = 1 << 2,
+    // Phase 1 threads claim the next stripe as they go, rather than every
+    // num_threads'th stripe
+    DYNAMIC_STRIPES = 1 << 3,
+    // Temp files are kept in memory. Only the final plot file is written
+    IN_MEMORY = 1 << 4,
+    // Sort buckets only store the bits of each entry that are used, packed
+    // back to back, instead of whole bytes per entry
+    PACKED_TEMP = 1 << 5,
+    // Sort bucket files are compressed a block at a time. Implies PACKED_TEMP
+    COMPRESSED_TEMP = 1 << 6,
 };
 
 #endif  // SRC_CPP_PHASES_HPP
@@ -0,0 +1,215 @@
+// Copyright 2018 Chia Network Inc
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//    http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SRC_CPP_PLOT_SCHEDULER_HPP_
+#define SRC_CPP_PLOT_SCHEDULER_HPP_
+
+#include <algorithm>
+#include <condition_variable>
+#include <exception>
+#include <future>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "exceptions.hpp"
+#include "phases.hpp"
+#include "plotter_disk.hpp"
+#include "thread_pool.hpp"
+
+// The arguments of one DiskPlotter::CreatePlotDisk() call
+struct PlotJob {
+    std::string tmp_dirname;
+    std::string tmp2_dirname;
+    std::string final_dirname;
+    std::string filename;
+    uint8_t k = 0;
+    std::vector<uint8_t> memo;
+    std::vector<uint8_t> id;
+    uint32_t buf_megabytes = 0;
+    uint32_t num_buckets = 0;
+    uint64_t stripe_size = 0;
+    uint8_t phases_flags = ENABLE_BITFIELD;
+    uint32_t bucket_ram_megabytes = 0;
+    uint32_t copy_megabytes_per_second = 0;
+};
+
+// Creates a queue of plots, overlapping consecutive ones. Phases 1 and 2 keep
+// all the threads busy, while phases 3 and 4 mostly wait for the disk, so the
+// next plot is started as soon as the last one enters phase 3. The threads are
+// shared rather than doubled: a plot that's overlapped runs phases 3 and 4 on
+// a quarter of them, and the next plot runs phases 1 and 2 on the rest. At
+// most two plots run at once, and only if their memory fits in
+// memory_megabytes together. With a single thread, or for plots that keep
+// their temp files in memory, plots run one after the other.
+class PlotScheduler {
+public:
+    // 0 threads is the default CreatePlotDisk() picks
+    PlotScheduler(uint32_t const memory_megabytes, uint8_t const num_threads)
+        : memory_megabytes_(memory_megabytes), num_threads_(num_threads == 0 ? 2 : num_threads)
+    {
+    }
+
+    void Add(PlotJob job) { jobs_.push_back(std::move(job)); }
+
+    // The memory a job is charged for: its sort buffer, 0 being the default
+    // CreatePlotDisk() picks, and its bucket RAM. The temp files of in-memory
+    // plots aren't charged, which is why they never overlap, and neither are
+    // allocations outside of the buffer, like the bitfields of phase 2 and
+    // the chunk the final copy goes through.
+    static uint64_t JobMegabytes(PlotJob const &job)
+    {
+        return uint64_t(job.buf_megabytes == 0 ? 4608 : job.buf_megabytes) +
+               job.bucket_ram_megabytes;
+    }
+
+    // Whether next may start while prev is in phase 3 or 4
+    bool CanOverlap(PlotJob const &prev, PlotJob const &next) const
+    {
+        return num_threads_ >= 2 && !(prev.phases_flags & IN_MEMORY) &&
+               !(next.phases_flags & IN_MEMORY);
+    }
+
+    // Creates the plots added so far, and returns once they all have their
+    // final names. A plot that fails doesn't stop the others. The first
+    // error is rethrown once they're done.
+    void Run()
+    {
+        for (PlotJob const &job : jobs_) {
+            if (JobMegabytes(job) > memory_megabytes_) {
+                throw InsufficientMemoryException(
+                    "Plot " + job.filename + " needs " + std::to_string(JobMegabytes(job)) +
+                    "MiB, the scheduler only has " + std::to_string(memory_megabytes_) + "MiB");
+            }
+        }
+
+        std::vector<PlotJob> jobs = std::move(jobs_);
+        jobs_.clear();
+        // The threads of an overlapped plot's phases 3 and 4
+        uint8_t const late_threads = std::max(1, num_threads_ / 4);
+        // Per job, whether it reached phase 3, or stopped
+        std::vector<bool> overlappable(jobs.size(), false);
+        // Per job, whether it stopped and gave its memory back
+        std::vector<bool> done(jobs.size(), false);
+        uint64_t memory_used = 0;
+        std::exception_ptr error;
+        std::mutex m;
+        std::condition_variable cv;
+
+        std::vector<std::future<void>> plots;
+        std::exception_ptr start_error;
+        try {
+            for (size_t i = 0; i < jobs.size(); i++) {
+                PlotJob const &job = jobs[i];
+                bool const after = i > 0 && CanOverlap(jobs[i - 1], job);
+                bool const before = i + 1 < jobs.size() && CanOverlap(job, jobs[i + 1]);
+                {
+                    std::unique_lock<std::mutex> l(m);
+                    cv.wait(l, [&]() {
+                        return (i < 2 || done[i - 2]) &&
+                               (i == 0 || done[i - 1] || (after && overlappable[i - 1])) &&
+                               memory_used + JobMegabytes(job) <= memory_megabytes_;
+                    });
+                    memory_used += JobMegabytes(job);
+                }
+                // The previous plot's phases 3 and 4 may run next to this
+                // plot's phases 1 and 2, or its own phases 3 and 4
+                uint8_t const threads = after ? num_threads_ - late_threads : num_threads_;
+                uint8_t const threads_3_4 =
+                    before ? late_threads : (after ? num_threads_ - late_threads : 0);
+                std::cout << "Starting plot " << i + 1 << "/" << jobs.size() << ": "
+                          << job.filename << std::endl;
+
+                plots.push_back(ThreadPool::Global().Submit([&, i, threads, threads_3_4]() {
+                    PlotJob const &job = jobs[i];
+                    DiskPlotter plotter;
+                    plotter.SetLatePhaseThreads(threads_3_4);
+                    plotter.SetPhaseCallback([&, i](uint8_t const phase) {
+                        if (phase == 3) {
+                            std::lock_guard<std::mutex> l(m);
+                            overlappable[i] = true;
+                            cv.notify_all();
+                        }
+                    });
+                    std::exception_ptr plot_error;
+                    try {
+                        // The copy to the final directory doesn't need the
+                        // memory, so it's done in the background
+                        plotter.CreatePlotDisk(
+                            job.tmp_dirname,
+                            job.tmp2_dirname,
+                            job.final_dirname,
+                            job.filename,
+                            job.k,
+                            job.memo.data(),
+                            job.memo.size(),
+                            job.id.data(),
+                            job.id.size(),
+                            job.buf_megabytes,
+                            job.num_buckets,
+                            job.stripe_size,
+                            threads,
+                            job.phases_flags,
+                            job.bucket_ram_megabytes,
+                            job.copy_megabytes_per_second,
+                            true);
+                    } catch (...) {
+                        plot_error = std::current_exception();
+                    }
+                    {
+                        std::lock_guard<std::mutex> l(m);
+                        memory_used -= JobMegabytes(job);
+                        overlappable[i] = true;
+                        done[i] = true;
+                        cv.notify_all();
+                    }
+                    try {
+                        plotter.WaitForCopies();
+                    } catch (...) {
+                        if (!plot_error) {
+                            plot_error = std::current_exception();
+                        }
+                    }
+                    if (plot_error) {
+                        std::lock_guard<std::mutex> l(m);
+                        if (!error) {
+                            error = plot_error;
+                        }
+                    }
+                }));
+            }
+        } catch (...) {
+            start_error = std::current_exception();
+        }
+        // The plots that were started use the state above, so they have to
+        // be done before it goes out of scope, even if starting one failed
+        for (auto &p : plots) {
+            p.wait();
+        }
+        if (start_error) {
+            std::rethrow_exception(start_error);
+        }
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+private:
+    uint64_t const memory_megabytes_;
+    uint8_t const num_threads_;
+    std::vector<PlotJob> jobs_;
+};
+
+#endif  // SRC_CPP_PLOT_SCHEDULER_HPP_
@@ -26,6 +26,7 @@
 
 #include <algorithm>
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <map>
 #include <string>
@@ -37,6 +38,7 @@
 #include "calculate_bucket.hpp"
 #include "encoding.hpp"
 #include "exceptions.hpp"
+#include "final_copy.hpp"
 #include "phases.hpp"
 #include "phase1.hpp"
 #include "phase2.hpp"
@@ -56,7 +58,10 @@ public:
     // This method creates a plot on disk with the filename. Many temporary files
     // (filename + ".table1.tmp", filename + ".p2.t3.sort_bucket_4.tmp", etc.) are created
     // and their total size will be larger than the final plot file. Temp files are deleted at the
-    // end of the process.
+    // end of the process. If the final directory is a different one than tmp2, the plot is copied
+    // there, at most copy_megabytes_per_second MiB/s if that's not 0. With background_copy, this
+    // returns once the plot is being moved on a thread of its own, and WaitForCopies() waits for
+    // it. Destroying the DiskPlotter waits for copies in progress, but stops retrying failed ones.
     void CreatePlotDisk(
         std::string tmp_dirname,
         std::string tmp2_dirname,
@@ -71,7 +76,10 @@ public:
         uint32_t num_buckets_input = 0,
         uint64_t stripe_size_input = 0,
         uint8_t num_threads_input = 0,
-        uint8_t phases_flags = ENABLE_BITFIELD)
+        uint8_t phases_flags = ENABLE_BITFIELD,
+        uint32_t bucket_ram_megabytes = 0,
+        uint32_t copy_megabytes_per_second = 0,
+        bool background_copy = false)
     {
         // Increases the open file limit, we will open a lot of files.
 #ifndef _WIN32
@@ -165,7 +173,23 @@ public:
         std::cout << "Final Directory is: " << final_dirname << std::endl;
         std::cout << "Using " << (int)num_threads << " threads of stripe size " << stripe_size
                   << std::endl;
+        if (late_phase_threads_ != 0 && late_phase_threads_ != num_threads) {
+            std::cout << "Phases 3 and 4 use " << (int)late_phase_threads_ << " threads"
+                      << std::endl;
+        }
         std::cout << "Process ID is: " << ::getpid() << std::endl;
+        if (phases_flags & IN_MEMORY) {
+            std::cout << "Temp files are kept in memory" << std::endl;
+        } else if (bucket_ram_megabytes > 0) {
+            std::cout << "Keeping up to " << bucket_ram_megabytes
+                      << "MiB of sort buckets in memory" << std::endl;
+        }
+        if (phases_flags & PACKED_TEMP) {
+            std::cout << "Sort buckets are bit-packed" << std::endl;
+        }
+        if (phases_flags & COMPRESSED_TEMP) {
+            std::cout << "Sort buckets are compressed" << std::endl;
+        }
 
         // Cross platform way to concatenate paths, gulrak library.
         std::vector<fs::path> tmp_1_filenames = std::vector<fs::path>();
@@ -204,21 +228,25 @@ public:
 
         {
             // Scope for FileDisk
+            // Shared by the sort buckets of all phases, they spill to disk once it's used up
+            MemoryBudget bucket_memory(uint64_t(bucket_ram_megabytes) * 1024 * 1024);
+            MemoryBudget* const bucket_budget = bucket_ram_megabytes > 0 ? &bucket_memory : nullptr;
             std::vector<FileDisk> tmp_1_disks;
             for (auto const& fname : tmp_1_filenames)
-                tmp_1_disks.emplace_back(fname);
+                tmp_1_disks.emplace_back(fname, TempFileMode(phases_flags));
 
             FileDisk tmp2_disk(tmp_2_filename);
 
             assert(id_len == kIdLen);
 
+            PhaseStarted(1);
             std::cout << std::endl
                       << "Starting phase 1/4: Forward Propagation into tmp files... "
                       << Timer::GetNow();
 
             Timer p1;
             Timer all_phases;
-            std::vector<uint64_t> table_sizes = RunPhase1(
+            Phase1Results res1 = RunPhase1(
                 tmp_1_disks,
                 k,
                 id,
@@ -229,8 +257,10 @@ public:
                 log_num_buckets,
                 stripe_size,
                 num_threads,
-                phases_flags);
+                phases_flags,
+                bucket_budget);
             p1.PrintElapsed("Time for phase 1 =");
+            std::vector<uint64_t> const& table_sizes = res1.table_sizes;
 
             uint64_t finalsize=0;
 
@@ -239,6 +269,7 @@ public:
                 // Memory to be used for sorting and buffers
                 std::unique_ptr<uint8_t[]> memory(new uint8_t[memory_size + 7]);
 
+                PhaseStarted(2);
                 std::cout << std::endl
                       << "Starting phase 2/4: Backpropagation without bitfield into tmp files... "
                       << Timer::GetNow();
@@ -261,6 +292,7 @@ public:
                 // Now we open a new file, where the final contents of the plot will be stored.
                 uint32_t header_size = WriteHeader(tmp2_disk, k, id, memo, memo_len);
 
+                PhaseStarted(3);
                 std::cout << std::endl
                       << "Starting phase 3/4: Compression without bitfield from tmp files into " << tmp_2_filename
                       << " ... " << Timer::GetNow();
@@ -281,6 +313,7 @@ public:
                     phases_flags);
                 p3.PrintElapsed("Time for phase 3 =");
 
+                PhaseStarted(4);
                 std::cout << std::endl
                       << "Starting phase 4/4: Write Checkpoint tables into " << tmp_2_filename
                       << " ... " << Timer::GetNow();
@@ -290,6 +323,7 @@ public:
                 finalsize = res.final_table_begin_pointers[11];
             }
             else {
+                PhaseStarted(2);
                 std::cout << std::endl
                       << "Starting phase 2/4: Backpropagation into tmp files... "
                       << Timer::GetNow();
@@ -305,15 +339,21 @@ public:
                     memory_size,
                     num_buckets,
                     log_num_buckets,
-                    phases_flags);
+                    num_threads,
+                    phases_flags,
+                    bucket_budget,
+                    std::move(res1.table6_used));
                 p2.PrintElapsed("Time for phase 2 =");
 
                 // Now we open a new file, where the final contents of the plot will be stored.
                 uint32_t header_size = WriteHeader(tmp2_disk, k, id, memo, memo_len);
 
+                PhaseStarted(3);
                 std::cout << std::endl
                       << "Starting phase 3/4: Compression from tmp files into " << tmp_2_filename
                       << " ... " << Timer::GetNow();
+                uint8_t const late_threads =
+                    late_phase_threads_ != 0 ? late_phase_threads_ : num_threads;
                 Timer p3;
                 Phase3Results res = RunPhase3(
                     k,
@@ -326,14 +366,17 @@ public:
                     memory_size,
                     num_buckets,
                     log_num_buckets,
-                    phases_flags);
+                    late_threads,
+                    phases_flags,
+                    bucket_budget);
                 p3.PrintElapsed("Time for phase 3 =");
 
+                PhaseStarted(4);
                 std::cout << std::endl
                       << "Starting phase 4/4: Write Checkpoint tables into " << tmp_2_filename
                       << " ... " << Timer::GetNow();
                 Timer p4;
-                RunPhase4(k, k + 1, tmp2_disk, res, phases_flags, 16);
+                RunPhase4(k, k + 1, tmp2_disk, res, phases_flags, 16, late_threads);
                 p4.PrintElapsed("Time for phase 4 =");
                 finalsize = res.final_table_begin_pointers[11];
             }
@@ -365,66 +408,83 @@ public:
             fs::remove(p);
         }
 
-        bool bCopied = false;
-        bool bRenamed = false;
-        Timer copy;
-        do {
-            std::error_code ec;
-            if (tmp_2_filename.parent_path() == final_filename.parent_path()) {
-                fs::rename(tmp_2_filename, final_filename, ec);
-                if (ec.value() != 0) {
-                    std::cout << "Could not rename " << tmp_2_filename << " to " << final_filename
-                              << ". Error " << ec.message() << ". Retrying in five minutes."
-                              << std::endl;
-                } else {
-                    bRenamed = true;
-                    std::cout << "Renamed final file from " << tmp_2_filename << " to "
-                              << final_filename << std::endl;
-                }
-            } else {
-                if (!bCopied) {
-                    fs::copy(
-                        tmp_2_filename, final_2_filename, fs::copy_options::overwrite_existing, ec);
-                    if (ec.value() != 0) {
-                        std::cout << "Could not copy " << tmp_2_filename << " to "
-                                  << final_2_filename << ". Error " << ec.message()
-                                  << ". Retrying in five minutes." << std::endl;
-                    } else {
-                        std::cout << "Copied final file from " << tmp_2_filename << " to "
-                                  << final_2_filename << std::endl;
-                        copy.PrintElapsed("Copy time =");
-                        bCopied = true;
-
-                        bool removed_2 = fs::remove(tmp_2_filename);
-                        std::cout << "Removed temp2 file " << tmp_2_filename << "? " << removed_2
-                                  << std::endl;
-                    }
-                }
-                if (bCopied && (!bRenamed)) {
-                    fs::rename(final_2_filename, final_filename, ec);
-                    if (ec.value() != 0) {
-                        std::cout << "Could not rename " << tmp_2_filename << " to "
-                                  << final_filename << ". Error " << ec.message()
-                                  << ". Retrying in five minutes." << std::endl;
-                    } else {
-                        std::cout << "Renamed final file from " << final_2_filename << " to "
-                                  << final_filename << std::endl;
-                        bRenamed = true;
-                    }
+        uint64_t const copy_bytes_per_second = uint64_t(copy_megabytes_per_second) * 1024 * 1024;
+        if (background_copy) {
+            // Plots that were copied in the meantime no longer need to be
+            // kept track of
+            finalizers_.erase(
+                std::remove_if(
+                    finalizers_.begin(),
+                    finalizers_.end(),
+                    [](std::unique_ptr<PlotFinalizer> const &f) { return f->Done(); }),
+                finalizers_.end());
+            std::cout << "Moving " << tmp_2_filename << " to " << final_filename
+                      << " in the background" << std::endl;
+            finalizers_.push_back(std::make_unique<PlotFinalizer>(
+                tmp_2_filename, final_2_filename, final_filename, copy_bytes_per_second));
+        } else {
+            FinalizePlot(tmp_2_filename, final_2_filename, final_filename, copy_bytes_per_second);
+        }
+    }
+
+    // The number of plots still being moved to their final directory in the
+    // background
+    size_t PendingCopies() const
+    {
+        return std::count_if(
+            finalizers_.begin(),
+            finalizers_.end(),
+            [](std::unique_ptr<PlotFinalizer> const &f) { return !f->Done(); });
+    }
+
+    // Waits until all plots moved in the background have their final names.
+    // Rethrows the first error, if a copy failed, once the others are done.
+    void WaitForCopies()
+    {
+        std::vector<std::unique_ptr<PlotFinalizer>> finalizers = std::move(finalizers_);
+        finalizers_.clear();
+        std::exception_ptr error;
+        // Destroying a finalizer cancels its copy, so none of them may go
+        // before they're all done
+        for (auto &f : finalizers) {
+            try {
+                f->Wait();
+            } catch (...) {
+                if (!error) {
+                    error = std::current_exception();
                 }
             }
+        }
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
 
-            if (!bRenamed) {
-#ifdef _WIN32
-                Sleep(5 * 60000);
-#else
-                sleep(5 * 60);
-#endif
-            }
-        } while (!bRenamed);
+    // Sets a function that's called with the phase number (1 to 4) whenever
+    // CreatePlotDisk() starts a phase. It's called on the plotting thread.
+    void SetPhaseCallback(std::function<void(uint8_t)> phase_callback)
+    {
+        phase_callback_ = std::move(phase_callback);
     }
 
+    // Sets how many threads phases 3 and 4 use. 0, the default, uses the
+    // num_threads CreatePlotDisk() is called with, like phases 1 and 2.
+    void SetLatePhaseThreads(uint8_t const num_threads) { late_phase_threads_ = num_threads; }
+
 private:
+    void PhaseStarted(uint8_t const phase)
+    {
+        if (phase_callback_) {
+            phase_callback_(phase);
+        }
+    }
+
+    std::function<void(uint8_t)> phase_callback_;
+    uint8_t late_phase_threads_ = 0;
+
+    // Plots being moved to their final directory in the background
+    std::vector<std::unique_ptr<PlotFinalizer>> finalizers_;
+
     // Writes the plot file header to a file
     uint32_t WriteHeader(
         FileDisk& plot_Disk,
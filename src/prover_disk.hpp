@@ -33,6 +33,7 @@
 #include "calculate_bucket.hpp"
 #include "encoding.hpp"
 #include "entry_sizes.hpp"
+#include "thread_pool.hpp"
 #include "util.hpp"
 
 struct plot_header {
@@ -649,10 +650,19 @@ private:
             ret.emplace_back(xy.first, k);   // x
             return ret;
         } else {
-            auto left_fut=std::async(std::launch::async, &DiskProver::GetInputs,this, (uint64_t)xy.second, (uint8_t)(depth - 1));
-            auto right_fut=std::async(std::launch::async, &DiskProver::GetInputs,this, (uint64_t)xy.first, (uint8_t)(depth - 1));
+            // The right half is read on this thread instead of waiting for
+            // it, which halves the pool threads a proof keeps blocked
+            auto left_fut = ThreadPool::Global().Submit(
+                [this, xy, depth]() { return GetInputs(xy.second, depth - 1); });
+            std::vector<Bits> right;  // x
+            try {
+                right = GetInputs(xy.first, depth - 1);
+            } catch (...) {
+                // the task uses this prover
+                left_fut.wait();
+                throw;
+            }
             std::vector<Bits> left = left_fut.get();  // y
-            std::vector<Bits> right = right_fut.get();  // x
             left.insert(left.end(), right.begin(), right.end());
             return left;
         }
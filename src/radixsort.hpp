@@ -0,0 +1,262 @@
+// Copyright 2018 Chia Network Inc
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//    http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SRC_CPP_RADIXSORT_HPP_
+#define SRC_CPP_RADIXSORT_HPP_
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "quicksort.hpp"
+#include "thread_pool.hpp"
+#include "util.hpp"
+
+// In-place MSD radix sort of fixed size entries, using 8 bit digits starting
+// at bits_begin. Sorts by the same key as QuickSort::Sort(). The top level
+// partitions are made on the calling thread, until the ranges are small enough
+// to be sorted independently, and those are then spread over num_threads
+// threads.
+namespace RadixSort {
+
+    // Ranges smaller than this are sorted by QuickSort
+    const uint64_t kSmallRange = 64;
+
+    // The 8 bits starting at bit, big endian. Bits past the end of the entry
+    // are 0
+    inline uint32_t Digit(const uint8_t *entry, uint32_t const entry_len, uint32_t const bit)
+    {
+        uint32_t const byte = bit / 8;
+        uint32_t window = (uint32_t)entry[byte] << 8;
+        if (byte + 1 < entry_len) {
+            window |= entry[byte + 1];
+        }
+        return (window >> (8 - bit % 8)) & 0xff;
+    }
+
+    // Partitions [begin, end) in place by the digit at bit (American flag
+    // sort). starts[d] is set to the first entry with digit d, and starts[256]
+    // to end. swap_space holds 2 entries.
+    inline void Partition(
+        uint8_t *memory,
+        uint32_t const L,
+        uint64_t const begin,
+        uint64_t const end,
+        uint32_t const bit,
+        uint64_t *starts,
+        uint8_t *swap_space)
+    {
+        uint64_t counts[256] = {0};
+        for (uint64_t i = begin; i < end; i++) {
+            counts[Digit(memory + i * L, L, bit)]++;
+        }
+        uint64_t next[256];
+        starts[0] = begin;
+        for (uint32_t d = 0; d < 256; d++) {
+            next[d] = starts[d];
+            starts[d + 1] = starts[d] + counts[d];
+        }
+        // All entries have the same digit, nothing to move
+        if (counts[Digit(memory + begin * L, L, bit)] == end - begin) {
+            return;
+        }
+
+        uint8_t *carry = swap_space;
+        uint8_t *evicted = swap_space + L;
+        for (uint32_t b = 0; b < 256; b++) {
+            while (next[b] < starts[b + 1]) {
+                uint8_t *entry = memory + next[b] * L;
+                uint32_t d = Digit(entry, L, bit);
+                if (d != b) {
+                    // Follow the cycle of displaced entries until one that
+                    // belongs here comes back
+                    memcpy(carry, entry, L);
+                    do {
+                        uint8_t *dest = memory + next[d]++ * L;
+                        uint32_t const dest_digit = Digit(dest, L, bit);
+                        memcpy(evicted, dest, L);
+                        memcpy(dest, carry, L);
+                        std::swap(carry, evicted);
+                        d = dest_digit;
+                    } while (d != b);
+                    memcpy(entry, carry, L);
+                }
+                next[b]++;
+            }
+        }
+    }
+
+    inline void SortRange(
+        uint8_t *memory,
+        uint32_t const L,
+        uint64_t const begin,
+        uint64_t const end,
+        uint32_t const bit,
+        uint8_t *swap_space)
+    {
+        if (bit >= L * 8) {
+            return;
+        }
+        if (end - begin < kSmallRange) {
+            QuickSort::Sort(memory + begin * L, L, end - begin, bit);
+            return;
+        }
+        uint64_t starts[257];
+        Partition(memory, L, begin, end, bit, starts, swap_space);
+        for (uint32_t d = 0; d < 256; d++) {
+            if (starts[d + 1] - starts[d] > 1) {
+                SortRange(memory, L, starts[d], starts[d + 1], bit + 8, swap_space);
+            }
+        }
+    }
+
+    inline void Sort(
+        uint8_t *const memory,
+        uint32_t const entry_len,
+        uint64_t const num_entries,
+        uint32_t const bits_begin,
+        uint32_t const num_threads = 1)
+    {
+        auto const swap_space = std::make_unique<uint8_t[]>(2 * entry_len);
+        if (num_threads <= 1) {
+            SortRange(memory, entry_len, 0, num_entries, bits_begin, swap_space.get());
+            return;
+        }
+
+        struct range_t {
+            uint64_t begin;
+            uint64_t end;
+            uint32_t bit;
+            uint64_t size() const { return end - begin; }
+        };
+
+        // Keep splitting the largest range until every range is a small part of
+        // the whole, so the threads get evenly sized work even if the data is
+        // skewed
+        uint64_t const target_size = std::max(num_entries / (4 * num_threads), kSmallRange);
+        std::vector<range_t> ranges{{0, num_entries, bits_begin}};
+        while (!ranges.empty()) {
+            auto const largest = std::max_element(
+                ranges.begin(), ranges.end(), [](const range_t &a, const range_t &b) {
+                    return a.size() < b.size();
+                });
+            range_t const r = *largest;
+            if (r.size() <= target_size || r.bit >= entry_len * 8) {
+                break;
+            }
+            ranges.erase(largest);
+            uint64_t starts[257];
+            Partition(memory, entry_len, r.begin, r.end, r.bit, starts, swap_space.get());
+            for (uint32_t d = 0; d < 256; d++) {
+                if (starts[d + 1] - starts[d] > 1) {
+                    ranges.push_back({starts[d], starts[d + 1], r.bit + 8});
+                }
+            }
+        }
+        std::sort(ranges.begin(), ranges.end(), [](const range_t &a, const range_t &b) {
+            return a.size() > b.size();
+        });
+
+        std::atomic<uint64_t> next_range{0};
+        auto worker = [&]() {
+            auto const thread_swap_space = std::make_unique<uint8_t[]>(2 * entry_len);
+            for (uint64_t i = next_range++; i < ranges.size(); i = next_range++) {
+                SortRange(
+                    memory,
+                    entry_len,
+                    ranges[i].begin,
+                    ranges[i].end,
+                    ranges[i].bit,
+                    thread_swap_space.get());
+            }
+        };
+        ThreadPool::Global().RunConcurrently(num_threads, [&](uint32_t) { worker(); });
+    }
+
+    // Stable LSD radix sort of entries of exactly L bytes, one pass per key
+    // byte, from the last byte to the one holding bits_begin. Passes where all
+    // entries have the same byte are skipped. tmp must hold num_entries entries.
+    template <uint32_t L>
+    inline void SortLSD(
+        uint8_t *memory,
+        uint8_t *tmp,
+        uint64_t const num_entries,
+        uint32_t const bits_begin)
+    {
+        uint32_t const first_byte = bits_begin / 8;
+        // Bits before bits_begin in its byte aren't part of the key
+        uint8_t const first_mask = 0xff >> (bits_begin % 8);
+
+        // Count all the passes in one go
+        std::vector<uint64_t> counts((L - first_byte) * 256, 0);
+        for (uint64_t i = 0; i < num_entries; i++) {
+            const uint8_t *entry = memory + i * L;
+            counts[entry[first_byte] & first_mask]++;
+            for (uint32_t b = first_byte + 1; b < L; b++) {
+                counts[(b - first_byte) * 256 + entry[b]]++;
+            }
+        }
+
+        uint8_t *src = memory;
+        uint8_t *dst = tmp;
+        for (uint32_t b = L; b-- > first_byte;) {
+            uint64_t *count = counts.data() + (b - first_byte) * 256;
+            uint8_t const mask = b == first_byte ? first_mask : 0xff;
+            if (num_entries == 0 || count[src[b] & mask] == num_entries) {
+                continue;
+            }
+            uint64_t offset = 0;
+            for (uint32_t d = 0; d < 256; d++) {
+                uint64_t const c = count[d];
+                count[d] = offset;
+                offset += c;
+            }
+            for (uint64_t i = 0; i < num_entries; i++) {
+                const uint8_t *entry = src + i * L;
+                memcpy(dst + count[entry[b] & mask]++ * L, entry, L);
+            }
+            std::swap(src, dst);
+        }
+        if (src != memory) {
+            memcpy(memory, src, num_entries * L);
+        }
+    }
+
+    // SortLSD() for the entry sizes it's instantiated for (8 to 16 bytes).
+    // Returns false, without sorting, for other sizes.
+    inline bool SortLSD(
+        uint8_t *memory,
+        uint8_t *tmp,
+        uint32_t const entry_len,
+        uint64_t const num_entries,
+        uint32_t const bits_begin)
+    {
+        switch (entry_len) {
+            case 8: SortLSD<8>(memory, tmp, num_entries, bits_begin); return true;
+            case 9: SortLSD<9>(memory, tmp, num_entries, bits_begin); return true;
+            case 10: SortLSD<10>(memory, tmp, num_entries, bits_begin); return true;
+            case 11: SortLSD<11>(memory, tmp, num_entries, bits_begin); return true;
+            case 12: SortLSD<12>(memory, tmp, num_entries, bits_begin); return true;
+            case 13: SortLSD<13>(memory, tmp, num_entries, bits_begin); return true;
+            case 14: SortLSD<14>(memory, tmp, num_entries, bits_begin); return true;
+            case 15: SortLSD<15>(memory, tmp, num_entries, bits_begin); return true;
+            case 16: SortLSD<16>(memory, tmp, num_entries, bits_begin); return true;
+            default: return false;
+        }
+    }
+
+}
+
+#endif  // SRC_CPP_RADIXSORT_HPP_
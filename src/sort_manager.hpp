@@ -16,20 +16,28 @@
 #define SRC_CPP_FAST_SORT_ON_DISK_HPP_
 
 #include <algorithm>
+#include <atomic>
 #include <fstream>
+#include <future>
 #include <iostream>
+#include <mutex>
+#include <sstream>
 #include <string>
 #include <vector>
 
 #include "chia_filesystem.hpp"
 
+#include "./bitpack.hpp"
 #include "./bits.hpp"
+#include "./bucket_codec.hpp"
 #include "./calculate_bucket.hpp"
 #include "./disk.hpp"
 #include "./quicksort.hpp"
+#include "./radixsort.hpp"
 #include "./uniformsort.hpp"
 #include "disk.hpp"
 #include "exceptions.hpp"
+#include "thread_pool.hpp"
 
 enum class strategy_t : uint8_t
 {
@@ -40,8 +48,31 @@ enum class strategy_t : uint8_t
     // really poorly on data that isn't actually uniformly distributed. The last
     // buckets are often not uniformly distributed.
     quicksort_last,
+
+    // MSD radix sort on num_threads threads. Works for any key distribution
+    // and only needs as much memory as quicksort
+    parallel_radix,
+
+    // LSD radix sort, for entries of 8 to 16 bytes. Needs twice the memory of
+    // the bucket, and falls back to quicksort otherwise
+    radix,
 };
 
+// The amount of data each ConcurrentWriter stages per bucket before writing
+// it out to the bucket file
+constexpr uint64_t kConcurrentWriteBuffer = 16 * 1024;
+
+// Bit-packed buckets are a sequence of blocks, each one being the number of
+// entries in it, as a two byte integer, followed by the packed entries
+constexpr uint32_t kPackedBlockHeader = 2;
+static_assert(kConcurrentWriteBuffer <= 0xffff, "entry count must fit in the block header");
+// In compressed buckets, the entry count is followed by the size of the
+// compressed data, also as a two byte integer
+constexpr uint32_t kCompressedBlockHeader = 4;
+
+// Bit-packed and compressed buckets are read back this many bytes at a time
+constexpr uint64_t kPackedReadBuffer = 1024 * 1024;
+
 class SortManager : public Disk {
 public:
     SortManager(
@@ -53,7 +84,12 @@ public:
         const std::string &filename,
         uint32_t begin_bits,
         uint64_t const stripe_size,
-        strategy_t const sort_strategy = strategy_t::uniform)
+        strategy_t const sort_strategy = strategy_t::uniform,
+        uint32_t const num_threads = 1,
+        file_mode_t const file_mode = file_mode_t::buffered,
+        MemoryBudget* const bucket_memory = nullptr,
+        uint32_t const packed_bits = 0,
+        bool const compress = false)
         : memory_size_(memory_size)
         , entry_size_(entry_size)
         , begin_bits_(begin_bits)
@@ -63,7 +99,16 @@ public:
         // 7 bytes head-room for SliceInt64FromBytes()
         , entry_buf_(new uint8_t[entry_size + 7])
         , strategy_(sort_strategy)
+        , num_threads_(num_threads)
+        , packed_bits_(packed_bits < entry_size * 8u ? packed_bits : 0)
+        , compress_(compress)
     {
+        if (packed_bits > entry_size * 8u) {
+            throw InvalidValueException(
+                "Can't pack entries of " + std::to_string(entry_size) + " bytes into " +
+                std::to_string(packed_bits) + " bits");
+        }
+
         // Cross platform way to concatenate paths, gulrak library.
         std::vector<fs::path> bucket_filenames = std::vector<fs::path>();
 
@@ -78,7 +123,7 @@ public:
             fs::remove(bucket_filename);
 
             buckets_.emplace_back(
-                FileDisk(bucket_filename));
+                FileDisk(bucket_filename, file_mode, bucket_memory));
         }
     }
 
@@ -93,13 +138,154 @@ public:
         if (this->done) {
             throw InvalidValueException("Already finished.");
         }
+        if (BlockFormat()) {
+            // entries are packed a block at a time, so stage them the same way
+            // as concurrent writers do
+            if (!cache_writer_) {
+                cache_writer_ = std::make_unique<ConcurrentWriter>(*this);
+            }
+            cache_writer_->Add(entry);
+            return;
+        }
         uint64_t const bucket_index =
             Util::ExtractNum(entry, entry_size_, begin_bits_, log_num_buckets_);
         bucket_t& b = buckets_[bucket_index];
-        b.file.Write(b.write_pointer, entry, entry_size_);
-        b.write_pointer += entry_size_;
+        uint64_t const write_pointer = b.write_pointer.load(std::memory_order_relaxed);
+        b.file.Write(write_pointer, entry, entry_size_);
+        b.write_pointer.store(write_pointer + entry_size_, std::memory_order_relaxed);
     }
 
+    // Allows multiple threads to add entries to the same SortManager without
+    // serializing on a lock. Each thread uses its own writer, which stages
+    // entries per bucket. Once a bucket's staging buffer is full, the writer
+    // reserves space in the bucket file by atomically bumping the bucket's
+    // write pointer, and writes the whole block there. Only the file write
+    // itself is done under the bucket's lock, since FileDisk tracks its own
+    // seek position. The order of entries within a bucket doesn't matter, since
+    // every bucket is sorted before it's read.
+    //
+    // With packed_bits or compress, each block is bit-packed or compressed
+    // before it's written, and its place in the file is reserved by bumping
+    // the bucket's disk pointer instead.
+    //
+    // Writers must be flushed before the SortManager is flushed or read from.
+    // Don't call SortManager::AddToCache() while writers are in use.
+    class ConcurrentWriter {
+    public:
+        explicit ConcurrentWriter(SortManager& sort_manager)
+            : sort_manager_(sort_manager)
+            , entry_size_(sort_manager.entry_size_)
+            , bucket_capacity_(
+                  std::max<uint64_t>(kConcurrentWriteBuffer / entry_size_, 1) * entry_size_)
+            // 7 bytes head-room for BucketCodec::Encode()
+            , buffer_(new uint8_t[bucket_capacity_ * sort_manager.buckets_.size() + 7])
+            , fill_(sort_manager.buckets_.size(), 0)
+        {
+            if (sort_manager.compress_) {
+                codec_ = sort_manager.MakeCodec();
+                pack_buffer_.reset(new uint8_t
+                                       [kCompressedBlockHeader +
+                                        codec_->MaxSize(bucket_capacity_ / entry_size_)]);
+            } else if (sort_manager.packed_bits_) {
+                // 7 bytes head-room for BitPack::Pack()
+                pack_buffer_.reset(new uint8_t[kPackedBlockHeader + bucket_capacity_ + 7]);
+            }
+        }
+
+        ConcurrentWriter(ConcurrentWriter const&) = delete;
+        ConcurrentWriter& operator=(ConcurrentWriter const&) = delete;
+
+        void Add(const uint8_t* entry)
+        {
+            if (sort_manager_.done) {
+                throw InvalidValueException("Already finished.");
+            }
+            uint64_t const bucket_index = Util::ExtractNum(
+                entry, entry_size_, sort_manager_.begin_bits_, sort_manager_.log_num_buckets_);
+            memcpy(
+                buffer_.get() + bucket_index * bucket_capacity_ + fill_[bucket_index],
+                entry,
+                entry_size_);
+            fill_[bucket_index] += entry_size_;
+            if (fill_[bucket_index] == bucket_capacity_) {
+                FlushBucket(bucket_index);
+            }
+        }
+
+        void Flush()
+        {
+            for (size_t bucket_i = 0; bucket_i < fill_.size(); bucket_i++) {
+                FlushBucket(bucket_i);
+            }
+        }
+
+        // Flush() has to be called before the writer is destroyed, so write
+        // errors reach the caller. Flushing here is only a best effort, for
+        // writers abandoned by an exception.
+        ~ConcurrentWriter()
+        {
+            try {
+                Flush();
+            } catch (std::exception const& e) {
+                std::cout << "Could not flush a sort bucket writer: " << e.what() << std::endl;
+            }
+        }
+
+    private:
+        void FlushBucket(size_t const bucket_index)
+        {
+            uint64_t const size = fill_[bucket_index];
+            if (size == 0) {
+                return;
+            }
+            bucket_t& b = sort_manager_.buckets_[bucket_index];
+            uint8_t const* block = buffer_.get() + bucket_index * bucket_capacity_;
+            uint64_t const begin = b.write_pointer.fetch_add(size);
+            if (pack_buffer_) {
+                uint64_t const num_entries = size / entry_size_;
+                uint64_t packed_size;
+                Util::IntToTwoBytes(pack_buffer_.get(), num_entries);
+                if (codec_) {
+                    uint64_t const data_size = codec_->Encode(
+                        pack_buffer_.get() + kCompressedBlockHeader, block, num_entries);
+                    if (data_size > 0xffff) {
+                        throw InvalidStateException(
+                            "Compressed block too large: " + std::to_string(data_size));
+                    }
+                    Util::IntToTwoBytes(pack_buffer_.get() + kPackedBlockHeader, data_size);
+                    packed_size = kCompressedBlockHeader + data_size;
+                } else {
+                    uint32_t const bits = sort_manager_.packed_bits_;
+                    packed_size = kPackedBlockHeader + BitPack::PackedSize(num_entries, bits);
+                    BitPack::Pack(
+                        pack_buffer_.get() + kPackedBlockHeader,
+                        block,
+                        entry_size_,
+                        bits,
+                        num_entries);
+                }
+                uint64_t const disk_begin = b.disk_pointer.fetch_add(packed_size);
+                std::lock_guard<std::mutex> l(*b.mutex);
+                b.underlying_file.Write(disk_begin, pack_buffer_.get(), packed_size);
+            } else {
+                std::lock_guard<std::mutex> l(*b.mutex);
+                b.underlying_file.Write(begin, block, size);
+            }
+            fill_[bucket_index] = 0;
+        }
+
+        SortManager& sort_manager_;
+        uint16_t const entry_size_;
+        // Size of the staging buffer of each bucket, a whole number of entries
+        uint64_t const bucket_capacity_;
+        std::unique_ptr<uint8_t[]> buffer_;
+        std::vector<uint64_t> fill_;
+        // Where blocks are packed, if the buckets are bit-packed or
+        // compressed
+        std::unique_ptr<uint8_t[]> pack_buffer_;
+        std::unique_ptr<BucketCodec> codec_;
+    };
+
     uint8_t const* Read(uint64_t begin, uint64_t length) override
     {
         assert(length <= entry_size_);
@@ -130,6 +316,11 @@ public:
 
     void FreeMemory() override
     {
+        if (prefetch_.valid()) {
+            // rethrows any exception from the background sort. The bucket it
+            // sorted is still on disk, and is sorted again if it's read.
+            prefetch_.get();
+        }
         for (auto& b : buckets_) {
             b.file.FreeMemory();
             // the underlying file will be re-opened again on-demand
@@ -137,6 +328,7 @@ public:
         }
         prev_bucket_buf_.reset();
         memory_start_.reset();
+        next_memory_.reset();
         final_position_end = 0;
         // TODO: Ideally, bucket files should be deleted as we read them (in the
         // last reading pass over them)
@@ -204,6 +396,10 @@ public:
 
     void FlushCache()
     {
+        WaitForPrefetch();
+        if (cache_writer_) {
+            cache_writer_->Flush();
+        }
         for (auto& b : buckets_) {
             b.file.FlushCache();
         }
@@ -213,22 +409,140 @@ public:
 
     ~SortManager()
     {
+        WaitForPrefetch();
+        cache_writer_.reset();
         // Close and delete files in case we exit without doing the sort
         for (auto& b : buckets_) {
-            std::string const filename = b.file.GetFileName();
-            b.underlying_file.Close();
-            fs::remove(fs::path(filename));
+            b.underlying_file.Remove();
         }
     }
 
 private:
 
+    // Reads a bit-packed or compressed bucket back as full sized entries.
+    // Only reads of whole entries, in order from the start, are supported.
+    class BlockReader {
+    public:
+        BlockReader(SortManager& sort_manager, uint64_t const bucket_i)
+            : file_(sort_manager.buckets_[bucket_i].underlying_file)
+            , file_size_(sort_manager.buckets_[bucket_i].disk_pointer)
+            , bucket_i_(bucket_i)
+            , entry_size_(sort_manager.entry_size_)
+            , bits_(sort_manager.packed_bits_)
+            , codec_(sort_manager.compress_ ? sort_manager.MakeCodec() : nullptr)
+            // 7 bytes head-room for BitPack::Unpack() and BucketCodec::Decode()
+            , buffer_(new uint8_t[kPackedReadBuffer + 7]())
+        {
+        }
+
+        void Read(uint64_t const begin, uint8_t* memcache, uint64_t const length)
+        {
+            if (begin != read_pos_) {
+                throw InvalidStateException("Packed buckets can only be read sequentially");
+            }
+            read_pos_ += length;
+            uint64_t num_entries = length / entry_size_;
+            while (num_entries > 0) {
+                if (block_left_ == 0) {
+                    NextBlock();
+                }
+                uint64_t const n = std::min(num_entries, block_left_);
+                if (codec_) {
+                    memcpy(memcache, block_.data() + block_pos_, n * entry_size_);
+                    block_pos_ += n * entry_size_;
+                } else {
+                    BitPack::Unpack(memcache, buffer_.get(), bit_pos_, entry_size_, bits_, n);
+                    bit_pos_ += n * bits_;
+                }
+                memcache += n * entry_size_;
+                block_left_ -= n;
+                num_entries -= n;
+            }
+        }
+
+    private:
+        void NextBlock()
+        {
+            uint32_t const header_size = codec_ ? kCompressedBlockHeader : kPackedBlockHeader;
+            Fill(header_size);
+            block_left_ = Util::TwoBytesToInt(buffer_.get() + buffer_pos_);
+            uint64_t const block_size =
+                codec_ ? Util::TwoBytesToInt(buffer_.get() + buffer_pos_ + kPackedBlockHeader)
+                       : BitPack::PackedSize(block_left_, bits_);
+            buffer_pos_ += header_size;
+            Fill(block_size);
+            if (codec_) {
+                // the entries are decoded all at once
+                block_.resize(block_left_ * entry_size_);
+                codec_->Decode(block_.data(), buffer_.get() + buffer_pos_, block_left_, bucket_i_);
+                block_pos_ = 0;
+            } else {
+                bit_pos_ = buffer_pos_ * 8;
+            }
+            buffer_pos_ += block_size;
+        }
+
+        // Makes sure the buffer holds the next size bytes, from buffer_pos_ on
+        void Fill(uint64_t const size)
+        {
+            if (buffer_pos_ + size <= buffer_size_) {
+                return;
+            }
+            buffer_size_ -= buffer_pos_;
+            memmove(buffer_.get(), buffer_.get() + buffer_pos_, buffer_size_);
+            buffer_pos_ = 0;
+            uint64_t const n = std::min(kPackedReadBuffer - buffer_size_, file_size_ - file_pos_);
+            file_.Read(file_pos_, buffer_.get() + buffer_size_, n);
+            file_pos_ += n;
+            buffer_size_ += n;
+            if (size > buffer_size_) {
+                throw InvalidStateException("Packed bucket ends in the middle of a block");
+            }
+        }
+
+        FileDisk& file_;
+        uint64_t const file_size_;
+        uint64_t const bucket_i_;
+        uint32_t const entry_size_;
+        uint32_t const bits_;
+        std::unique_ptr<BucketCodec> codec_;
+        std::unique_ptr<uint8_t[]> buffer_;
+        uint64_t buffer_pos_ = 0;
+        uint64_t buffer_size_ = 0;
+        uint64_t file_pos_ = 0;
+        uint64_t read_pos_ = 0;
+        // Entries left in the current block, starting at bit bit_pos_ of
+        // buffer_, or, if it's compressed, at block_pos_ of block_
+        uint64_t block_left_ = 0;
+        uint64_t bit_pos_ = 0;
+        std::vector<uint8_t> block_;
+        uint64_t block_pos_ = 0;
+    };
+
     struct bucket_t
     {
-        bucket_t(FileDisk f) : underlying_file(std::move(f)), file(&underlying_file, 0) {}
+        explicit bucket_t(FileDisk f) : underlying_file(std::move(f)), file(&underlying_file, 0) {}
+
+        // file refers to underlying_file, so it has to be re-created rather
+        // than moved. Buckets are only moved before any data is written to them
+        bucket_t(bucket_t&& rhs) noexcept
+            : write_pointer(rhs.write_pointer.load())
+            , disk_pointer(rhs.disk_pointer.load())
+            , mutex(std::move(rhs.mutex))
+            , underlying_file(std::move(rhs.underlying_file))
+            , file(&underlying_file, 0)
+        {
+        }
 
-        // The amount of data written to the disk bucket
-        uint64_t write_pointer = 0;
+        // The amount of data written to the disk bucket. ConcurrentWriters
+        // reserve their ranges of the file by bumping this
+        std::atomic<uint64_t> write_pointer{0};
+
+        // The amount of data in the bucket file, when it's bit-packed
+        std::atomic<uint64_t> disk_pointer{0};
+
+        // Serializes ConcurrentWriter writes to underlying_file
+        std::unique_ptr<std::mutex> mutex = std::make_unique<std::mutex>();
 
         // The file for the bucket
         FileDisk underlying_file;
@@ -259,23 +573,160 @@ private:
     uint64_t next_bucket_to_sort = 0;
     std::unique_ptr<uint8_t[]> entry_buf_;
     strategy_t strategy_;
+    // Threads used by the parallel_radix strategy
+    uint32_t num_threads_;
+    // If non-zero, only the first packed_bits_ bits of each entry are stored,
+    // bit-packed, in the bucket files. The rest of the entry must be 0
+    uint32_t packed_bits_;
+    // Whether the bucket files are compressed by BucketCodec. That implies
+    // packing, if packed_bits_ is set
+    bool compress_;
+    // Stages AddToCache() entries when the buckets are bit-packed or
+    // compressed
+    std::unique_ptr<ConcurrentWriter> cache_writer_;
+
+    // Whether the buckets are written in blocks, rather than as plain entries
+    bool BlockFormat() const { return packed_bits_ || compress_; }
+
+    std::unique_ptr<BucketCodec> MakeCodec() const
+    {
+        return std::make_unique<BucketCodec>(
+            entry_size_,
+            packed_bits_ ? packed_bits_ : entry_size_ * 8,
+            begin_bits_,
+            log_num_buckets_);
+    }
 
-    void SortBucket()
+    // When every bucket fits in half of memory_size_, the memory is split into
+    // two buffers. While the consumer reads bucket i from one of them, bucket
+    // i + 1 is read from disk and sorted into the other on a background thread.
+    // Decided when the first bucket is sorted.
+    bool double_buffer_ = false;
+    // The buffer bucket next_bucket_to_sort is prefetched into
+    std::unique_ptr<uint8_t[]> next_memory_;
+    std::future<std::string> prefetch_;
+
+    bool ForceQuicksort(uint64_t const bucket_i) const
     {
-        if (!memory_start_) {
-            // we allocate the memory to sort the bucket in lazily. It'se freed
-            // in FreeMemory() or the destructor
-            memory_start_.reset(new uint8_t[memory_size_]);
+        bool const last_bucket = (bucket_i == buckets_.size() - 1)
+            || buckets_[bucket_i + 1].write_pointer == 0;
+
+        return (strategy_ == strategy_t::quicksort)
+            || (strategy_ == strategy_t::quicksort_last && last_bucket);
+    }
+
+    // Whether bucket_i would be sorted with uniform sort, given memory_size
+    // bytes to sort in
+    bool UseUniformSort(uint64_t const bucket_i, uint64_t const memory_size) const
+    {
+        uint64_t const bucket_entries = buckets_[bucket_i].write_pointer / entry_size_;
+
+        // Do SortInMemory algorithm if it fits in the memory
+        // (number of entries required * entry_size_) <= total memory available
+        return strategy_ != strategy_t::parallel_radix && strategy_ != strategy_t::radix &&
+            !ForceQuicksort(bucket_i) &&
+            Util::RoundSize(bucket_entries) * entry_size_ <= memory_size;
+    }
+
+    // Whether bucket_i would be sorted with LSD radix sort, given memory_size
+    // bytes to sort in
+    bool UseLSDRadixSort(uint64_t const bucket_i, uint64_t const memory_size) const
+    {
+        return strategy_ == strategy_t::radix && entry_size_ >= 8 && entry_size_ <= 16 &&
+            2 * buckets_[bucket_i].write_pointer <= memory_size;
+    }
+
+    // Double buffering must not change how any bucket is sorted, only where
+    bool CanDoubleBuffer() const
+    {
+        uint64_t const half = memory_size_ / 2;
+        for (uint64_t bucket_i = 0; bucket_i < buckets_.size(); bucket_i++) {
+            if (buckets_[bucket_i].write_pointer > half ||
+                UseUniformSort(bucket_i, half) != UseUniformSort(bucket_i, memory_size_) ||
+                UseLSDRadixSort(bucket_i, half) != UseLSDRadixSort(bucket_i, memory_size_)) {
+                return false;
+            }
         }
+        return true;
+    }
 
+    // The prefetched bucket stays available to SortBucket()
+    void WaitForPrefetch()
+    {
+        if (prefetch_.valid()) {
+            prefetch_.wait();
+        }
+    }
+
+    void SortBucket()
+    {
+        if (!this->done) {
+            double_buffer_ = CanDoubleBuffer();
+        }
         this->done = true;
         if (next_bucket_to_sort >= buckets_.size()) {
             throw InvalidValueException("Trying to sort bucket which does not exist.");
         }
         uint64_t const bucket_i = this->next_bucket_to_sort;
+        uint64_t const buffer_size = double_buffer_ ? memory_size_ / 2 : memory_size_;
+
+        if (prefetch_.valid()) {
+            // rethrows any exception from the background sort. The progress
+            // is printed here, rather than from the pool thread.
+            std::cout << prefetch_.get() << std::flush;
+            std::swap(memory_start_, next_memory_);
+        } else {
+            if (!memory_start_) {
+                // we allocate the memory to sort the bucket in lazily. It'se freed
+                // in FreeMemory() or the destructor
+                memory_start_.reset(new uint8_t[buffer_size]);
+            }
+            std::cout << SortBucketToMemory(bucket_i, memory_start_.get(), buffer_size)
+                      << std::flush;
+        }
+        // The bucket is only deleted once it's consumed, since a prefetched
+        // one may be dropped by FreeMemory()
+        buckets_[bucket_i].underlying_file.Remove();
+
+        this->final_position_start = this->final_position_end;
+        this->final_position_end += buckets_[bucket_i].write_pointer;
+        this->next_bucket_to_sort += 1;
+
+        if (double_buffer_ && next_bucket_to_sort < buckets_.size()) {
+            if (!next_memory_) {
+                next_memory_.reset(new uint8_t[buffer_size]);
+            }
+            uint8_t* const memory = next_memory_.get();
+            uint64_t const bucket = next_bucket_to_sort;
+            prefetch_ = ThreadPool::Global().Submit([this, bucket, memory, buffer_size]() {
+                return SortBucketToMemory(bucket, memory, buffer_size);
+            });
+        }
+    }
+
+    // Reads all of bucket_i's entries into memory, unsorted
+    void ReadBucket(uint64_t const bucket_i, uint8_t* memory)
+    {
+        bucket_t& b = buckets_[bucket_i];
+        if (BlockFormat()) {
+            BlockReader reader(*this, bucket_i);
+            reader.Read(0, memory, b.write_pointer);
+        } else {
+            b.underlying_file.Read(0, memory, b.write_pointer);
+        }
+    }
+
+    // Reads bucket_i from disk and sorts it into memory. Only touches the
+    // bucket itself, so it can run in the background. Returns the progress
+    // line for the caller to print.
+    std::string SortBucketToMemory(
+        uint64_t const bucket_i,
+        uint8_t* memory,
+        uint64_t const memory_size)
+    {
         bucket_t& b = buckets_[bucket_i];
         uint64_t const bucket_entries = b.write_pointer / entry_size_;
-        uint64_t const entries_fit_in_memory = this->memory_size_ / entry_size_;
+        uint64_t const entries_fit_in_memory = memory_size / entry_size_;
 
         double const have_ram = entry_size_ * entries_fit_in_memory / (1024.0 * 1024.0 * 1024.0);
         double const qs_ram = entry_size_ * bucket_entries / (1024.0 * 1024.0 * 1024.0);
@@ -288,23 +739,40 @@ private:
                 std::to_string(b.write_pointer / (1024.0 * 1024.0 * 1024.0)) +
                 "GiB");
         }
-        bool const last_bucket = (bucket_i == buckets_.size() - 1)
-            || buckets_[bucket_i + 1].write_pointer == 0;
-
-        bool const force_quicksort = (strategy_ == strategy_t::quicksort)
-            || (strategy_ == strategy_t::quicksort_last && last_bucket);
 
-        // Do SortInMemory algorithm if it fits in the memory
-        // (number of entries required * entry_size_) <= total memory available
-        if (!force_quicksort &&
-            Util::RoundSize(bucket_entries) * entry_size_ <= memory_size_) {
-            std::cout << "\tBucket " << bucket_i << " uniform sort. Ram: " << std::fixed
-                      << std::setprecision(3) << have_ram << "GiB, u_sort min: " << u_ram
-                      << "GiB, qs min: " << qs_ram << "GiB." << std::endl;
-            UniformSort::SortToMemory(
-                b.underlying_file,
-                0,
-                memory_start_.get(),
+        std::ostringstream progress;
+        if (UseUniformSort(bucket_i, memory_size)) {
+            progress << "\tBucket " << bucket_i << " uniform sort. Ram: " << std::fixed
+                     << std::setprecision(3) << have_ram << "GiB, u_sort min: " << u_ram
+                     << "GiB, qs min: " << qs_ram << "GiB.\n";
+            if (BlockFormat()) {
+                BlockReader reader(*this, bucket_i);
+                UniformSort::SortToMemory(
+                    reader, 0, memory, entry_size_, bucket_entries, begin_bits_ + log_num_buckets_);
+            } else {
+                UniformSort::SortToMemory(
+                    b.underlying_file,
+                    0,
+                    memory,
+                    entry_size_,
+                    bucket_entries,
+                    begin_bits_ + log_num_buckets_);
+            }
+        } else if (strategy_ == strategy_t::parallel_radix) {
+            progress << "\tBucket " << bucket_i << " radix sort, " << num_threads_
+                     << " threads. Ram: " << std::fixed << std::setprecision(3) << have_ram
+                     << "GiB, min: " << qs_ram << "GiB.\n";
+            ReadBucket(bucket_i, memory);
+            RadixSort::Sort(
+                memory, entry_size_, bucket_entries, begin_bits_ + log_num_buckets_, num_threads_);
+        } else if (UseLSDRadixSort(bucket_i, memory_size)) {
+            progress << "\tBucket " << bucket_i << " LSD radix sort. Ram: " << std::fixed
+                     << std::setprecision(3) << have_ram << "GiB, min: " << 2 * qs_ram
+                     << "GiB.\n";
+            ReadBucket(bucket_i, memory);
+            RadixSort::SortLSD(
+                memory,
+                memory + bucket_entries * entry_size_,
                 entry_size_,
                 bucket_entries,
                 begin_bits_ + log_num_buckets_);
@@ -312,22 +780,15 @@ private:
             // Are we in Compress phrase 1 (quicksort=1) or is it the last bucket (quicksort=2)?
             // Perform quicksort if so (SortInMemory algorithm won't always perform well), or if we
             // don't have enough memory for uniform sort
-            std::cout << "\tBucket " << bucket_i << " QS. Ram: " << std::fixed
-                      << std::setprecision(3) << have_ram << "GiB, u_sort min: " << u_ram
-                      << "GiB, qs min: " << qs_ram << "GiB. force_qs: " << force_quicksort
-                      << std::endl;
-            b.underlying_file.Read(0, memory_start_.get(), bucket_entries * entry_size_);
-            QuickSort::Sort(memory_start_.get(), entry_size_, bucket_entries, begin_bits_ + log_num_buckets_);
+            bool const force_quicksort = ForceQuicksort(bucket_i);
+            progress << "\tBucket " << bucket_i << " QS. Ram: " << std::fixed
+                     << std::setprecision(3) << have_ram << "GiB, u_sort min: " << u_ram
+                     << "GiB, qs min: " << qs_ram << "GiB. force_qs: " << force_quicksort << "\n";
+            ReadBucket(bucket_i, memory);
+            QuickSort::Sort(memory, entry_size_, bucket_entries, begin_bits_ + log_num_buckets_);
         }
 
-        // Deletes the bucket file
-        std::string filename = b.file.GetFileName();
-        b.underlying_file.Close();
-        fs::remove(fs::path(filename));
-
-        this->final_position_start = this->final_position_end;
-        this->final_position_end += b.write_pointer;
-        this->next_bucket_to_sort += 1;
+        return progress.str();
     }
 };
 
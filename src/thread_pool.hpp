@@ -0,0 +1,237 @@
+// Copyright 2018 Chia Network Inc
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//    http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SRC_CPP_THREAD_POOL_HPP_
+#define SRC_CPP_THREAD_POOL_HPP_
+
+#ifdef __linux__
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A pool of threads that are started once, and reused by every parallel part
+// of plotting and proving, rather than creating and joining threads for each
+// table. Tasks may wait for each other (phase 1's threads hand stripes to each
+// other in turns, for example), so a task never waits for a thread: if no
+// thread is idle, the pool grows by one. It never shrinks, so it ends up as
+// large as the most tasks that ever ran at once.
+class ThreadPool {
+public:
+    ThreadPool() = default;
+
+    ThreadPool(ThreadPool const &) = delete;
+    ThreadPool &operator=(ThreadPool const &) = delete;
+
+    // Waits for the tasks that are still queued or running, and stops the
+    // threads
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> l(m_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        for (auto &t : threads_) {
+            t.join();
+        }
+    }
+
+    // The pool shared by the whole process
+    static ThreadPool &Global()
+    {
+        static ThreadPool pool;
+        return pool;
+    }
+
+    uint32_t NumThreads()
+    {
+        std::lock_guard<std::mutex> l(m_);
+        return threads_.size();
+    }
+
+    // Pins each thread to a core of its own, the n'th thread to the n'th of
+    // the cores the process may run on, modulo their number. Applies to the
+    // threads started later, too. Only supported on Linux, it's ignored
+    // elsewhere.
+    void SetPinning(bool const pin)
+    {
+        std::lock_guard<std::mutex> l(m_);
+        pin_ = pin;
+#ifdef __linux__
+        cores_.clear();
+        if (pin_) {
+            cpu_set_t allowed;
+            CPU_ZERO(&allowed);
+            if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+                std::cout << "Could not get the CPU affinity, not pinning threads. Error "
+                          << ::strerror(errno) << std::endl;
+                pin_ = false;
+            }
+            for (int c = 0; pin_ && c < CPU_SETSIZE; c++) {
+                if (CPU_ISSET(c, &allowed)) {
+                    cores_.push_back(c);
+                }
+            }
+        }
+#endif
+        if (pin_) {
+            for (size_t i = 0; i < threads_.size(); i++) {
+                Pin(threads_[i], i);
+            }
+        }
+    }
+
+    // Runs task on a pool thread. The future holds its result, or exception.
+    template <typename Fn>
+    auto Submit(Fn task) -> std::future<decltype(task())>
+    {
+        // std::function needs to be copyable, std::packaged_task isn't
+        auto packaged =
+            std::make_shared<std::packaged_task<decltype(task())()>>(std::move(task));
+        std::future<decltype(task())> result = packaged->get_future();
+        Enqueue([packaged]() { (*packaged)(); });
+        return result;
+    }
+
+    // Runs fn(0) to fn(n - 1) at the same time, fn(0) on the calling thread,
+    // so they may wait for each other. Returns once they're all done. The
+    // first exception one of them throws is rethrown.
+    template <typename Fn>
+    void RunConcurrently(uint32_t const n, Fn fn)
+    {
+        std::vector<std::future<void>> others;
+        for (uint32_t i = 1; i < n; i++) {
+            others.push_back(Submit([&fn, i]() { fn(i); }));
+        }
+        std::exception_ptr error;
+        try {
+            if (n > 0) {
+                fn(0);
+            }
+        } catch (...) {
+            error = std::current_exception();
+        }
+        // All of them need to be done before fn goes out of scope, even if
+        // one failed
+        for (auto &f : others) {
+            try {
+                f.get();
+            } catch (...) {
+                if (!error) {
+                    error = std::current_exception();
+                }
+            }
+        }
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+    // Calls fn(begin, end) for consecutive ranges of at most chunk indexes,
+    // which together cover 0 to count, on up to num_threads threads
+    template <typename Fn>
+    void ParallelFor(uint64_t const count, uint64_t const chunk, uint32_t num_threads, Fn fn)
+    {
+        uint64_t const num_chunks = (count + chunk - 1) / chunk;
+        num_threads = std::max<uint32_t>(1, std::min<uint64_t>(num_threads, num_chunks));
+        std::atomic<uint64_t> next_chunk{0};
+        RunConcurrently(num_threads, [&](uint32_t) {
+            for (uint64_t c = next_chunk++; c < num_chunks; c = next_chunk++) {
+                fn(c * chunk, std::min(count, (c + 1) * chunk));
+            }
+        });
+    }
+
+private:
+    void Enqueue(std::function<void()> task)
+    {
+        std::lock_guard<std::mutex> l(m_);
+        queue_.push_back(std::move(task));
+        if (idle_ < queue_.size()) {
+            threads_.emplace_back([this]() { Worker(); });
+            if (pin_) {
+                Pin(threads_.back(), threads_.size() - 1);
+            }
+        } else {
+            cv_.notify_one();
+        }
+    }
+
+    void Worker()
+    {
+        std::unique_lock<std::mutex> l(m_);
+        for (;;) {
+            idle_++;
+            cv_.wait(l, [this]() { return stop_ || !queue_.empty(); });
+            idle_--;
+            if (queue_.empty()) {
+                return;
+            }
+            std::function<void()> task = std::move(queue_.front());
+            queue_.pop_front();
+            l.unlock();
+            // Submit() stores exceptions in the future
+            task();
+            task = nullptr;
+            l.lock();
+        }
+    }
+
+    void Pin(std::thread &t, size_t const index)
+    {
+#ifdef __linux__
+        if (cores_.empty()) {
+            return;
+        }
+        int const core = cores_[index % cores_.size()];
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(core, &cpus);
+        int const err = pthread_setaffinity_np(t.native_handle(), sizeof(cpus), &cpus);
+        if (err != 0) {
+            std::cout << "Could not pin thread " << index << " to core " << core << ". Error "
+                      << ::strerror(err) << std::endl;
+        }
+#endif
+    }
+
+    std::mutex m_;
+    std::condition_variable cv_;
+    std::deque<std::function<void()>> queue_;
+    // threads waiting for a task
+    size_t idle_ = 0;
+    bool stop_ = false;
+    bool pin_ = false;
+    // the cores threads are pinned to, in order
+    std::vector<int> cores_;
+    std::vector<std::thread> threads_;
+};
+
+#endif  // SRC_CPP_THREAD_POOL_HPP_
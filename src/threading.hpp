@@ -18,6 +18,21 @@
 #include <semaphore.h>
 #endif
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <algorithm>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "thread_pool.hpp"
+
 // TODO: in C++20, this can be replaced with std::binary_semaphore
 namespace Sem {
 #ifdef _WIN32
@@ -64,5 +79,371 @@ namespace Sem {
 
 };
 
+// Schedules the stripes of a table over worker threads. Stripes start in
+// order, but are computed independently, so a slow stripe doesn't hold up the
+// threads behind it. Their results are committed in order through a reorder
+// buffer of `window` slots: once a stripe and all stripes before it have been
+// computed, the number of entries before it is known, and it can be committed.
+//
+// Each stripe adds two kinds of entries (the left and the right table in
+// phase 1). Their running totals are the prefix sums the stripes are placed
+// at.
+//
+// With dynamic set, threads claim whichever stripe is next, rather than every
+// num_threads'th stripe, so threads that are faster, or get easier stripes,
+// take on more of them. Either way, the stripes are committed in the same
+// order, so the output doesn't depend on it.
+class StripeScheduler {
+public:
+    // A stripe whose offsets are known, and that can be committed
+    struct ready_t {
+        uint64_t stripe;
+        // The number of entries of the stripes before this one
+        uint64_t left_begin;
+        uint64_t right_begin;
+    };
+
+    StripeScheduler(
+        uint64_t const num_stripes,
+        uint32_t const num_threads,
+        uint32_t const window,
+        bool const dynamic = false)
+        : num_stripes_(num_stripes)
+        , num_threads_(num_threads)
+        , window_(window)
+        , dynamic_(dynamic)
+        , start_(std::chrono::steady_clock::now())
+        , slots_(window, kFree)
+        , owner_(window, 0)
+        , state_(window, 0)
+        , left_(window, 0)
+        , right_(window, 0)
+        , next_stripe_(num_threads, 0)
+        , stripes_(num_threads, 0)
+        , idle_(num_threads, 0.0)
+        , finished_(num_threads, 0.0)
+    {
+        for (uint32_t i = 0; i < num_threads; i++) {
+            next_stripe_[i] = i;
+        }
+    }
+
+    uint32_t Window() const { return window_; }
+
+    // Claims the next stripe of thread_index, its slot being stripe % Window().
+    // Returns false once there are no more stripes. Waits until the stripe
+    // before it has started, and its slot has been committed. The stripe then
+    // holds the start gate until Started() is called.
+    bool Claim(uint32_t const thread_index, uint64_t &stripe)
+    {
+        std::unique_lock<std::mutex> l(m_);
+        if (dynamic_) {
+            Wait(l, thread_index, [&] {
+                return started_ == claimed_ &&
+                       (claimed_ >= num_stripes_ || slots_[claimed_ % window_] == kFree);
+            });
+            stripe = claimed_;
+            if (stripe < num_stripes_) ++claimed_;
+        } else {
+            stripe = next_stripe_[thread_index];
+            if (stripe < num_stripes_) {
+                next_stripe_[thread_index] += num_threads_;
+                Wait(l, thread_index, [&] {
+                    return started_ == stripe && slots_[stripe % window_] == kFree;
+                });
+            }
+        }
+        if (stripe >= num_stripes_) {
+            finished_[thread_index] = Seconds(std::chrono::steady_clock::now());
+            return false;
+        }
+        slots_[stripe % window_] = stripe;
+        owner_[stripe % window_] = thread_index;
+        state_[stripe % window_] = 0;
+        ++stripes_[thread_index];
+        return true;
+    }
+
+    // Lets the next stripe start
+    void Started(uint64_t const stripe)
+    {
+        std::lock_guard<std::mutex> l(m_);
+        started_ = stripe + 1;
+        cv_.notify_all();
+    }
+
+    // Waits until all stripes before stripe have been computed, so nothing
+    // reads from their input anymore
+    void WaitForComputed(uint64_t const stripe)
+    {
+        std::unique_lock<std::mutex> l(m_);
+        Wait(l, owner_[stripe % window_], [&] { return computed_ >= stripe; });
+    }
+
+    // Marks stripe as computed, adding left and right entries. Appends the
+    // stripes that can now be committed to ready, in order. It's up to the
+    // caller to commit them and call Committed().
+    void Computed(
+        uint64_t const stripe,
+        uint64_t const left,
+        uint64_t const right,
+        std::vector<ready_t> &ready)
+    {
+        std::lock_guard<std::mutex> l(m_);
+        uint32_t const slot = stripe % window_;
+        state_[slot] = 1;
+        left_[slot] = left;
+        right_[slot] = right;
+        while (computed_ < started_ && slots_[computed_ % window_] == computed_ &&
+               state_[computed_ % window_] == 1) {
+            uint32_t const s = computed_ % window_;
+            ready.push_back({computed_, left_total_, right_total_});
+            left_total_ += left_[s];
+            right_total_ += right_[s];
+            ++computed_;
+        }
+        cv_.notify_all();
+    }
+
+    // Frees the slot of a stripe returned by Computed()
+    void Committed(uint64_t const stripe)
+    {
+        std::lock_guard<std::mutex> l(m_);
+        slots_[stripe % window_] = kFree;
+        cv_.notify_all();
+    }
+
+    // Totals once all stripes have been computed
+    uint64_t LeftTotal() const { return left_total_; }
+    uint64_t RightTotal() const { return right_total_; }
+
+    // Once all threads are done: the number of stripes each thread computed,
+    // and the share of the time until the last thread was done that it was
+    // busy
+    uint64_t Stripes(uint32_t const thread_index) const { return stripes_[thread_index]; }
+    double Utilization(uint32_t const thread_index) const
+    {
+        double const wall = *std::max_element(finished_.begin(), finished_.end());
+        if (wall <= 0) return 1.0;
+        return (finished_[thread_index] - idle_[thread_index]) / wall;
+    }
+
+private:
+    static constexpr uint64_t kFree = UINT64_MAX;
+
+    double Seconds(std::chrono::steady_clock::time_point const t) const
+    {
+        return std::chrono::duration<double>(t - start_).count();
+    }
+
+    // Waits for pred, counting the time as idle for thread_index
+    template <typename Pred>
+    void Wait(std::unique_lock<std::mutex> &l, uint32_t const thread_index, Pred pred)
+    {
+        if (pred()) return;
+        auto const begin = std::chrono::steady_clock::now();
+        cv_.wait(l, pred);
+        idle_[thread_index] +=
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    }
+
+    uint64_t const num_stripes_;
+    uint32_t const num_threads_;
+    uint32_t const window_;
+    bool const dynamic_;
+    std::chrono::steady_clock::time_point const start_;
+
+    std::mutex m_;
+    std::condition_variable cv_;
+    // The stripe occupying each slot, or kFree
+    std::vector<uint64_t> slots_;
+    // The thread that claimed the stripe in each slot
+    std::vector<uint32_t> owner_;
+    // Per slot, whether the stripe has been computed, and its entries
+    std::vector<uint8_t> state_;
+    std::vector<uint64_t> left_;
+    std::vector<uint64_t> right_;
+    // Stripes before this have started
+    uint64_t started_ = 0;
+    // Stripes before this have been computed, and handed out to be committed
+    uint64_t computed_ = 0;
+    uint64_t left_total_ = 0;
+    uint64_t right_total_ = 0;
+    // With dynamic, the next stripe to be claimed. Otherwise, each thread's
+    // next stripe
+    uint64_t claimed_ = 0;
+    std::vector<uint64_t> next_stripe_;
+    // Per thread, the stripes claimed, seconds spent waiting, and when it ran
+    // out of stripes (in seconds since the start)
+    std::vector<uint64_t> stripes_;
+    std::vector<double> idle_;
+    std::vector<double> finished_;
+};
+
+// Runs tasks on num_threads threads of the pool, in the order they're added, but
+// concurrently. At most max_queued tasks wait to be started, Add() blocks while
+// that many do. The first exception a task throws is rethrown by the next
+// Add() or Wait().
+class TaskQueue {
+public:
+    TaskQueue(uint32_t const num_threads, size_t const max_queued) : max_queued_(max_queued)
+    {
+        for (uint32_t i = 0; i < std::max<uint32_t>(num_threads, 1); i++) {
+            workers_.push_back(ThreadPool::Global().Submit([this]() { Worker(); }));
+        }
+    }
+
+    TaskQueue(TaskQueue const &) = delete;
+    TaskQueue &operator=(TaskQueue const &) = delete;
+
+    // Runs the tasks that are still queued, and stops the threads
+    ~TaskQueue()
+    {
+        {
+            std::lock_guard<std::mutex> l(m_);
+            stop_ = true;
+        }
+        work_cv_.notify_all();
+        for (auto &w : workers_) {
+            w.wait();
+        }
+    }
+
+    void Add(std::function<void()> task)
+    {
+        std::unique_lock<std::mutex> l(m_);
+        done_cv_.wait(l, [this]() { return queue_.size() < max_queued_ || error_; });
+        if (error_) {
+            std::rethrow_exception(error_);
+        }
+        queue_.push_back(std::move(task));
+        work_cv_.notify_one();
+    }
+
+    // Waits until all tasks added so far have finished
+    void Wait()
+    {
+        std::unique_lock<std::mutex> l(m_);
+        done_cv_.wait(l, [this]() { return (queue_.empty() && busy_ == 0) || error_; });
+        if (error_) {
+            std::rethrow_exception(error_);
+        }
+    }
+
+private:
+    void Worker()
+    {
+        std::unique_lock<std::mutex> l(m_);
+        for (;;) {
+            work_cv_.wait(l, [this]() { return stop_ || !queue_.empty(); });
+            if (queue_.empty()) {
+                return;
+            }
+            std::function<void()> const task = std::move(queue_.front());
+            queue_.pop_front();
+            busy_++;
+            done_cv_.notify_all();
+            l.unlock();
+            std::exception_ptr error;
+            try {
+                task();
+            } catch (...) {
+                error = std::current_exception();
+            }
+            l.lock();
+            if (error && !error_) {
+                error_ = error;
+            }
+            busy_--;
+            done_cv_.notify_all();
+        }
+    }
+
+    size_t const max_queued_;
+    std::mutex m_;
+    // signalled when a task is queued, or the threads should stop
+    std::condition_variable work_cv_;
+    // signalled when a task is started, or has finished
+    std::condition_variable done_cv_;
+    std::deque<std::function<void()>> queue_;
+    // tasks that are running
+    uint32_t busy_ = 0;
+    bool stop_ = false;
+    std::exception_ptr error_;
+    std::vector<std::future<void>> workers_;
+};
+
+// A bounded, lock-free queue between one producer thread and one consumer
+// thread. A full or empty queue is waited on by polling, yielding at first,
+// then sleeping, so it's meant for passing batches rather than single items.
+template <typename T>
+class SPSCQueue {
+public:
+    explicit SPSCQueue(size_t const capacity) : slots_(capacity + 1) {}
+
+    SPSCQueue(SPSCQueue const&) = delete;
+    SPSCQueue& operator=(SPSCQueue const&) = delete;
+
+    // Waits for room, and adds item. Returns false, without adding it, if the
+    // queue has been cancelled
+    bool Push(T&& item)
+    {
+        if (cancelled_.load(std::memory_order_relaxed)) return false;
+        size_t const tail = tail_.load(std::memory_order_relaxed);
+        size_t const next = (tail + 1) % slots_.size();
+        for (uint32_t polls = 0; next == head_.load(std::memory_order_acquire); polls++) {
+            if (cancelled_.load(std::memory_order_relaxed)) return false;
+            Backoff(polls);
+        }
+        slots_[tail] = std::move(item);
+        tail_.store(next, std::memory_order_release);
+        return true;
+    }
+
+    // Waits for an item, and moves it to item. Returns false once the queue
+    // is closed and all items have been taken, or if it has been cancelled
+    bool Pop(T& item)
+    {
+        if (cancelled_.load(std::memory_order_relaxed)) return false;
+        size_t const head = head_.load(std::memory_order_relaxed);
+        for (uint32_t polls = 0; head == tail_.load(std::memory_order_acquire); polls++) {
+            if (cancelled_.load(std::memory_order_relaxed)) return false;
+            if (closed_.load(std::memory_order_acquire) &&
+                head == tail_.load(std::memory_order_acquire)) {
+                return false;
+            }
+            Backoff(polls);
+        }
+        item = std::move(slots_[head]);
+        head_.store((head + 1) % slots_.size(), std::memory_order_release);
+        return true;
+    }
+
+    // Called by the producer, after its last Push()
+    void Close() { closed_.store(true, std::memory_order_release); }
+
+    // Makes Push() and Pop() give up, on either side, e.g. when the other
+    // side has failed
+    void Cancel() { cancelled_.store(true, std::memory_order_relaxed); }
+
+private:
+    static void Backoff(uint32_t const polls)
+    {
+        if (polls < 64) {
+            std::this_thread::yield();
+        } else {
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+        }
+    }
+
+    // One slot is always left empty, to tell a full queue from an empty one
+    std::vector<T> slots_;
+    // on separate cache lines, since each side writes one of them
+    alignas(64) std::atomic<size_t> head_{0};
+    alignas(64) std::atomic<size_t> tail_{0};
+    std::atomic<bool> closed_{false};
+    std::atomic<bool> cancelled_{false};
+};
+
 //        std::cout << ptd->index << " waited 0" << std::endl;
 #endif  // CHIAPOS_THREADING_HPP
@@ -36,8 +36,11 @@ namespace UniformSort {
         return true;
     }
 
+    // input_disk is read from input_disk_begin on, in order. It can be any
+    // type with FileDisk's Read()
+    template <typename InputDisk>
     inline void SortToMemory(
-        FileDisk &input_disk,
+        InputDisk &input_disk,
         uint64_t const input_disk_begin,
         uint8_t *const memory,
         uint32_t const entry_len,
@@ -0,0 +1,266 @@
+// Copyright 2018 Chia Network Inc
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//    http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SRC_CPP_URING_HPP_
+#define SRC_CPP_URING_HPP_
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define HAVE_URING 1
+#endif
+#endif
+#endif
+
+#if HAVE_URING
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <thread>
+
+// A minimal io_uring submission/completion queue pair, talking to the kernel
+// through the raw syscalls, so there's no dependency on liburing. It's only
+// meant to be used by one thread at a time.
+class URing {
+public:
+    // Returns nullptr if the kernel doesn't support io_uring, or it's not
+    // allowed (e.g. by a seccomp filter)
+    static std::unique_ptr<URing> Create(uint32_t const entries)
+    {
+        // once it has failed, don't keep asking
+        static std::atomic<bool> unavailable{false};
+        if (unavailable) {
+            return nullptr;
+        }
+        std::unique_ptr<URing> ring(new URing());
+        if (!ring->Setup(entries)) {
+            unavailable = true;
+            return nullptr;
+        }
+        return ring;
+    }
+
+    URing(const URing &) = delete;
+    URing &operator=(const URing &) = delete;
+
+    ~URing()
+    {
+        if (sqes_ != MAP_FAILED) {
+            ::munmap(sqes_, sqes_size_);
+        }
+        if (cq_ptr_ != MAP_FAILED && cq_ptr_ != sq_ptr_) {
+            ::munmap(cq_ptr_, cq_size_);
+        }
+        if (sq_ptr_ != MAP_FAILED) {
+            ::munmap(sq_ptr_, sq_size_);
+        }
+        if (fd_ >= 0) {
+            ::close(fd_);
+        }
+    }
+
+    // Queues a read or write of length bytes at offset. It's passed to the
+    // kernel by the next Submit(). Returns false if the submission queue is
+    // full.
+    bool Prepare(
+        uint8_t const opcode,
+        int const fd,
+        const void *buf,
+        uint32_t const length,
+        uint64_t const offset,
+        uint64_t const user_data)
+    {
+        uint32_t const tail = *sq_tail_;
+        if (tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) == sq_entries_) {
+            return false;
+        }
+        uint32_t const index = tail & sq_mask_;
+        struct io_uring_sqe *sqe = &sqes_[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = opcode;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)(uintptr_t)buf;
+        sqe->len = length;
+        sqe->off = offset;
+        sqe->user_data = user_data;
+        sq_array_[index] = index;
+        __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+        ++to_submit_;
+        return true;
+    }
+
+    uint32_t Queued() const { return to_submit_; }
+
+    // Passes all queued operations to the kernel, and waits until at least
+    // min_complete operations have completed. Like the stdio path, failures
+    // are retried rather than thrown.
+    void Submit(uint32_t const min_complete)
+    {
+        while (to_submit_ > 0 || min_complete > 0) {
+            int const ret = ::syscall(
+                __NR_io_uring_enter,
+                fd_,
+                to_submit_,
+                min_complete,
+                min_complete > 0 ? IORING_ENTER_GETEVENTS : 0,
+                nullptr,
+                0);
+            if (ret < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EBUSY) {
+                    // out of kernel resources for now
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                    continue;
+                }
+                std::cout << "io_uring_enter failed: " << ::strerror(errno)
+                          << ". Retrying in five minutes." << std::endl;
+                std::this_thread::sleep_for(std::chrono::minutes(5));
+                continue;
+            }
+            to_submit_ -= ret;
+            if (to_submit_ == 0) {
+                return;
+            }
+        }
+    }
+
+    // Takes the oldest completion off the completion queue. Returns false if
+    // there is none.
+    bool PopCompletion(uint64_t &user_data, int32_t &result)
+    {
+        uint32_t const head = *cq_head_;
+        if (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+            return false;
+        }
+        struct io_uring_cqe const &cqe = cqes_[head & cq_mask_];
+        user_data = cqe.user_data;
+        result = cqe.res;
+        __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    // Like PopCompletion(), but waits for a completion if there is none
+    void WaitCompletion(uint64_t &user_data, int32_t &result)
+    {
+        while (!PopCompletion(user_data, result)) {
+            Submit(1);
+        }
+    }
+
+private:
+    URing() = default;
+
+    bool Setup(uint32_t const entries)
+    {
+        struct io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        fd_ = ::syscall(__NR_io_uring_setup, entries, &params);
+        if (fd_ < 0) {
+            return false;
+        }
+
+        sq_size_ = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+        cq_size_ = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        bool const single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap) {
+            sq_size_ = cq_size_ = std::max(sq_size_, cq_size_);
+        }
+        sq_ptr_ = ::mmap(
+            nullptr,
+            sq_size_,
+            PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE,
+            fd_,
+            IORING_OFF_SQ_RING);
+        if (sq_ptr_ == MAP_FAILED) {
+            return false;
+        }
+        cq_ptr_ = single_mmap ? sq_ptr_
+                              : ::mmap(
+                                    nullptr,
+                                    cq_size_,
+                                    PROT_READ | PROT_WRITE,
+                                    MAP_SHARED | MAP_POPULATE,
+                                    fd_,
+                                    IORING_OFF_CQ_RING);
+        if (cq_ptr_ == MAP_FAILED) {
+            return false;
+        }
+        sqes_size_ = params.sq_entries * sizeof(struct io_uring_sqe);
+        void *sqes = ::mmap(
+            nullptr,
+            sqes_size_,
+            PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE,
+            fd_,
+            IORING_OFF_SQES);
+        if (sqes == MAP_FAILED) {
+            return false;
+        }
+        sqes_ = static_cast<struct io_uring_sqe *>(sqes);
+
+        uint8_t *sq = static_cast<uint8_t *>(sq_ptr_);
+        sq_head_ = reinterpret_cast<uint32_t *>(sq + params.sq_off.head);
+        sq_tail_ = reinterpret_cast<uint32_t *>(sq + params.sq_off.tail);
+        sq_mask_ = *reinterpret_cast<uint32_t *>(sq + params.sq_off.ring_mask);
+        sq_array_ = reinterpret_cast<uint32_t *>(sq + params.sq_off.array);
+        sq_entries_ = params.sq_entries;
+
+        uint8_t *cq = static_cast<uint8_t *>(cq_ptr_);
+        cq_head_ = reinterpret_cast<uint32_t *>(cq + params.cq_off.head);
+        cq_tail_ = reinterpret_cast<uint32_t *>(cq + params.cq_off.tail);
+        cq_mask_ = *reinterpret_cast<uint32_t *>(cq + params.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<struct io_uring_cqe *>(cq + params.cq_off.cqes);
+        return true;
+    }
+
+    int fd_ = -1;
+
+    void *sq_ptr_ = MAP_FAILED;
+    void *cq_ptr_ = MAP_FAILED;
+    struct io_uring_sqe *sqes_ = static_cast<struct io_uring_sqe *>(MAP_FAILED);
+    size_t sq_size_ = 0;
+    size_t cq_size_ = 0;
+    size_t sqes_size_ = 0;
+
+    uint32_t *sq_head_ = nullptr;
+    uint32_t *sq_tail_ = nullptr;
+    uint32_t *sq_array_ = nullptr;
+    uint32_t sq_mask_ = 0;
+    uint32_t sq_entries_ = 0;
+
+    uint32_t *cq_head_ = nullptr;
+    uint32_t *cq_tail_ = nullptr;
+    struct io_uring_cqe *cqes_ = nullptr;
+    uint32_t cq_mask_ = 0;
+
+    // operations prepared, but not yet passed to the kernel
+    uint32_t to_submit_ = 0;
+};
+
+#endif  // HAVE_URING
+
+#endif  // SRC_CPP_URING_HPP_
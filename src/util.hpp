@@ -81,6 +81,28 @@ inline uint64_t bswap_64(uint64_t x) { return __builtin_bswap64(x); }
 #include <cpuid.h>
 #endif
 
+#if defined(_WIN32) || defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// Marks functions using instruction set extensions that the rest of the build
+// doesn't assume. Callers must check Util::GetISA() first.
+#if defined(__GNUC__)
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define TARGET_AVX512 __attribute__((target("avx512f")))
+#else
+#define TARGET_AVX2
+#define TARGET_AVX512
+#endif
+
+// The SIMD code paths, in order of preference
+enum class isa_t : uint8_t {
+    portable,
+    sse2,
+    avx2,
+    avx512,
+};
+
 class Timer {
 public:
     Timer()
@@ -162,6 +184,21 @@ namespace Util {
         return s.str();
     }
 
+    // Splits a comma separated list. Every comma ends an item, so an empty
+    // string is one empty item and "a," is "a" and "".
+    inline std::vector<std::string> SplitList(const std::string &list)
+    {
+        std::vector<std::string> items;
+        size_t begin = 0;
+        for (size_t comma = list.find(','); comma != std::string::npos;
+             comma = list.find(',', begin)) {
+            items.push_back(list.substr(begin, comma - begin));
+            begin = comma + 1;
+        }
+        items.push_back(list.substr(begin));
+        return items;
+    }
+
     inline void IntToTwoBytes(uint8_t *result, const uint16_t input)
     {
         uint16_t r = bswap_16(input);
@@ -273,6 +310,48 @@ namespace Util {
         return ((uint128_t)high << 64) | low;
     }
 
+    // The inverse of SliceInt64FromBytes(). Sets the 'num_bits' (<= 64) bits
+    // starting at 'start_bit' of the big-endian bit string 'bytes' to the low
+    // bits of 'value'. Those bits must be zero to begin with.
+    //
+    // Note: like SliceInt64FromBytes(), this accesses the 8 bytes starting at
+    // the first byte it writes to, so buffers need 7 bytes of head-room.
+    inline void SetInt64InBytes(
+        uint8_t *bytes,
+        const uint32_t start_bit,
+        uint64_t value,
+        const uint32_t num_bits)
+    {
+        if (num_bits == 0) {
+            return;
+        }
+        if (start_bit % 8 + num_bits > 64) {
+            SetInt64InBytes(bytes, start_bit, value >> 32, num_bits - 32);
+            SetInt64InBytes(bytes, start_bit + num_bits - 32, value & 0xffffffff, 32);
+            return;
+        }
+        if (num_bits < 64) {
+            value &= ((uint64_t)1 << num_bits) - 1;
+        }
+        bytes += start_bit / 8;
+        uint64_t const tmp = Util::EightBytesToInt(bytes);
+        Util::IntToEightBytes(bytes, tmp | (value << (64 - start_bit % 8 - num_bits)));
+    }
+
+    inline void SetInt128InBytes(
+        uint8_t *bytes,
+        const uint32_t start_bit,
+        const uint128_t value,
+        const uint32_t num_bits)
+    {
+        if (num_bits <= 64) {
+            SetInt64InBytes(bytes, start_bit, (uint64_t)value, num_bits);
+            return;
+        }
+        SetInt64InBytes(bytes, start_bit, (uint64_t)(value >> 64), num_bits - 64);
+        SetInt64InBytes(bytes, start_bit + num_bits - 64, (uint64_t)value, 64);
+    }
+
     inline void GetRandomBytes(uint8_t *buf, uint32_t num_bytes)
     {
         std::random_device rd;
@@ -359,8 +438,99 @@ namespace Util {
         // Bit 23 of ECX indicates POPCNT instruction support
         return (regs[2] >> 23) & 1;
     }
+
+    // Returns the OS-enabled register state, the extended control register 0
+    inline uint64_t XGetBV()
+    {
+#if defined(_WIN32)
+        return _xgetbv(0);
+#else
+        uint32_t eax, edx;
+        __asm__ __volatile__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+        return ((uint64_t)edx << 32) | eax;
+#endif /* defined(_WIN32) */
+    }
+
+    inline bool HaveAVX2(void)
+    {
+        uint32_t regs[4] = {0};
+
+        CpuID(1, regs);
+        // Bit 27 of ECX indicates OSXSAVE, needed to check that the OS saves
+        // the YMM registers (bits 1 and 2 of XCR0)
+        if (!((regs[2] >> 27) & 1) || (XGetBV() & 0x6) != 0x6) {
+            return false;
+        }
+        CpuID(0, regs);
+        if (regs[0] < 7) {
+            return false;
+        }
+#if defined(_WIN32)
+        __cpuidex((int *)regs, 7, 0);
+#else
+        __cpuid_count(7, 0, regs[0], regs[1], regs[2], regs[3]);
+#endif /* defined(_WIN32) */
+        // Bit 5 of EBX indicates AVX2 support
+        return (regs[1] >> 5) & 1;
+    }
+
+    inline bool HaveAVX512F(void)
+    {
+        uint32_t regs[4] = {0};
+
+        if (!HaveAVX2()) {
+            return false;
+        }
+        // The OS also has to save the opmask and ZMM registers (bits 5-7 of XCR0)
+        if ((XGetBV() & 0xe6) != 0xe6) {
+            return false;
+        }
+#if defined(_WIN32)
+        __cpuidex((int *)regs, 7, 0);
+#else
+        __cpuid_count(7, 0, regs[0], regs[1], regs[2], regs[3]);
+#endif /* defined(_WIN32) */
+        // Bit 16 of EBX indicates AVX-512 Foundation support
+        return (regs[1] >> 16) & 1;
+    }
 #endif /* defined(_WIN32) || defined(__x86_64__) */
 
+    // The best SIMD code path this CPU supports, detected once
+    inline isa_t GetISA()
+    {
+#if defined(_WIN32) || defined(__x86_64__)
+        static isa_t const isa =
+            HaveAVX512F() ? isa_t::avx512 : HaveAVX2() ? isa_t::avx2 : isa_t::sse2;
+        return isa;
+#else
+        return isa_t::portable;
+#endif
+    }
+
+    // n must be non-zero
+    inline uint32_t CountTrailingZeros(uint64_t n)
+    {
+#if defined(_WIN32)
+        unsigned long index;
+        _BitScanForward64(&index, n);
+        return index;
+#else
+        return __builtin_ctzll(n);
+#endif
+    }
+
+    // n must be non-zero
+    inline uint32_t CountLeadingZeros(uint64_t n)
+    {
+#if defined(_WIN32)
+        unsigned long index;
+        _BitScanReverse64(&index, n);
+        return 63 - index;
+#else
+        return __builtin_clzll(n);
+#endif
+    }
+
     inline uint64_t PopCount(uint64_t n)
     {
 #if defined(_WIN32)
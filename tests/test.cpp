@@ -20,6 +20,7 @@
 #include "../lib/include/picosha2.hpp"
 #include "calculate_bucket.hpp"
 #include "disk.hpp"
+#include "plot_scheduler.hpp"
 #include "plotter_disk.hpp"
 #include "prover_disk.hpp"
 #include "sort_manager.hpp"
@@ -165,6 +166,13 @@ TEST_CASE("Util")
         REQUIRE(Util::SliceInt128FromBytes(bytes3, 0, 120) == int3 >> 8);
         REQUIRE(Util::SliceInt128FromBytes(bytes3, 3, 127) == (int3 << 2 | 3));
     }
+
+    SECTION("Comma separated lists")
+    {
+        REQUIRE(Util::SplitList("01,,0203") == vector<string>{"01", "", "0203"});
+        REQUIRE(Util::SplitList("01,") == vector<string>{"01", ""});
+        REQUIRE(Util::SplitList("") == vector<string>{""});
+    }
 }
 
 TEST_CASE("Bits")
@@ -386,6 +394,63 @@ TEST_CASE("F functions")
         REQUIRE(result4.first.GetValue() == results[max_batch - 1]);
     }
 
+    SECTION("F1 batch")
+    {
+        uint8_t test_key[] = {0, 2, 3, 4,  5, 5, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16,
+                              1, 2, 3, 41, 5, 6, 7, 8, 9, 10, 11, 12, 13, 11, 15, 16};
+        uint64_t results[1 << kBatchSizes];
+        for (uint8_t k : {18, 25, 32, 50}) {
+            F1Calculator f1(k, test_key);
+            // The last one crosses the low 32 bits of the ChaCha8 block counter
+            uint64_t const block_2_32 = ((1ULL << 32) * kF1BlockSizeBits) / k;
+            for (uint64_t first_x : vector<uint64_t>{0, 12345, block_2_32 - 100}) {
+                if (first_x + (1 << kBatchSizes) > (1ULL << k)) {
+                    continue;
+                }
+                for (uint64_t n : {1, 3, 61, 1 << kBatchSizes}) {
+                    f1.CalculateBuckets(first_x, n, results);
+                    for (uint64_t i = 0; i < n; i++) {
+                        REQUIRE(f1.CalculateF(Bits(first_x + i, k)).GetValue() == results[i]);
+                    }
+                }
+            }
+        }
+    }
+
+    SECTION("ChaCha8 kernels")
+    {
+        uint8_t key[32];
+        for (uint32_t i = 0; i < 32; i++) {
+            key[i] = i * 7 + 1;
+        }
+        struct chacha8_ctx ctx;
+        chacha8_keysetup(&ctx, key, 256, NULL);
+
+        uint32_t const n = 37;
+        vector<uint8_t> expected(n * 64), out(n * 64);
+        // The second position carries into the high 32 bits of the counter
+        for (uint64_t pos : vector<uint64_t>{0, (1ULL << 32) - 20}) {
+            chacha8_get_keystream_portable(&ctx, pos, n, expected.data());
+            chacha8_get_keystream(&ctx, pos, n, out.data());
+            REQUIRE(out == expected);
+#if defined(_WIN32) || defined(__x86_64__)
+            std::fill(out.begin(), out.end(), 0);
+            chacha8_get_keystream_sse2(&ctx, pos, n, out.data());
+            REQUIRE(out == expected);
+            if (Util::HaveAVX2()) {
+                std::fill(out.begin(), out.end(), 0);
+                chacha8_get_keystream_avx2(&ctx, pos, n, out.data());
+                REQUIRE(out == expected);
+            }
+            if (Util::HaveAVX512F()) {
+                std::fill(out.begin(), out.end(), 0);
+                chacha8_get_keystream_avx512(&ctx, pos, n, out.data());
+                REQUIRE(out == expected);
+            }
+#endif
+        }
+    }
+
     SECTION("F2")
     {
         uint8_t test_key_2[] = {20,  2,  5,  4,   51, 52,  23,  84,  91, 10, 111,
@@ -477,6 +542,141 @@ TEST_CASE("F functions")
         VerifyFC(7, 16, 0x5fec898f, 0x82283d15, 0x14f410, 0x24c3c2, 0x0);
         VerifyFC(7, 16, 0x64ac5db9, 0x7923986, 0x590fd, 0x1c74a2, 0x0);
     }
+
+    SECTION("Fx batch")
+    {
+        std::mt19937_64 rng(17);
+        for (uint8_t k : {18, 32, 40}) {
+            for (uint8_t t = 2; t <= 7; t++) {
+                uint32_t const metadata_size = kVectorLens[t] * k;
+                uint32_t const c_size = t < 7 ? kVectorLens[t + 1] * k : 0;
+                // Not a multiple of any batch or SIMD width, to cover the tails
+                uint32_t const n = 2 * kFxBatchSize + 29;
+                vector<uint64_t> y(n), f_out(n);
+                vector<metadata_t> L(n), R(n), c_out(n);
+                auto random_bits = [&rng](uint32_t size) {
+                    uint128_t r = ((uint128_t)rng() << 64) | rng();
+                    return size >= 128 ? r : r & (((uint128_t)1 << size) - 1);
+                };
+                auto to_bits = [](const metadata_t& m, uint32_t size) {
+                    if (size <= 128) {
+                        return Bits(m.left, size);
+                    }
+                    return Bits(m.left, 128) + Bits(m.right, size - 128);
+                };
+                for (uint32_t i = 0; i < n; i++) {
+                    y[i] = (uint64_t)random_bits(k + kExtraBits);
+                    L[i].left = random_bits(std::min<uint32_t>(metadata_size, 128));
+                    L[i].right = metadata_size > 128 ? random_bits(metadata_size - 128) : 0;
+                    R[i].left = random_bits(std::min<uint32_t>(metadata_size, 128));
+                    R[i].right = metadata_size > 128 ? random_bits(metadata_size - 128) : 0;
+                }
+
+                FxCalculator f(k, t);
+                f.CalculateBuckets(n, y.data(), L.data(), R.data(), f_out.data(), c_out.data());
+                for (uint32_t i = 0; i < n; i++) {
+                    std::pair<Bits, Bits> expected = f.CalculateBucket(
+                        Bits(y[i], k + kExtraBits),
+                        to_bits(L[i], metadata_size),
+                        to_bits(R[i], metadata_size));
+                    REQUIRE(expected.first.GetValue() == f_out[i]);
+                    if (c_size > 0) {
+                        REQUIRE(expected.second == to_bits(c_out[i], c_size));
+                    }
+                }
+            }
+        }
+    }
+
+    SECTION("FindMatches kernels")
+    {
+        std::mt19937_64 rng(5);
+        FxCalculator f(18, 2);
+        vector<isa_t> isas = {isa_t::portable};
+        if (Util::GetISA() >= isa_t::avx2) {
+            isas.push_back(isa_t::avx2);
+        }
+        if (Util::GetISA() >= isa_t::avx512) {
+            isas.push_back(isa_t::avx512);
+        }
+        for (uint64_t bucket = 100; bucket < 120; bucket++) {
+            // Sizes around the average bucket size, with some repeated y values
+            vector<uint64_t> L_y(150 + rng() % 200), R_y(150 + rng() % 200);
+            for (uint64_t& y : L_y) {
+                y = bucket * kBC + rng() % kBC;
+            }
+            for (uint64_t& y : R_y) {
+                y = (bucket + 1) * kBC + rng() % kBC;
+            }
+            std::sort(L_y.begin(), L_y.end());
+            std::sort(R_y.begin(), R_y.end());
+
+            int32_t expected_count = 0;
+            for (uint64_t yl : L_y) {
+                for (uint64_t yr : R_y) {
+                    expected_count += CheckMatch(yl, yr);
+                }
+            }
+
+            uint16_t expected_L[10000], expected_R[10000];
+            REQUIRE(
+                f.FindMatches(
+                    L_y.data(),
+                    L_y.size(),
+                    R_y.data(),
+                    R_y.size(),
+                    expected_L,
+                    expected_R,
+                    isa_t::portable) == expected_count);
+            for (isa_t isa : isas) {
+                uint16_t idx_L[10000], idx_R[10000];
+                int32_t const idx_count = f.FindMatches(
+                    L_y.data(), L_y.size(), R_y.data(), R_y.size(), idx_L, idx_R, isa);
+                REQUIRE(idx_count == expected_count);
+                for (int32_t i = 0; i < idx_count; i++) {
+                    REQUIRE(idx_L[i] == expected_L[i]);
+                    REQUIRE(idx_R[i] == expected_R[i]);
+                    REQUIRE(CheckMatch(L_y[idx_L[i]], R_y[idx_R[i]]));
+                }
+            }
+        }
+    }
+
+    SECTION("Blake3 batch kernels")
+    {
+        uint32_t const n = 67;
+        vector<uint8_t> blocks(n * Blake3Batch::kBlockLen);
+        vector<uint8_t> expected(n * Blake3Batch::kOutLen), out(n * Blake3Batch::kOutLen);
+        for (uint8_t block_len : {1, 12, 37, 57, 64}) {
+            std::fill(blocks.begin(), blocks.end(), 0);
+            for (uint32_t i = 0; i < n; i++) {
+                for (uint32_t j = 0; j < block_len; j++) {
+                    blocks[i * Blake3Batch::kBlockLen + j] = i * 31 + j;
+                }
+                blake3_hasher hasher;
+                blake3_hasher_init(&hasher);
+                blake3_hasher_update(&hasher, &blocks[i * Blake3Batch::kBlockLen], block_len);
+                blake3_hasher_finalize(&hasher, &expected[i * Blake3Batch::kOutLen], 32);
+            }
+            Blake3Batch::HashPortable(blocks.data(), n, block_len, out.data());
+            REQUIRE(out == expected);
+#if defined(_WIN32) || defined(__x86_64__)
+            std::fill(out.begin(), out.end(), 0);
+            Blake3Batch::HashSSE2(blocks.data(), n, block_len, out.data());
+            REQUIRE(out == expected);
+            if (Util::HaveAVX2()) {
+                std::fill(out.begin(), out.end(), 0);
+                Blake3Batch::HashAVX2(blocks.data(), n, block_len, out.data());
+                REQUIRE(out == expected);
+            }
+            if (Util::HaveAVX512F()) {
+                std::fill(out.begin(), out.end(), 0);
+                Blake3Batch::HashAVX512(blocks.data(), n, block_len, out.data());
+                REQUIRE(out == expected);
+            }
+#endif
+        }
+    }
 }
 
 void HexToBytes(const string& hex, uint8_t* result)
@@ -533,6 +733,13 @@ void TestProofOfSpace(
     delete[] proof_data;
 }
 
+// Sets whether FileDisks use io_uring, for its scope. It's turned back off
+// even if a REQUIRE fails, so the following tests aren't affected.
+struct URingScope {
+    explicit URingScope(bool const enabled) { FileDisk::URingEnabled() = enabled; }
+    ~URingScope() { FileDisk::URingEnabled() = false; }
+};
+
 void PlotAndTestProofOfSpace(
     std::string filename,
     uint32_t iterations,
@@ -541,12 +748,15 @@ void PlotAndTestProofOfSpace(
     uint32_t buffer,
     uint32_t num_proofs,
     uint32_t stripe_size,
-    uint8_t num_threads)
+    uint8_t num_threads,
+    uint8_t flags = ENABLE_BITFIELD,
+    uint32_t bucket_ram_megabytes = 0)
 {
     DiskPlotter plotter = DiskPlotter();
     uint8_t memo[5] = {1, 2, 3, 4, 5};
     plotter.CreatePlotDisk(
-        ".", ".", ".", filename, k, memo, 5, plot_id, 32, buffer, 0, stripe_size, num_threads);
+        ".", ".", ".", filename, k, memo, 5, plot_id, 32, buffer, 0, stripe_size, num_threads,
+        flags, bucket_ram_megabytes);
     TestProofOfSpace(filename, iterations, k, plot_id, num_proofs);
     REQUIRE(remove(filename.c_str()) == 0);
 }
@@ -557,6 +767,46 @@ TEST_CASE("Plotting")
     {
         PlotAndTestProofOfSpace("cpp-test-plot.dat", 100, 18, plot_id_1, 11, 95, 4000, 2);
     }
+    SECTION("Disk plot k18 no bitfield")
+    {
+        PlotAndTestProofOfSpace("cpp-test-plot.dat", 100, 18, plot_id_1, 11, 95, 4000, 2, 0);
+    }
+    SECTION("Disk plot k18 dynamic stripes")
+    {
+        PlotAndTestProofOfSpace(
+            "cpp-test-plot.dat", 100, 18, plot_id_1, 11, 95, 4000, 2,
+            ENABLE_BITFIELD | DYNAMIC_STRIPES);
+    }
+    SECTION("Disk plot k18 direct I/O")
+    {
+        PlotAndTestProofOfSpace(
+            "cpp-test-plot.dat", 100, 18, plot_id_1, 11, 95, 4000, 2, ENABLE_BITFIELD | DIRECT_IO);
+    }
+    SECTION("Disk plot k18 bucket RAM")
+    {
+        // Less than the buckets need, so some of them spill to disk
+        PlotAndTestProofOfSpace(
+            "cpp-test-plot.dat", 100, 18, plot_id_1, 11, 95, 4000, 2, ENABLE_BITFIELD, 8);
+    }
+    SECTION("Disk plot k18 packed temp files")
+    {
+        PlotAndTestProofOfSpace(
+            "cpp-test-plot.dat", 100, 18, plot_id_1, 11, 95, 4000, 2,
+            ENABLE_BITFIELD | PACKED_TEMP);
+    }
+    SECTION("Disk plot k18 compressed temp files")
+    {
+        PlotAndTestProofOfSpace(
+            "cpp-test-plot.dat", 100, 18, plot_id_1, 11, 95, 4000, 2,
+            ENABLE_BITFIELD | COMPRESSED_TEMP);
+    }
+    SECTION("Disk plot k18 no bitfield, io_uring")
+    {
+        // Without the bitfield, phase 2 rewrites the tables in place, so queued
+        // writes overlap and interleave with reads
+        URingScope const ring(true);
+        PlotAndTestProofOfSpace("cpp-test-plot.dat", 100, 18, plot_id_1, 11, 95, 4000, 2, 0);
+    }
     SECTION("Disk plot k19")
     {
         PlotAndTestProofOfSpace("cpp-test-plot.dat", 100, 19, plot_id_1, 100, 71, 8192, 2);
@@ -565,6 +815,11 @@ TEST_CASE("Plotting")
     {
         PlotAndTestProofOfSpace("cpp-test-plot.dat", 100, 19, plot_id_1, 100, 71, 8192, 1);
     }
+    SECTION("Disk plot k19 in memory")
+    {
+        PlotAndTestProofOfSpace(
+            "cpp-test-plot.dat", 100, 19, plot_id_1, 100, 71, 8192, 2, ENABLE_BITFIELD | IN_MEMORY);
+    }
     SECTION("Disk plot k20")
     {
         PlotAndTestProofOfSpace("cpp-test-plot.dat", 500, 20, plot_id_3, 100, 469, 16000, 2);
@@ -577,6 +832,66 @@ TEST_CASE("Plotting")
     // 100, 107); }
 }
 
+TEST_CASE("Background copy")
+{
+    fs::create_directory("bg-copy-final");
+    DiskPlotter plotter = DiskPlotter();
+    uint8_t memo[5] = {1, 2, 3, 4, 5};
+    plotter.CreatePlotDisk(
+        ".", ".", "bg-copy-final", "cpp-test-plot.dat", 18, memo, 5, plot_id_1, 32, 11, 0, 4000,
+        2, ENABLE_BITFIELD, 0, 64, true);
+    plotter.WaitForCopies();
+    REQUIRE(plotter.PendingCopies() == 0);
+    REQUIRE(!fs::exists("cpp-test-plot.dat.2.tmp"));
+    TestProofOfSpace("bg-copy-final/cpp-test-plot.dat", 100, 18, plot_id_1, 95);
+    REQUIRE(fs::remove_all("bg-copy-final") == 2);
+}
+
+TEST_CASE("PlotScheduler")
+{
+    PlotJob job;
+    job.tmp_dirname = job.tmp2_dirname = job.final_dirname = ".";
+    job.k = 18;
+    job.memo = {1, 2, 3, 4, 5};
+    job.id.assign(plot_id_1, plot_id_1 + 32);
+    job.buf_megabytes = 11;
+    job.stripe_size = 4000;
+
+    SECTION("overlapping plots")
+    {
+        PlotScheduler scheduler(2 * job.buf_megabytes, 2);
+        for (int i = 0; i < 3; i++) {
+            job.filename = "cpp-test-plot-" + std::to_string(i) + ".dat";
+            scheduler.Add(job);
+        }
+        scheduler.Run();
+        for (int i = 0; i < 3; i++) {
+            string const filename = "cpp-test-plot-" + std::to_string(i) + ".dat";
+            TestProofOfSpace(filename, 100, 18, plot_id_1, 95);
+            REQUIRE(remove(filename.c_str()) == 0);
+        }
+    }
+
+    SECTION("sharing threads")
+    {
+        // Overlapping needs a thread for each plot, and memory for their temp files
+        REQUIRE(PlotScheduler(100, 2).CanOverlap(job, job));
+        REQUIRE(!PlotScheduler(100, 1).CanOverlap(job, job));
+        PlotJob in_memory = job;
+        in_memory.phases_flags |= IN_MEMORY;
+        REQUIRE(!PlotScheduler(100, 4).CanOverlap(job, in_memory));
+        REQUIRE(!PlotScheduler(100, 4).CanOverlap(in_memory, job));
+    }
+
+    SECTION("not enough memory")
+    {
+        PlotScheduler scheduler(job.buf_megabytes - 1, 2);
+        job.filename = "cpp-test-plot.dat";
+        scheduler.Add(job);
+        REQUIRE_THROWS_AS(scheduler.Run(), InsufficientMemoryException);
+    }
+}
+
 TEST_CASE("Invalid plot")
 {
     SECTION("File gets deleted")
@@ -686,6 +1001,47 @@ TEST_CASE("Sort on disk")
         delete[] hashes_bytes;
     }
 
+    SECTION("Radix sort")
+    {
+        std::mt19937_64 rng(3);
+        for (uint32_t const entry_len : {5, 11, 16}) {
+            for (uint32_t const bits_begin : {0, 3, 13}) {
+                for (bool const skewed : {false, true}) {
+                    // Skewed entries share long prefixes and repeat a lot,
+                    // which exercises the constant digit and tiny range paths
+                    uint64_t const num_entries = 20000;
+                    vector<uint8_t> expected(num_entries * entry_len);
+                    for (uint64_t i = 0; i < num_entries; i++) {
+                        uint8_t* entry = expected.data() + i * entry_len;
+                        for (uint32_t j = 0; j < entry_len; j++) {
+                            entry[j] = skewed ? (j + 1 < entry_len ? 0 : rng() % 3) : rng();
+                        }
+                        // The bits before bits_begin are the same within a bucket
+                        for (uint32_t bit = 0; bit < bits_begin; bit++) {
+                            entry[bit / 8] &= ~(0x80 >> (bit % 8));
+                        }
+                    }
+                    vector<uint8_t> sorted_1 = expected;
+                    vector<uint8_t> sorted_4 = expected;
+                    vector<uint8_t> sorted_lsd = expected;
+                    QuickSort::Sort(expected.data(), entry_len, num_entries, bits_begin);
+                    RadixSort::Sort(sorted_1.data(), entry_len, num_entries, bits_begin, 1);
+                    RadixSort::Sort(sorted_4.data(), entry_len, num_entries, bits_begin, 4);
+                    REQUIRE(sorted_1 == expected);
+                    REQUIRE(sorted_4 == expected);
+
+                    vector<uint8_t> tmp(num_entries * entry_len);
+                    bool const have_lsd = RadixSort::SortLSD(
+                        sorted_lsd.data(), tmp.data(), entry_len, num_entries, bits_begin);
+                    REQUIRE(have_lsd == (entry_len >= 8 && entry_len <= 16));
+                    if (have_lsd) {
+                        REQUIRE(sorted_lsd == expected);
+                    }
+                }
+            }
+        }
+    }
+
     SECTION("File disk")
     {
         FileDisk d = FileDisk("test_file.bin");
@@ -755,6 +1111,144 @@ TEST_CASE("Sort on disk")
         }
     }
 
+    SECTION("Lazy Sort Manager double buffered")
+    {
+        // Every bucket fits in half the memory, so the next bucket is sorted
+        // in the background while the current one is read
+        uint32_t const iters = 120000;
+        uint32_t const size = 32;
+        vector<Bits> input;
+        const uint32_t memory_len = 4000000;
+        SortManager manager(
+            memory_len, 16, 4, size, ".", "test-files", 0, 1, strategy_t::quicksort_last);
+        for (uint32_t i = 0; i < iters; i++) {
+            vector<unsigned char> hash_input = intToBytes(i, 4);
+            vector<unsigned char> hash(picosha2::k_digest_size);
+            picosha2::hash256(hash_input.begin(), hash_input.end(), hash.begin(), hash.end());
+            Bits to_write = Bits(hash.data(), size, size * 8);
+            input.emplace_back(to_write);
+            manager.AddToCache(to_write);
+        }
+        manager.FlushCache();
+        uint8_t buf[size];
+        sort(input.begin(), input.end());
+        for (uint32_t i = 0; i < iters; i++) {
+            uint8_t* entry = manager.ReadEntry(i * size);
+            input[i].ToBytes(buf);
+            REQUIRE(memcmp(buf, entry, size) == 0);
+        }
+    }
+
+    SECTION("Lazy Sort Manager parallel radix sort")
+    {
+        uint32_t const iters = 120000;
+        uint32_t const size = 32;
+        vector<Bits> input;
+        const uint32_t memory_len = 1000000;
+        SortManager manager(
+            memory_len, 16, 4, size, ".", "test-files", 0, 1, strategy_t::parallel_radix, 4);
+        for (uint32_t i = 0; i < iters; i++) {
+            vector<unsigned char> hash_input = intToBytes(i, 4);
+            vector<unsigned char> hash(picosha2::k_digest_size);
+            picosha2::hash256(hash_input.begin(), hash_input.end(), hash.begin(), hash.end());
+            Bits to_write = Bits(hash.data(), size, size * 8);
+            input.emplace_back(to_write);
+            manager.AddToCache(to_write);
+        }
+        manager.FlushCache();
+        uint8_t buf[size];
+        sort(input.begin(), input.end());
+        for (uint32_t i = 0; i < iters; i++) {
+            uint8_t* entry = manager.ReadEntry(i * size);
+            input[i].ToBytes(buf);
+            REQUIRE(memcmp(buf, entry, size) == 0);
+        }
+    }
+
+    SECTION("Lazy Sort Manager concurrent writers")
+    {
+        uint32_t const iters = 200000;
+        uint32_t const num_threads = 4;
+        uint32_t const size = 32;
+        // The entries as bytes, which sort like the Bits they'd make
+        vector<vector<uint8_t>> input;
+        const uint32_t memory_len = 1000000;
+        SortManager manager(memory_len, 16, 4, size, ".", "test-files", 0, 1);
+        for (uint32_t i = 0; i < iters; i++) {
+            vector<unsigned char> hash_input = intToBytes(i, 4);
+            vector<unsigned char> hash(picosha2::k_digest_size);
+            picosha2::hash256(hash_input.begin(), hash_input.end(), hash.begin(), hash.end());
+            input.emplace_back(hash.begin(), hash.begin() + size);
+        }
+        vector<thread> threads;
+        for (uint32_t t = 0; t < num_threads; t++) {
+            threads.emplace_back([&, t]() {
+                SortManager::ConcurrentWriter writer(manager);
+                for (uint32_t i = t; i < iters; i += num_threads) {
+                    writer.Add(input[i].data());
+                }
+                writer.Flush();
+            });
+        }
+        for (auto& t : threads) {
+            t.join();
+        }
+        manager.FlushCache();
+        sort(input.begin(), input.end());
+        for (uint32_t i = 0; i < iters; i++) {
+            REQUIRE(memcmp(input[i].data(), manager.ReadEntry(i * size), size) == 0);
+        }
+    }
+
+    SECTION("Lazy Sort Manager bit-packed and compressed")
+    {
+        // Only the first 203 bits of the entries are used
+        uint32_t const iters = 120000;
+        uint32_t const size = 32;
+        uint32_t const bits = 203;
+        // The entries as bytes, which sort like the Bits they'd make
+        vector<vector<uint8_t>> input;
+        for (uint32_t i = 0; i < iters; i++) {
+            vector<unsigned char> hash_input = intToBytes(i, 4);
+            vector<unsigned char> hash(picosha2::k_digest_size);
+            picosha2::hash256(hash_input.begin(), hash_input.end(), hash.begin(), hash.end());
+            hash[bits / 8] &= 0xff00 >> (bits % 8);
+            std::fill(hash.begin() + bits / 8 + 1, hash.end(), 0);
+            input.emplace_back(hash.begin(), hash.begin() + size);
+        }
+        sort(input.begin(), input.end());
+
+        struct format_t {
+            uint32_t packed_bits;
+            bool compress;
+        };
+        for (format_t const format : {format_t{bits, false}, {bits, true}, {0, true}})
+        for (strategy_t const strategy : {strategy_t::uniform, strategy_t::parallel_radix}) {
+            SortManager manager(
+                1000000,
+                16,
+                4,
+                size,
+                ".",
+                "test-files",
+                0,
+                1,
+                strategy,
+                2,
+                file_mode_t::buffered,
+                nullptr,
+                format.packed_bits,
+                format.compress);
+            for (uint32_t i = 0; i < iters; i++) {
+                manager.AddToCache(input[(i * 7919) % iters].data());
+            }
+            manager.FlushCache();
+            for (uint32_t i = 0; i < iters; i++) {
+                REQUIRE(memcmp(input[i].data(), manager.ReadEntry(i * size), size) == 0);
+            }
+        }
+    }
+
     SECTION("Sort in Memory")
     {
         uint32_t iters = 100000;
@@ -785,6 +1279,152 @@ TEST_CASE("Sort on disk")
     }
 }
 
+TEST_CASE("BitPack")
+{
+    std::mt19937_64 rng(15);
+    for (uint32_t const entry_len : {1, 3, 8, 9, 13, 26, 40}) {
+        for (uint32_t const bits : {1u, entry_len * 4 + 1, entry_len * 8 - 3, entry_len * 8}) {
+            // Unused bits are 0
+            uint64_t const num_entries = 1000;
+            vector<uint8_t> entries(num_entries * entry_len);
+            for (uint64_t i = 0; i < num_entries; i++) {
+                uint8_t* entry = entries.data() + i * entry_len;
+                for (uint32_t b = 0; b < entry_len; b++) {
+                    entry[b] = rng();
+                }
+                if (bits % 8) {
+                    entry[bits / 8] &= 0xff00 >> (bits % 8);
+                }
+                std::fill(entry + cdiv(bits, 8), entry + entry_len, 0);
+            }
+
+            vector<uint8_t> packed(BitPack::PackedSize(num_entries, bits) + 7);
+            BitPack::Pack(packed.data(), entries.data(), entry_len, bits, num_entries);
+            REQUIRE(Util::SliceInt64FromBytesFull(packed.data(), bits, std::min(bits, 64u)) ==
+                    Util::SliceInt64FromBytesFull(entries.data() + entry_len, 0, std::min(bits, 64u)));
+
+            // Unpacked in two parts, into a buffer that's just large enough
+            vector<uint8_t> unpacked(num_entries * entry_len, 0xff);
+            uint64_t const first = 333;
+            BitPack::Unpack(unpacked.data(), packed.data(), 0, entry_len, bits, first);
+            BitPack::Unpack(
+                unpacked.data() + first * entry_len,
+                packed.data(),
+                first * bits,
+                entry_len,
+                bits,
+                num_entries - first);
+            REQUIRE(unpacked == entries);
+        }
+    }
+}
+
+TEST_CASE("BucketCodec")
+{
+    std::mt19937_64 rng(16);
+    uint32_t const entry_size = 12;
+    uint32_t const log_num_buckets = 7;
+    uint64_t const bucket = 93;
+    // The bucket bits are in the middle of the entry (begin_bits 20), at the
+    // start, or partly past the used bits
+    for (uint32_t const begin_bits : {20u, 0u, 85u}) {
+        for (uint32_t const entry_bits : {90u, 96u}) {
+            for (uint64_t const num_entries : {1, 2, 1000}) {
+                vector<uint8_t> entries(num_entries * entry_size + 7, 0);
+                for (uint64_t i = 0; i < num_entries; i++) {
+                    uint8_t* entry = entries.data() + i * entry_size;
+                    for (uint32_t bit = 0; bit < entry_bits; bit += 32) {
+                        uint32_t const n = std::min(32u, entry_bits - bit);
+                        // some duplicate keys
+                        uint64_t const value = (i % 10 == 3) ? 0 : rng() & ((1ULL << n) - 1);
+                        Util::SetInt64InBytes(entry, bit, value, n);
+                    }
+                    entry[begin_bits / 8] = 0;
+                    entry[begin_bits / 8 + 1] = 0;
+                    Util::SetInt64InBytes(
+                        entry,
+                        begin_bits,
+                        bucket >> (begin_bits + log_num_buckets > entry_bits ? 2 : 0),
+                        std::min(log_num_buckets, entry_bits - begin_bits));
+                }
+
+                BucketCodec codec(entry_size, entry_bits, begin_bits, log_num_buckets);
+                vector<uint8_t> encoded(codec.MaxSize(num_entries));
+                uint64_t const size = codec.Encode(encoded.data(), entries.data(), num_entries);
+                REQUIRE(size + 7 <= encoded.size());
+                if (num_entries == 1000 && begin_bits + log_num_buckets <= entry_bits) {
+                    // at least the bucket bits are saved
+                    REQUIRE(size * 8 < num_entries * (entry_bits - log_num_buckets));
+                }
+
+                // The entries come back reordered
+                vector<uint8_t> decoded(num_entries * entry_size);
+                codec.Decode(decoded.data(), encoded.data(), num_entries, bucket);
+                std::multiset<vector<uint8_t>> expected, actual;
+                for (uint64_t i = 0; i < num_entries; i++) {
+                    expected.emplace(
+                        entries.begin() + i * entry_size, entries.begin() + (i + 1) * entry_size);
+                    actual.emplace(
+                        decoded.begin() + i * entry_size, decoded.begin() + (i + 1) * entry_size);
+                }
+                REQUIRE(actual == expected);
+            }
+        }
+    }
+}
+
+// Hidden, run with: RunTests "[benchmark]"
+TEST_CASE("Sort benchmark", "[.benchmark]")
+{
+    uint64_t const num_entries = 4000000;
+    std::mt19937_64 rng(11);
+    for (uint32_t const entry_len : {8, 10, 12, 16}) {
+        vector<uint8_t> input(num_entries * entry_len + 7);
+        for (uint8_t& b : input) {
+            b = rng();
+        }
+        FileDisk disk("sort-benchmark.tmp");
+        disk.Write(0, input.data(), num_entries * entry_len);
+        vector<uint8_t> memory(std::max(
+            Util::RoundSize(num_entries) * entry_len, 2 * num_entries * entry_len));
+
+        auto report = [&](const char* name, Timer& t) {
+            std::cout << "entry_len " << entry_len << ": " << name << " ";
+            t.PrintElapsed("time =");
+        };
+        {
+            Timer t;
+            UniformSort::SortToMemory(disk, 0, memory.data(), entry_len, num_entries, 0);
+            report("uniform sort", t);
+        }
+        {
+            Timer t;
+            disk.Read(0, memory.data(), num_entries * entry_len);
+            QuickSort::Sort(memory.data(), entry_len, num_entries, 0);
+            report("quicksort", t);
+        }
+        for (uint32_t const num_threads : {1, 4}) {
+            Timer t;
+            disk.Read(0, memory.data(), num_entries * entry_len);
+            RadixSort::Sort(memory.data(), entry_len, num_entries, 0, num_threads);
+            report(num_threads == 1 ? "MSD radix sort" : "MSD radix sort, 4 threads", t);
+        }
+        {
+            Timer t;
+            disk.Read(0, memory.data(), num_entries * entry_len);
+            RadixSort::SortLSD(
+                memory.data(),
+                memory.data() + num_entries * entry_len,
+                entry_len,
+                num_entries,
+                0);
+            report("LSD radix sort", t);
+        }
+        disk.Close();
+        fs::remove("sort-benchmark.tmp");
+    }
+}
+
 TEST_CASE("bitfield-simple")
 {
     bitfield b(4);
@@ -943,6 +1583,189 @@ TEST_CASE("FileDisk")
     remove("test_file.bin");
 }
 
+TEST_CASE("FileDisk overlapping writes")
+{
+    // Queued io_uring writes must land in order, and be visible to reads.
+    // Direct I/O has to read-modify-write the unaligned ends.
+    enum { stdio, uring, direct };
+    for (int const mode : {stdio, uring, direct}) {
+        URingScope const ring(mode == uring);
+        std::mt19937_64 rng(8);
+        vector<uint8_t> expected(8 * 1024 * 1024, 0);
+        {
+            FileDisk d = FileDisk(
+                "test_file.bin", mode == direct ? file_mode_t::direct : file_mode_t::buffered);
+            d.Write(expected.size() - 1, expected.data(), 1);
+            vector<uint8_t> data;
+            for (int i = 0; i < 300; i++) {
+                // mostly small writes, some larger than what may be in flight
+                uint64_t const length =
+                    1 + rng() % (i % 50 == 0 ? 3 * 1024 * 1024 : 64 * 1024);
+                uint64_t const begin = rng() % (expected.size() - length);
+                data.resize(length);
+                for (uint8_t& b : data) {
+                    b = rng();
+                }
+                d.Write(begin, data.data(), length);
+                memcpy(expected.data() + begin, data.data(), length);
+                if (i % 7 == 0) {
+                    // nothing to write, but it mustn't upset the queued ones
+                    d.Write(rng() % expected.size(), data.data(), 0);
+                }
+                // the caller may reuse its buffer as soon as Write() returns
+                std::fill(data.begin(), data.end(), 0);
+
+                if (i % 30 == 29) {
+                    vector<uint8_t> read(length);
+                    uint64_t const read_begin = rng() % (expected.size() - length);
+                    d.Read(read_begin, read.data(), length);
+                    REQUIRE(memcmp(read.data(), expected.data() + read_begin, length) == 0);
+                }
+            }
+            REQUIRE(d.GetWriteMax() == expected.size());
+        }
+        // everything is on disk once the FileDisk is closed
+        std::ifstream f("test_file.bin", std::ios::binary);
+        vector<uint8_t> on_disk(
+            (std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+        REQUIRE(on_disk == expected);
+    }
+    remove("test_file.bin");
+}
+
+TEST_CASE("FileDisk in memory")
+{
+    fs::remove("test_file.bin");
+    std::mt19937_64 rng(13);
+    FileDisk d = FileDisk("test_file.bin", file_mode_t::memory);
+    // writes across chunks, and past the end
+    vector<uint8_t> expected(memory_chunk * 2 + 100, 0);
+    vector<uint8_t> data(memory_chunk / 2);
+    for (uint8_t& b : data) {
+        b = rng();
+    }
+    for (uint64_t const begin : vector<uint64_t>{memory_chunk * 2 - 10, memory_chunk - 1000, 17}) {
+        uint64_t const length = std::min<uint64_t>(data.size(), expected.size() - begin);
+        d.Write(begin, data.data(), length);
+        memcpy(expected.data() + begin, data.data(), length);
+    }
+    REQUIRE(d.GetWriteMax() == expected.size());
+    // closing doesn't drop the data
+    d.Close();
+    vector<uint8_t> read(expected.size());
+    d.Read(0, read.data(), read.size());
+    REQUIRE(read == expected);
+
+    // truncated data reads as zeros once the file grows again
+    d.Truncate(memory_chunk + 5);
+    d.Write(memory_chunk + 500, data.data(), 1);
+    d.Read(memory_chunk, read.data(), 501);
+    REQUIRE(memcmp(read.data(), expected.data() + memory_chunk, 5) == 0);
+    for (int i = 5; i < 500; i++) {
+        REQUIRE(read[i] == 0);
+    }
+    REQUIRE(read[500] == data[0]);
+    REQUIRE_THROWS_AS(d.Read(memory_chunk, read.data(), 502), InvalidStateException);
+
+    // nothing ever touched the file system
+    REQUIRE(!fs::exists("test_file.bin"));
+    d.Remove();
+}
+
+TEST_CASE("FileDisk with a memory budget")
+{
+    std::mt19937_64 rng(14);
+    MemoryBudget budget(tier_chunk * 3);
+    vector<uint8_t> data(tier_chunk * 5);
+    for (uint8_t& b : data) {
+        b = rng();
+    }
+    {
+        // The first file gets two chunks, the second one what's left
+        FileDisk a = FileDisk("test_file.bin", file_mode_t::buffered, &budget);
+        FileDisk b = FileDisk("test_file2.bin", file_mode_t::buffered, &budget);
+        a.Write(0, data.data(), tier_chunk + 10);
+        REQUIRE(budget.Available() == tier_chunk);
+        b.Write(0, data.data(), tier_chunk);
+        REQUIRE(budget.Available() == 0);
+        REQUIRE(fs::file_size("test_file2.bin") == 0);
+
+        // Writes across the end of the in-memory part, with the rest of the
+        // data spilling to the file
+        a.Write(tier_chunk + 10, data.data() + tier_chunk + 10, tier_chunk * 3 - 10);
+        b.Write(tier_chunk, data.data() + tier_chunk, tier_chunk * 4);
+        a.Close();
+        b.Close();
+        REQUIRE(fs::file_size("test_file.bin") == tier_chunk * 2);
+        REQUIRE(fs::file_size("test_file2.bin") == tier_chunk * 4);
+        REQUIRE(a.GetWriteMax() == tier_chunk * 4);
+        REQUIRE(b.GetWriteMax() == tier_chunk * 5);
+
+        vector<uint8_t> read(data.size());
+        a.Read(0, read.data(), tier_chunk * 4);
+        REQUIRE(memcmp(read.data(), data.data(), tier_chunk * 4) == 0);
+        for (uint64_t const begin : vector<uint64_t>{0, tier_chunk - 7, tier_chunk * 3 - 1000}) {
+            b.Read(begin, read.data(), 2000);
+            REQUIRE(memcmp(read.data(), data.data() + begin, 2000) == 0);
+        }
+
+        // Truncating into the in-memory part gives chunks back, and the file
+        // can be used again
+        a.Truncate(tier_chunk / 2);
+        REQUIRE(budget.Available() == tier_chunk);
+        REQUIRE(fs::file_size("test_file.bin") == 0);
+        a.Write(0, data.data(), tier_chunk * 2);
+        REQUIRE(budget.Available() == 0);
+        REQUIRE(fs::file_size("test_file.bin") == 0);
+        a.Read(0, read.data(), tier_chunk * 2);
+        REQUIRE(memcmp(read.data(), data.data(), tier_chunk * 2) == 0);
+
+        b.Remove();
+        REQUIRE(budget.Available() == tier_chunk);
+        REQUIRE(!fs::exists("test_file2.bin"));
+
+        // With the file gone, truncating within the budget only frees memory
+        b.Write(0, data.data(), 100);
+        b.Remove();
+        REQUIRE_NOTHROW(b.Truncate(0));
+        REQUIRE(!fs::exists("test_file2.bin"));
+    }
+    REQUIRE(budget.Available() == tier_chunk * 3);
+    fs::remove("test_file.bin");
+}
+
+TEST_CASE("BufferedDisk direct I/O")
+{
+    // Sequential writes of odd sized entries, which only occasionally line up
+    // with the blocks
+    uint32_t const entry_size = 13;
+    uint64_t const num_entries = 300000;
+    {
+        FileDisk d = FileDisk("test_file.bin", file_mode_t::direct);
+        BufferedDisk bd(&d, num_entries * entry_size);
+        uint8_t entry[entry_size];
+        for (uint64_t i = 0; i < num_entries; i++) {
+            memset(entry, i % 251, entry_size);
+            memcpy(entry, &i, sizeof(i));
+            bd.Write(i * entry_size, entry, entry_size);
+        }
+        bd.FlushCache();
+        REQUIRE(d.GetWriteMax() == num_entries * entry_size);
+
+        // forward reads, skipping some entries
+        for (uint64_t i = 0; i < num_entries; i += 1 + i % 3) {
+            uint8_t const* ptr = bd.Read(i * entry_size, entry_size);
+            uint64_t value;
+            memcpy(&value, ptr, sizeof(value));
+            REQUIRE(value == i);
+            REQUIRE(ptr[entry_size - 1] == i % 251);
+        }
+    }
+    // the padding of the last block is gone once the file is closed
+    REQUIRE(fs::file_size("test_file.bin") == num_entries * entry_size);
+    remove("test_file.bin");
+}
+
 TEST_CASE("BufferedDisk")
 {
     FileDisk d = FileDisk("test_file.bin");
@@ -1025,3 +1848,455 @@ TEST_CASE("FilteredDisk")
 */
     remove("test_file.bin");
 }
+
+TEST_CASE("StripeScheduler")
+{
+    uint64_t const num_stripes = 500;
+    uint32_t const num_threads = 4;
+    // Threads either take turns, or claim the next stripe as they go
+    for (bool const dynamic : {false, true}) {
+        StripeScheduler scheduler(num_stripes, num_threads, 2 * num_threads, dynamic);
+
+        std::mutex m;
+        std::vector<int> committed(num_stripes, 0);
+        std::vector<uint64_t> left_begin(num_stripes);
+        std::vector<uint64_t> right_begin(num_stripes);
+        std::atomic<uint64_t> in_flight{0};
+        std::atomic<uint64_t> max_in_flight{0};
+        // Catch's assertions aren't thread safe
+        std::atomic<bool> wrong_thread{false};
+
+        auto worker = [&](uint32_t const index) {
+            std::mt19937 rng(index);
+            std::vector<StripeScheduler::ready_t> ready;
+            uint64_t stripe;
+            while (scheduler.Claim(index, stripe)) {
+                if (!dynamic && stripe % num_threads != index) {
+                    wrong_thread = true;
+                }
+                if (stripe % 50 == 0) {
+                    scheduler.WaitForComputed(stripe);
+                }
+                scheduler.Started(stripe);
+                uint64_t const n = ++in_flight;
+                max_in_flight = std::max<uint64_t>(max_in_flight, n);
+                std::this_thread::sleep_for(std::chrono::microseconds(rng() % 200));
+                --in_flight;
+
+                ready.clear();
+                scheduler.Computed(stripe, stripe % 7, stripe % 5, ready);
+                for (auto const& r : ready) {
+                    {
+                        std::lock_guard<std::mutex> l(m);
+                        committed[r.stripe]++;
+                        left_begin[r.stripe] = r.left_begin;
+                        right_begin[r.stripe] = r.right_begin;
+                    }
+                    scheduler.Committed(r.stripe);
+                }
+            }
+        };
+        std::vector<std::thread> threads;
+        for (uint32_t i = 0; i < num_threads; i++) {
+            threads.emplace_back(worker, i);
+        }
+        for (auto& t : threads) {
+            t.join();
+        }
+
+        uint64_t left = 0;
+        uint64_t right = 0;
+        for (uint64_t stripe = 0; stripe < num_stripes; stripe++) {
+            REQUIRE(committed[stripe] == 1);
+            REQUIRE(left_begin[stripe] == left);
+            REQUIRE(right_begin[stripe] == right);
+            left += stripe % 7;
+            right += stripe % 5;
+        }
+        REQUIRE(scheduler.LeftTotal() == left);
+        REQUIRE(scheduler.RightTotal() == right);
+        REQUIRE(max_in_flight <= num_threads);
+        REQUIRE(!wrong_thread);
+        uint64_t claimed = 0;
+        for (uint32_t i = 0; i < num_threads; i++) {
+            claimed += scheduler.Stripes(i);
+            REQUIRE(scheduler.Utilization(i) <= 1.0);
+        }
+        REQUIRE(claimed == num_stripes);
+    }
+}
+
+TEST_CASE("ScanTableParallel")
+{
+    uint32_t const entry_size = 3;
+    int64_t const chunk_entries = 64;
+    // not a whole number of chunks
+    int64_t const table_size = 1000;
+    FileDisk d("test_scan.bin");
+    for (int64_t i = 0; i < table_size; i++) {
+        uint8_t entry[3] = {uint8_t(i >> 16), uint8_t(i >> 8), uint8_t(i)};
+        d.Write(i * entry_size, entry, entry_size);
+    }
+
+    for (uint8_t const num_threads : {1, 4}) {
+        bitfield seen(table_size);
+        std::atomic<int64_t> chunks{0};
+        // Catch's assertions aren't thread safe
+        std::atomic<bool> wrong_entry{false};
+        ScanTableParallel(
+            d,
+            table_size,
+            entry_size,
+            chunk_entries,
+            num_threads,
+            true,
+            [&](uint32_t const thread_index, uint8_t* entries, int64_t begin, int64_t end) {
+                if (thread_index >= num_threads || begin % chunk_entries != 0) {
+                    wrong_entry = true;
+                }
+                chunks++;
+                for (int64_t i = begin; i < end; i++) {
+                    uint8_t* entry = entries + (i - begin) * entry_size;
+                    if (Util::SliceInt64FromBytes(entry, 8, 16) != uint64_t(i & 0xffff)) {
+                        wrong_entry = true;
+                    }
+                    seen.set_concurrent(i);
+                    // counts how often the table has been scanned
+                    entry[0]++;
+                }
+            });
+        REQUIRE(!wrong_entry);
+        REQUIRE(chunks == cdiv(table_size, chunk_entries));
+        REQUIRE(seen.count(0, table_size) == table_size);
+    }
+
+    // both scans wrote their changes back
+    for (int64_t i = 0; i < table_size; i++) {
+        uint8_t entry[3];
+        d.Read(i * entry_size, entry, entry_size);
+        REQUIRE(entry[0] == uint8_t((i >> 16) + 2));
+    }
+    remove("test_scan.bin");
+}
+
+TEST_CASE("ParkWriter")
+{
+    uint8_t const k = 20;
+    uint8_t const table_index = 2;
+    uint32_t const park_size = EntrySizes::CalculateParkSize(k, table_index);
+    uint64_t const num_parks = 50;
+    uint64_t const table_start = 100;
+    std::mt19937 rng(7);
+
+    std::vector<std::vector<uint8_t>> deltas(num_parks);
+    std::vector<std::vector<uint64_t>> stubs(num_parks);
+    for (uint64_t p = 0; p < num_parks; p++) {
+        // the last park is a short one
+        uint32_t const n = p + 1 == num_parks ? 100 : kEntriesPerPark - 1;
+        for (uint32_t i = 0; i < n; i++) {
+            deltas[p].push_back(rng() % 4);
+            stubs[p].push_back(rng() & ((1U << (k - kStubMinusBits)) - 1));
+        }
+    }
+
+    uint64_t const buffer_size = EntrySizes::CalculateLinePointSize(k) +
+                                 EntrySizes::CalculateStubsSize(k) + 2 +
+                                 EntrySizes::CalculateMaxDeltasSize(k, 1);
+    std::unique_ptr<uint8_t[]> buffer(new uint8_t[buffer_size]);
+    FileDisk expected("test_parks_expected.bin");
+    for (uint64_t p = 0; p < num_parks; p++) {
+        WriteParkToFile(
+            expected,
+            table_start,
+            p,
+            park_size,
+            p * 1000,
+            deltas[p],
+            stubs[p],
+            k,
+            table_index,
+            buffer.get(),
+            buffer_size);
+    }
+
+    FileDisk actual("test_parks.bin");
+    {
+        // a small buffer, so most parks go around it
+        RegionWriter out(actual, 4 * park_size);
+        ParkWriter writer(out, out.AddRegion(table_start), k, 3);
+        // in reverse, the order doesn't matter
+        for (uint64_t p = num_parks; p-- > 0;) {
+            writer.Add(table_start, p, park_size, p * 1000, deltas[p], stubs[p], table_index);
+        }
+        writer.Flush();
+        out.Flush();
+    }
+
+    uint64_t const size = num_parks * park_size;
+    std::vector<uint8_t> expected_bytes(size);
+    std::vector<uint8_t> actual_bytes(size);
+    expected.Read(table_start, expected_bytes.data(), size);
+    actual.Read(table_start, actual_bytes.data(), size);
+    REQUIRE(expected_bytes == actual_bytes);
+
+    remove("test_parks_expected.bin");
+    remove("test_parks.bin");
+}
+
+TEST_CASE("SPSCQueue")
+{
+    SECTION("in order")
+    {
+        SPSCQueue<std::vector<uint64_t>> queue(3);
+        uint64_t const n = 100000;
+        std::thread producer([&]() {
+            std::vector<uint64_t> batch;
+            for (uint64_t i = 0; i < n; i++) {
+                batch.push_back(i);
+                if (batch.size() == 37 || i + 1 == n) {
+                    queue.Push(std::move(batch));
+                    batch.clear();
+                }
+            }
+            queue.Close();
+        });
+        uint64_t expected = 0;
+        bool in_order = true;
+        std::vector<uint64_t> batch;
+        while (queue.Pop(batch)) {
+            for (uint64_t const v : batch) {
+                in_order = in_order && v == expected;
+                expected++;
+            }
+        }
+        producer.join();
+        REQUIRE(in_order);
+        REQUIRE(expected == n);
+    }
+
+    SECTION("cancel")
+    {
+        SPSCQueue<int> queue(2);
+        REQUIRE(queue.Push(1));
+        REQUIRE(queue.Push(2));
+        // full, the push waits until it's cancelled
+        std::thread canceller([&]() {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            queue.Cancel();
+        });
+        REQUIRE(!queue.Push(3));
+        canceller.join();
+        int v;
+        REQUIRE(!queue.Pop(v));
+    }
+}
+
+TEST_CASE("ThreadPool")
+{
+    ThreadPool pool;
+
+    SECTION("submit")
+    {
+        std::future<int> a = pool.Submit([]() { return 6 * 7; });
+        std::future<void> b = pool.Submit([]() { throw InvalidStateException("failed"); });
+        REQUIRE(a.get() == 42);
+        REQUIRE_THROWS_AS(b.get(), InvalidStateException);
+    }
+
+    SECTION("concurrent tasks wait for each other")
+    {
+        // Every task waits for all of them to have started, so they only
+        // finish if they all run at the same time
+        uint32_t const n = 8;
+        std::atomic<uint32_t> started{0};
+        pool.RunConcurrently(n, [&](uint32_t) {
+            started++;
+            while (started < n) {
+                std::this_thread::yield();
+            }
+        });
+        REQUIRE(started == n);
+        // the calling thread runs one of them
+        REQUIRE(pool.NumThreads() == n - 1);
+
+        // the threads are reused. A thread may not be idle again yet when
+        // the next tasks are submitted, so there may be a few more
+        for (int i = 0; i < 10; i++) {
+            pool.RunConcurrently(n, [](uint32_t) {});
+        }
+        REQUIRE(pool.NumThreads() <= 2 * (n - 1));
+    }
+
+    SECTION("parallel for")
+    {
+        std::vector<std::atomic<uint32_t>> counts(10007);
+        pool.ParallelFor(counts.size(), 100, 4, [&](uint64_t const begin, uint64_t const end) {
+            for (uint64_t i = begin; i < end; i++) {
+                counts[i]++;
+            }
+        });
+        bool once = true;
+        for (auto const &c : counts) {
+            once = once && c == 1;
+        }
+        REQUIRE(once);
+    }
+}
+
+TEST_CASE("TaskQueue")
+{
+    SECTION("runs all tasks")
+    {
+        std::vector<uint64_t> done(1000, 0);
+        {
+            TaskQueue tasks(4, 8);
+            for (uint64_t i = 0; i < done.size(); i++) {
+                tasks.Add([&done, i]() { done[i] = i + 1; });
+            }
+            tasks.Wait();
+            for (uint64_t i = 0; i < done.size(); i++) {
+                REQUIRE(done[i] == i + 1);
+            }
+            tasks.Add([&done]() { done[0] = 0; });
+        }
+        // the destructor runs what's still queued
+        REQUIRE(done[0] == 0);
+    }
+
+    SECTION("exception")
+    {
+        TaskQueue tasks(2, 2);
+        tasks.Add([]() { throw InvalidStateException("task failed"); });
+        REQUIRE_THROWS_AS(tasks.Wait(), InvalidStateException);
+    }
+}
+
+TEST_CASE("CopyPlotFile")
+{
+    std::mt19937_64 rng(5);
+    std::vector<uint8_t> data(3 * 1024 * 1024 + 17);
+    for (uint8_t &b : data) {
+        b = rng();
+    }
+    {
+        std::ofstream out("test_copy_from.bin", std::ios::binary);
+        out.write(reinterpret_cast<const char *>(data.data()), data.size());
+    }
+
+    auto check = [&]() {
+        std::ifstream in("test_copy_to.bin", std::ios::binary);
+        std::vector<uint8_t> copied(
+            (std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        REQUIRE(copied == data);
+    };
+
+    std::error_code ec;
+    SECTION("unlimited")
+    {
+        CopyPlotFile("test_copy_from.bin", "test_copy_to.bin", 0, ec);
+        REQUIRE(!ec);
+        check();
+    }
+    SECTION("bandwidth limit")
+    {
+        CopyPlotFile("test_copy_from.bin", "test_copy_to.bin", 8 * 1024 * 1024, ec);
+        REQUIRE(!ec);
+        check();
+
+        // the kernel may clone the file, but streaming it is always throttled
+        auto const start = std::chrono::steady_clock::now();
+        StreamFile("test_copy_from.bin", "test_copy_to.bin", 8 * 1024 * 1024, ec);
+        REQUIRE(!ec);
+        check();
+        REQUIRE(std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(250));
+    }
+    SECTION("streamed")
+    {
+        StreamFile("test_copy_from.bin", "test_copy_to.bin", 0, ec);
+        REQUIRE(!ec);
+        check();
+    }
+    SECTION("missing file")
+    {
+        CopyPlotFile("test_copy_missing.bin", "test_copy_to.bin", 0, ec);
+        REQUIRE(ec);
+    }
+    remove("test_copy_from.bin");
+    remove("test_copy_to.bin");
+}
+
+TEST_CASE("PlotFinalizer")
+{
+    fs::create_directory("finalizer-final");
+    auto const start = std::chrono::steady_clock::now();
+    {
+        // The copy fails, and would be retried in five minutes, but the
+        // destructor gives up instead
+        PlotFinalizer finalizer(
+            "test_copy_missing.bin",
+            "finalizer-final/test_copy_missing.bin.2.tmp",
+            "finalizer-final/test_copy_missing.bin",
+            0);
+    }
+    REQUIRE(std::chrono::steady_clock::now() - start < std::chrono::minutes(1));
+    REQUIRE(!fs::exists("finalizer-final/test_copy_missing.bin"));
+    REQUIRE(fs::remove_all("finalizer-final") == 1);
+}
+
+TEST_CASE("RegionWriter")
+{
+    std::mt19937_64 rng(11);
+    uint64_t const buffer_size = 3 * direct_alignment;
+    uint64_t const region_size = 50000;
+    std::vector<uint8_t> expected(3 * region_size, 0);
+    uint64_t file_size = 0;
+
+    FileDisk d("test_regions.bin");
+    {
+        RegionWriter out(d, buffer_size);
+        std::vector<uint64_t> cursor;
+        for (uint64_t r = 0; r < 3; r++) {
+            // the regions don't start on a block boundary
+            cursor.push_back(r * region_size + 100);
+            REQUIRE(out.AddRegion(cursor.back()) == r);
+        }
+        std::vector<uint8_t> data(2 * buffer_size);
+        for (int i = 0; i < 2000; i++) {
+            uint64_t const r = rng() % 3;
+            uint64_t length = rng() % 40 + 1;
+            uint64_t begin = cursor[r];
+            switch (rng() % 16) {
+                case 0:
+                    // skip ahead
+                    begin += rng() % 100;
+                    break;
+                case 1:
+                    // back a little
+                    begin -= std::min<uint64_t>(begin - r * region_size, rng() % 300);
+                    break;
+                case 2:
+                    // larger than the buffer
+                    length = buffer_size + rng() % buffer_size;
+                    break;
+            }
+            if (begin + length > (r + 1) * region_size) {
+                continue;
+            }
+            for (uint64_t j = 0; j < length; j++) {
+                data[j] = rng() | 1;
+            }
+            out.Write(r, begin, data.data(), length);
+            memcpy(expected.data() + begin, data.data(), length);
+            cursor[r] = std::max(cursor[r], begin + length);
+            file_size = std::max(file_size, begin + length);
+        }
+        out.Flush();
+    }
+
+    std::vector<uint8_t> actual(expected.size(), 0);
+    d.Read(0, actual.data(), file_size);
+    // the gaps that were skipped may have been filled with zeros, or not
+    // written at all
+    REQUIRE(actual == expected);
+    remove("test_regions.bin");
+}
@@ -99,6 +99,40 @@ class TestPythonBindings(unittest.TestCase):
         )
         print(f"\nPlotfile asserted sha256: {plot_hash}\n")
 
+    def test_background_copy(self):
+        final_dir = Path("bg_copy_final")
+        final_dir.mkdir(exist_ok=True)
+        plot_id: bytes = bytes([i for i in range(64, 96)])
+        pl = DiskPlotter()
+        pl.create_plot_disk(
+            ".",
+            ".",
+            str(final_dir),
+            "bgplot.dat",
+            18,
+            bytes([1, 2, 3, 4, 5]),
+            plot_id,
+            11,
+            0,
+            4000,
+            2,
+            False,
+            background_copy=True,
+            copy_megabytes_per_second=64,
+        )
+        assert pl.pending_copies() <= 1
+        pl.wait_for_copies()
+        assert pl.pending_copies() == 0
+        assert not Path("bgplot.dat.2.tmp").exists()
+        pl = None
+
+        pr = DiskProver(str(final_dir / "bgplot.dat"))
+        assert pr.get_size() == 18
+        assert pr.get_id() == plot_id
+        pr = None
+        (final_dir / "bgplot.dat").unlink()
+        final_dir.rmdir()
+
     def test_faulty_plot_doesnt_crash(self):
         if Path("myplot.dat").exists():
             Path("myplot.dat").unlink()